@@ -5,10 +5,210 @@
 
 #include "buddy.h"
 #include "poptrie.h"
+#include "region.h"
 #include <stdlib.h>
 #include <string.h>
 
-#define BUDDY_EOL 0xffffffffUL
+/* Flag of the tag of a free block */
+#define BUDDY_FREE 0x80000000UL
+
+/*
+ * Buddy system with the free bitmaps.  The head block of each allocated or
+ * free block is tagged with its level in the blocks array, so that a block is
+ * freed and merged with its buddy without any search.  The free blocks of each
+ * level are kept in a layered bitmap, and the summary bitmap flags the levels
+ * having free blocks.  An allocation takes the first free block of the lowest
+ * level large enough, and splits it down to the requested level.  Both run in
+ * time bounded by the number of the levels.
+ */
+
+/*
+ * Tag of a block
+ */
+static __inline__ u32 *
+_tag(struct buddy *bs, u32 off)
+{
+    return (u32 *)((u8 *)bs->blocks + (size_t)bs->bsz * off);
+}
+
+/*
+ * Set up the layers of the free bitmaps of the levels for (2**sz) blocks on
+ * zeroed words
+ */
+static int
+_alloc_bitmaps(int sz, int level, struct buddy_bitmap **bitmapsp, u64 **wordsp)
+{
+    struct buddy_bitmap *bitmaps;
+    u64 *words;
+    size_t nw;
+    size_t n;
+    size_t w;
+    int lv;
+    int k;
+
+    /* Count the words */
+    nw = 0;
+    for ( lv = 0; lv < level; lv++ ) {
+        n = lv < sz ? (size_t)1 << (sz - lv) : 1;
+        do {
+            w = (n + 63) / 64;
+            nw += w;
+            n = w;
+        } while ( w > 1 );
+    }
+
+    bitmaps = malloc(sizeof(struct buddy_bitmap) * level);
+    if ( NULL == bitmaps ) {
+        return -1;
+    }
+    words = malloc(sizeof(u64) * nw);
+    if ( NULL == words ) {
+        free(bitmaps);
+        return -1;
+    }
+    (void)memset(words, 0, sizeof(u64) * nw);
+
+    nw = 0;
+    for ( lv = 0; lv < level; lv++ ) {
+        n = lv < sz ? (size_t)1 << (sz - lv) : 1;
+        k = 0;
+        do {
+            w = (n + 63) / 64;
+            bitmaps[lv].layers[k++] = words + nw;
+            nw += w;
+            n = w;
+        } while ( w > 1 );
+        bitmaps[lv].nlayers = k;
+    }
+    *bitmapsp = bitmaps;
+    *wordsp = words;
+
+    return 0;
+}
+
+/*
+ * Flag the ith block of the level as free in the bitmap
+ */
+static void
+_bitmap_set(struct buddy *bs, int lv, u32 i)
+{
+    struct buddy_bitmap *bm;
+    u64 w;
+    int k;
+
+    bm = &bs->bitmaps[lv];
+    for ( k = 0; k < bm->nlayers; k++ ) {
+        w = bm->layers[k][i >> 6];
+        bm->layers[k][i >> 6] = w | (1ULL << (i & 63));
+        if ( w ) {
+            /* The upper layers are already flagged */
+            return;
+        }
+        i >>= 6;
+    }
+    bs->summary |= 1ULL << lv;
+}
+
+/*
+ * Unflag the ith block of the level in the bitmap
+ */
+static void
+_bitmap_clear(struct buddy *bs, int lv, u32 i)
+{
+    struct buddy_bitmap *bm;
+    int k;
+
+    bm = &bs->bitmaps[lv];
+    for ( k = 0; k < bm->nlayers; k++ ) {
+        bm->layers[k][i >> 6] &= ~(1ULL << (i & 63));
+        if ( bm->layers[k][i >> 6] ) {
+            return;
+        }
+        i >>= 6;
+    }
+    bs->summary &= ~(1ULL << lv);
+}
+
+/*
+ * Find the first free block of a level having any
+ */
+static u32
+_bitmap_first(struct buddy *bs, int lv)
+{
+    struct buddy_bitmap *bm;
+    u32 i;
+    int k;
+
+    bm = &bs->bitmaps[lv];
+    i = 0;
+    for ( k = bm->nlayers - 1; k >= 0; k-- ) {
+        i = (i << 6) + __builtin_ctzll(bm->layers[k][i]);
+    }
+
+    return i;
+}
+
+/*
+ * Rebuild the upper layers of the bitmaps and the summary from the bottom
+ * layers
+ */
+static void
+_bitmap_fill(struct buddy *bs, int sz)
+{
+    struct buddy_bitmap *bm;
+    size_t n;
+    size_t j;
+    int lv;
+    int k;
+
+    bs->summary = 0;
+    for ( lv = 0; lv < bs->level; lv++ ) {
+        bm = &bs->bitmaps[lv];
+        n = lv < sz ? (size_t)1 << (sz - lv) : 1;
+        for ( k = 1; k < bm->nlayers; k++ ) {
+            n = (n + 63) / 64;
+            for ( j = 0; j < n; j++ ) {
+                if ( bm->layers[k - 1][j] ) {
+                    bm->layers[k][j >> 6] |= 1ULL << (j & 63);
+                }
+            }
+        }
+        if ( bm->layers[bm->nlayers - 1][0] ) {
+            bs->summary |= 1ULL << lv;
+        }
+    }
+}
+
+/*
+ * Append a free block to the level
+ */
+static __inline__ void
+_push(struct buddy *bs, u32 off, int lv)
+{
+    *_tag(bs, off) = BUDDY_FREE | lv;
+    _bitmap_set(bs, lv, off >> lv);
+}
+
+/*
+ * Return a block of the level, merging it with its buddy while the buddy is
+ * free at the same level
+ */
+static void
+_merge(struct buddy *bs, u32 off, int lv)
+{
+    u32 p;
+
+    for ( ; lv + 1 < bs->level; lv++ ) {
+        p = off ^ (1U << lv);
+        if ( *_tag(bs, p) != (BUDDY_FREE | lv) ) {
+            break;
+        }
+        _bitmap_clear(bs, lv, p >> lv);
+        off &= ~(1U << lv);
+    }
+    _push(bs, off, lv);
+}
+
 
 /*
  * Initialize buddy system
@@ -16,114 +216,294 @@
 int
 buddy_init(struct buddy *bs, int sz, int level, int bsz)
 {
-    int i;
+    return buddy_init2(bs, sz, level, bsz, 0, sz);
+}
+
+/*
+ * Initialize buddy system with the memory backing flags for the blocks.  The
+ * address space for (2**maxsz) blocks is reserved for buddy_grow().
+ */
+int
+buddy_init2(struct buddy *bs, int sz, int level, int bsz, int flags,
+            int maxsz)
+{
+    u32 i;
+    int lv;
     u8 *b;
-    u32 *buddy;
-    void *blocks;
-    u64 off;
 
-    /* Block size must be >= 32 bits */
-    if ( bsz < 4 ) {
+    /* Block size must be >= 32 bits, and the levels fit in the summary */
+    if ( bsz < 4 || level < 1 || level > 64 ) {
         return -1;
     }
 
-    /* Heads */
-    buddy = malloc(sizeof(u32) * level);
-    if ( NULL == buddy ) {
+    /* Free bitmaps */
+    if ( _alloc_bitmaps(sz, level, &bs->bitmaps, &bs->words) < 0 ) {
         return -1;
     }
     /* Pre allocated nodes */
-    blocks = malloc(bsz * (1 << sz));
-    if ( NULL == blocks ) {
-        free(buddy);
+    if ( maxsz < sz ) {
+        maxsz = sz;
+    }
+    if ( region_reserve(&bs->region, (size_t)bsz << sz, (size_t)bsz << maxsz,
+                        flags, -1) < 0 ) {
+        free(bs->words);
+        free(bs->bitmaps);
         return -1;
     }
     /* Bitmap */
     b = malloc(((1 << (sz)) + 7) / 8);
     if ( NULL == b ) {
-        free(blocks);
-        free(buddy);
+        region_free(&bs->region);
+        free(bs->words);
+        free(bs->bitmaps);
         return -1;
     }
     (void)memset(b, 0, ((1 << (sz)) + 7) / 8);
 
-    /* Initialize buddy system */
-    for ( i = 0; i < level; i++ ) {
-        buddy[i] = BUDDY_EOL;
-    }
-    if ( sz < level ) {
-        buddy[sz] = 0;
-        *(u32 *)blocks = 0;      /* Terminate */
-    } else {
-        buddy[level - 1] = 0;
-        for ( i = 0; i < (1 << (sz - level + 1)); i++ ) {
-            off = bsz * (i * (1 << (level - 1)));
-            if ( i == (1 << (sz - level + 1)) - 1 ) {
-                *(u32 *)(blocks + off) = BUDDY_EOL;
-            } else {
-                *(u32 *)(blocks + off)
-                    = (u32)((i + 1) * (1 << (level - 1)));
-            }
-        }
-    }
-
     /* Set */
     bs->sz = sz;
+    bs->maxsz = maxsz;
+    bs->used = 0;
     bs->bsz = bsz;
     bs->level = level;
-    bs->buddy = buddy;
-    bs->blocks = blocks;
+    bs->summary = 0;
+    bs->blocks = bs->region.ptr;
     bs->b = b;
+    bs->base = 0;
+
+    /* Initialize buddy system with the largest blocks */
+    lv = sz < level ? sz : level - 1;
+    for ( i = 0; i < (1U << sz); i += 1U << lv ) {
+        _push(bs, i, lv);
+    }
 
     return 0;
 }
 
 /*
- * Release the buddy system
+ * Double the number of blocks in place.  The new half is freed as the largest
+ * blocks, and merged with the old half if possible.
  */
-void
-buddy_release(struct buddy *bs)
+int
+buddy_grow(struct buddy *bs)
 {
-    free(bs->buddy);
-    free(bs->blocks);
-    free(bs->b);
+    struct buddy_bitmap *bitmaps;
+    u64 *words;
+    u8 *b;
+    int level;
+    int lv;
+    u32 i;
+
+    if ( bs->sz >= bs->maxsz ) {
+        return -1;
+    }
+    if ( region_grow(&bs->region, (size_t)bs->bsz << (bs->sz + 1)) < 0 ) {
+        return -1;
+    }
+
+    /* One more level to keep the largest block half of the whole */
+    level = bs->level == bs->sz ? bs->level + 1 : bs->level;
+    if ( level > 64 ) {
+        return -1;
+    }
+
+    /* Free bitmaps; the bottom layers are carried over */
+    if ( _alloc_bitmaps(bs->sz + 1, level, &bitmaps, &words) < 0 ) {
+        return -1;
+    }
+    for ( lv = 0; lv < bs->level; lv++ ) {
+        memcpy(bitmaps[lv].layers[0], bs->bitmaps[lv].layers[0],
+               sizeof(u64) * (lv < bs->sz
+                              ? ((1ULL << (bs->sz - lv)) + 63) / 64 : 1));
+    }
+
+    /* Bitmap */
+    b = realloc(bs->b, ((1 << (bs->sz + 1)) + 7) / 8);
+    if ( NULL == b ) {
+        free(words);
+        free(bitmaps);
+        return -1;
+    }
+    (void)memset(b + ((1 << bs->sz) + 7) / 8, 0,
+                 ((1 << (bs->sz + 1)) + 7) / 8 - ((1 << bs->sz) + 7) / 8);
+    bs->b = b;
+
+    free(bs->words);
+    free(bs->bitmaps);
+    bs->bitmaps = bitmaps;
+    bs->words = words;
+    bs->level = level;
+    _bitmap_fill(bs, bs->sz + 1);
+
+    /* Free the new blocks at the largest level */
+    bs->sz++;
+    lv = bs->sz - 1 < bs->level - 1 ? bs->sz - 1 : bs->level - 1;
+    for ( i = 1U << (bs->sz - 1); i < (1U << bs->sz); i += 1U << lv ) {
+        _merge(bs, i, lv);
+    }
+
+    return 0;
 }
 
 /*
- * Split the block at the level n
+ * Rebuild the free bitmaps from the tags of the blocks, e.g., loaded from a
+ * snapshot
  */
-static int
-_split_buddy(struct buddy *bs, int lv)
+int
+buddy_restore(struct buddy *bs)
 {
-    int ret;
-    u32 next;
+    struct buddy_bitmap *bm;
+    u32 tag;
+    u32 i;
+    int lv;
+    int k;
+    size_t n;
+
+    /* Clear the bitmaps */
+    for ( lv = 0; lv < bs->level; lv++ ) {
+        bm = &bs->bitmaps[lv];
+        n = lv < bs->sz ? (size_t)1 << (bs->sz - lv) : 1;
+        for ( k = 0; k < bm->nlayers; k++ ) {
+            n = (n + 63) / 64;
+            (void)memset(bm->layers[k], 0, sizeof(u64) * n);
+        }
+    }
+    bs->summary = 0;
+
+    /* Walk the blocks from the head */
+    for ( i = 0; i < (1U << bs->sz); i += 1U << lv ) {
+        tag = *_tag(bs, i);
+        lv = tag & ~BUDDY_FREE;
+        if ( lv >= bs->level || (i & ((1U << lv) - 1))
+             || i + (1U << lv) > (1U << bs->sz) ) {
+            /* Broken */
+            return -1;
+        }
+        if ( tag & BUDDY_FREE ) {
+            _bitmap_set(bs, lv, i >> lv);
+        }
+    }
 
-    /* Check the head of the current level */
-    if ( BUDDY_EOL != bs->buddy[lv] ) {
-        return 0;
+    return 0;
+}
+
+/*
+ * Allocate (2**sz) blocks, and set up another buddy system on them in sub
+ * sharing the tags, so that another thread allocates from them without
+ * touching this one.  Its largest blocks are the two halves, so that the
+ * split block is never tagged free while split.  It does not grow, and is
+ * returned with buddy_join().
+ */
+int
+buddy_split(struct buddy *bs, int sz, struct buddy *sub)
+{
+    u32 i;
+    int off;
+    u8 *b;
+
+    if ( sz < 1 ) {
+        return -1;
+    }
+    off = buddy_alloc2(bs, sz);
+    if ( off < 0 ) {
+        return -1;
     }
 
-    /* Check the size */
-    if ( lv + 1 >= bs->level ) {
+    /* Free bitmaps */
+    if ( _alloc_bitmaps(sz, sz, &sub->bitmaps, &sub->words) < 0 ) {
+        buddy_free2(bs, off);
+        return -1;
+    }
+    /* Bitmap */
+    b = malloc(((1 << sz) + 7) / 8);
+    if ( NULL == b ) {
+        free(sub->words);
+        free(sub->bitmaps);
+        buddy_free2(bs, off);
         return -1;
     }
+    (void)memset(b, 0, ((1 << sz) + 7) / 8);
+
+    /* Set */
+    (void)memset(&sub->region, 0, sizeof(struct poptrie_region));
+    sub->sz = sz;
+    sub->maxsz = sz;
+    sub->used = 0;
+    sub->bsz = bs->bsz;
+    sub->level = sz;
+    sub->summary = 0;
+    sub->blocks = (u8 *)bs->blocks + (size_t)bs->bsz * (off - bs->base);
+    sub->b = b;
+    sub->base = off;
+
+    /* Free the two halves */
+    for ( i = 0; i < (1U << sz); i += 1U << (sz - 1) ) {
+        _push(sub, i, sz - 1);
+    }
+
+    return off;
+}
+
+/*
+ * Return the blocks of a buddy system split from the offset off.  The blocks
+ * allocated from it stay allocated, and the free ones are freed.
+ */
+void
+buddy_join(struct buddy *bs, struct buddy *sub, int off)
+{
+    struct buddy_bitmap *bm;
+    u64 m;
+    u32 n;
+    u32 i;
+    u32 j;
+    int lv;
+
+    /* Replace the split block with the blocks allocated from it */
+    off -= bs->base;
+    j = off + (1U << sub->sz) - 1;
+    bs->b[j >> 3] &= ~(1 << (j & 0x7));
+    for ( i = 0; i < (1U << sub->sz); i++ ) {
+        if ( sub->b[i >> 3] & (1 << (i & 0x7)) ) {
+            j = off + i;
+            bs->b[j >> 3] |= 1 << (j & 0x7);
+        }
+    }
+    bs->used += sub->used - (1 << sub->sz);
 
-    /* Check the head of the upper level */
-    if ( BUDDY_EOL == bs->buddy[lv + 1] ) {
-        ret = _split_buddy(bs, lv + 1);
-        if ( ret < 0 ) {
-            return ret;
+    if ( 0 == sub->used ) {
+        /* Free the whole split block, merged with its buddy if free */
+        _merge(bs, off, sub->sz);
+    } else {
+        /* The free blocks are already merged within the split block */
+        for ( lv = 0; lv < sub->level; lv++ ) {
+            bm = &sub->bitmaps[lv];
+            n = ((1U << (sub->sz - lv)) + 63) / 64;
+            for ( i = 0; i < n; i++ ) {
+                m = bm->layers[0][i];
+                while ( m ) {
+                    j = (i << 6) + __builtin_ctzll(m);
+                    m &= m - 1;
+                    _push(bs, off + (j << lv), lv);
+                }
+            }
         }
     }
 
-    /* Split */
-    bs->buddy[lv] = bs->buddy[lv + 1];
-    bs->buddy[lv + 1] = *(u32 *)((u64)bs->blocks + bs->bsz * bs->buddy[lv]);
-    next = bs->buddy[lv] + (1<<lv);
-    *(u32 *)((u64)bs->blocks + bs->bsz * next) = BUDDY_EOL;
-    *(u32 *)((u64)bs->blocks + bs->bsz * bs->buddy[lv]) = next;
+    free(sub->words);
+    free(sub->bitmaps);
+    free(sub->b);
+}
 
-    return 0;
+/*
+ * Release the buddy system
+ */
+void
+buddy_release(struct buddy *bs)
+{
+    free(bs->words);
+    free(bs->bitmaps);
+    region_free(&bs->region);
+    free(bs->b);
 }
 
 /*
@@ -136,17 +516,17 @@ buddy_alloc(struct buddy *bs, int n)
 
     ret = buddy_alloc2(bs, n);
     if ( ret < 0 ) {
-        return NULL;;
+        return NULL;
     }
 
-    return (void *)((u64)bs->blocks + bs->bsz * ret);
+    return (void *)((u64)bs->blocks + bs->bsz * (ret - bs->base));
 }
 int
 buddy_alloc2(struct buddy *bs, int sz)
 {
-    int ret;
+    u64 m;
     u32 a;
-    u32 b;
+    int lv;
 
     /* Check the argument */
     if ( sz < 0 ) {
@@ -158,66 +538,27 @@ buddy_alloc2(struct buddy *bs, int sz)
         return -1;
     }
 
-    /* Split first if needed */
-    ret = _split_buddy(bs, sz);
-    if ( ret < 0 ) {
+    /* Find the lowest level having a free block */
+    m = bs->summary >> sz;
+    if ( 0 == m ) {
         return -1;
     }
-
-    /* Obtain from the head */
-    a = bs->buddy[sz];
-    b = *(u32 *)(bs->blocks + bs->bsz * a);
-#if 0
-    printf("ALLOC %p %x, %x [%x/%d]\n", bs, a, b, sz, bs->bsz);
-#endif
-    bs->buddy[sz] = b;
+    lv = sz + __builtin_ctzll(m);
+
+    /* Obtain the first one, and split it to the size */
+    a = _bitmap_first(bs, lv) << lv;
+    _bitmap_clear(bs, lv, a >> lv);
+    while ( lv > sz ) {
+        lv--;
+        _push(bs, a + (1U << lv), lv);
+    }
+    *_tag(bs, a) = sz;
 
     /* Flag the tail block in bitmap */
     bs->b[(a + (1 << sz) - 1) >> 3] |= 1 << ((a + (1 << sz) - 1) & 0x7);
+    bs->used += 1 << sz;
 
-    return a;
-}
-
-/*
- * Merge blocks onto an upper level if possible
- */
-static void
-_merge(struct buddy *bs, int off, int lv)
-{
-    int i;
-    u32 s;
-    u32 *n;
-
-    if ( lv + 1 >= bs->level ) {
-        /* Reached maximum */
-        return;
-    }
-
-    s = off / (1 << (lv + 1)) * (1 << (lv + 1));
-    for ( i = 0; i < (1 << (lv + 1)); i++ ) {
-        if ( bs->b[(s + i) >> 3] & (1 << ((s + i) & 7)) ) {
-            /* Found one */
-            return;
-        }
-    }
-    /* All bits were zero, then take the corresponding two blocks from the
-       current level */
-    n = &bs->buddy[lv];
-    while ( BUDDY_EOL != *n ) {
-        if ( s == *n || (s + (1 << lv)) == *n ) {
-            /* Remove this */
-            *n = *(u32 *)(bs->blocks + bs->bsz * (*n));
-        } else {
-            n = (u32 *)(bs->blocks + bs->bsz * (*n));
-        }
-    }
-
-    /* Append it to the upper level */
-    *(u32 *)(bs->blocks + bs->bsz * s) = bs->buddy[lv + 1];
-    bs->buddy[lv + 1] = s;
-
-    /* Try to merge the upper level */
-    _merge(bs, s, lv + 1);
+    return bs->base + a;
 }
 
 /*
@@ -229,55 +570,32 @@ buddy_free(struct buddy *bs, void *a)
     int off;
 
     /* Calculate the offset */
-    off = ((u64)a - (u64)bs->blocks) / bs->bsz;
+    off = ((u64)a - (u64)bs->blocks) / bs->bsz + bs->base;
 
     buddy_free2(bs, off);
 }
 void
 buddy_free2(struct buddy *bs, int a)
 {
+    u32 tag;
+    u32 off;
     int sz;
-    u32 next;
-    u32 *n;
 
     /* Find the size */
-    sz = 0;
-    for ( ;; ) {
-        if ( bs->b[(a + (1 << sz) - 1) >> 3]
-             & (1 << ((a + (1 << sz) - 1) & 0x7)) ) {
-            break;
-        }
-        sz++;
-    }
-
-    if ( sz >= bs->level ) {
+    off = a - bs->base;
+    tag = *_tag(bs, off);
+    if ( (tag & BUDDY_FREE) || tag >= (u32)bs->level ) {
         /* Something is wrong... */
         return;
     }
+    sz = tag;
 
     /* Unflag the tail block in bitmap */
-    bs->b[(a + (1 << sz) - 1) >> 3] &= ~(1 << ((a + (1 << sz) - 1) & 0x7));
+    bs->b[(off + (1 << sz) - 1) >> 3] &= ~(1 << ((off + (1 << sz) - 1) & 0x7));
+    bs->used -= 1 << sz;
 
     /* Return to the buddy system */
-    n = &bs->buddy[sz];
-    while ( BUDDY_EOL != *n ) {
-        if ( (u32)a < *n ) {
-            next = *n;
-            *n = a;
-            *(u32 *)(bs->blocks + bs->bsz * a) = next;
-            n = NULL;
-            break;
-        } else {
-            n = (u32 *)(bs->blocks + bs->bsz * (*n));
-        }
-    }
-    if ( n != NULL ) {
-        *n = a;
-        *(u32 *)(bs->blocks + bs->bsz * a) = BUDDY_EOL;
-    }
-
-
-    _merge(bs, a, sz);
+    _merge(bs, off, sz);
 }
 
 /*
@@ -9,35 +9,66 @@
 #ifndef _POPTRIE_BUDDY_H
 #define _POPTRIE_BUDDY_H
 
+/* The maximum number of the layers of a free bitmap, enough for (2**36)
+   blocks */
+#define BUDDY_LAYERS    6
+
+/*
+ * Free bitmap of a level.  Bit i of the bottom layer is set if the (i << lv)th
+ * block is the head of a free block of the level lv, and bit i of an upper
+ * layer is set if the word i of the layer below is nonzero, so that the first
+ * free block is found by a find-first-set on each layer from the top, which
+ * is a single word.
+ */
+struct buddy_bitmap {
+    u64 *layers[BUDDY_LAYERS];
+    int nlayers;
+};
+
 /*
  * Buddy system
  */
 struct buddy {
     /* Size of buddy system (# of blocks) */
     int sz;
+    /* Maximum size to which the buddy system can grow */
+    int maxsz;
+    /* Number of allocated blocks */
+    int used;
     /* Size of each block */
     int bsz;
     /* Bitmap */
     u8 *b;
-    /* Memory blocks */
+    /* Tags of the head blocks; the level, and BUDDY_FREE if free */
     void *blocks;
+    struct poptrie_region region;
     /* Level */
     int level;
-    /* Heads */
-    u32 *buddy;
+    /* Bitmap of the levels having free blocks */
+    u64 summary;
+    /* Free bitmaps of the levels, and the words of them */
+    struct buddy_bitmap *bitmaps;
+    u64 *words;
+    /* Offset of the blocks if split from another buddy system, added to the
+       offsets allocated and subtracted from those freed */
+    int base;
 };
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
     /* buddy.c */
     int buddy_init(struct buddy *, int, int, int);
+    int buddy_init2(struct buddy *, int, int, int, int, int);
+    int buddy_grow(struct buddy *);
     void buddy_release(struct buddy *);
     void * buddy_alloc(struct buddy *, int);
     int buddy_alloc2(struct buddy *, int);
     void buddy_free(struct buddy *, void *);
     void buddy_free2(struct buddy *, int);
+    int buddy_restore(struct buddy *);
+    int buddy_split(struct buddy *, int, struct buddy *);
+    void buddy_join(struct buddy *, struct buddy *, int);
 
 #ifdef __cplusplus
 }
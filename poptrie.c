@@ -5,6 +5,12 @@
 
 #include "buddy.h"
 #include "poptrie.h"
+#include "qsbr.h"
+#include "radix.h"
+#include "region.h"
+#include "replica.h"
+#include "shm.h"
+#include "slab.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -13,18 +19,63 @@
 
 #define KEYLENGTH       32
 
-
-/* Prototype declaration */
-static void _release_radix(struct radix_node *);
-
 /*
  * Initialize the poptrie data structure
  */
 struct poptrie *
 poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
+{
+    return poptrie_init2(poptrie, sz1, sz0, NULL);
+}
+
+/*
+ * Initialize the poptrie data structure with the optional parameters
+ */
+struct poptrie *
+poptrie_init2(struct poptrie *poptrie, int sz1, int sz0,
+              const struct poptrie_params *params)
 {
     int ret;
     int i;
+    int s;
+    int flags;
+    int sz1_max;
+    int sz0_max;
+
+    /* Check the parameters */
+    if ( NULL != params && 0 != params->s ) {
+        s = params->s;
+    } else {
+        s = POPTRIE_S;
+    }
+    if ( NULL != params ) {
+        flags = params->flags;
+    } else {
+        flags = 0;
+    }
+    if ( NULL != params && 0 != params->sz1_max ) {
+        sz1_max = params->sz1_max;
+    } else {
+        sz1_max = sz1 + POPTRIE_GROW_BITS;
+        if ( sz1_max > POPTRIE_SZ_MAX ) {
+            sz1_max = POPTRIE_SZ_MAX;
+        }
+    }
+    if ( NULL != params && 0 != params->sz0_max ) {
+        sz0_max = params->sz0_max;
+    } else {
+        sz0_max = sz0 + POPTRIE_GROW_BITS;
+        if ( sz0_max > POPTRIE_SZ_MAX ) {
+            sz0_max = POPTRIE_SZ_MAX;
+        }
+    }
+    if ( s < POPTRIE_S_MIN || s > POPTRIE_S_MAX ) {
+        return NULL;
+    }
+    if ( sz1 < 0 || sz1 > sz1_max || sz1_max > POPTRIE_SZ_MAX
+         || sz0 < 0 || sz0 > sz0_max || sz0_max > POPTRIE_SZ_MAX ) {
+        return NULL;
+    }
 
     if ( NULL == poptrie ) {
         /* Allocate new one */
@@ -40,18 +91,28 @@ poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
         /* Write zero's */
         (void)memset(poptrie, 0, sizeof(struct poptrie));
     }
+    poptrie->s = s;
 
-    /* Allocate the nodes and leaves */
-    poptrie->nodes = malloc(sizeof(poptrie_node_t) * (1 << sz1));
-    if ( NULL == poptrie->nodes ) {
+    /* Allocate the nodes and leaves, and reserve the address space to grow
+       them in place */
+    ret = region_reserve(&poptrie->nodes_region,
+                         sizeof(poptrie_node_t) << sz1,
+                         sizeof(poptrie_node_t) << sz1_max, flags, -1);
+    if ( ret < 0 ) {
         poptrie_release(poptrie);
         return NULL;
     }
-    poptrie->leaves = malloc(sizeof(poptrie_leaf_t) * (1 << sz0));
-    if ( NULL == poptrie->leaves ) {
+    poptrie->nodes = poptrie->nodes_region.ptr;
+    ret = region_reserve(&poptrie->leaves_region,
+                         sizeof(poptrie_leaf_t) << sz0,
+                         sizeof(poptrie_leaf_t) << sz0_max, flags, -1);
+    if ( ret < 0 ) {
         poptrie_release(poptrie);
         return NULL;
     }
+    poptrie->leaves = poptrie->leaves_region.ptr;
+    poptrie->nodesz = sz1;
+    poptrie->leafsz = sz0;
 
     /* Prepare the buddy system for the internal node array */
     poptrie->cnodes = malloc(sizeof(struct buddy));
@@ -59,7 +120,8 @@ poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
         poptrie_release(poptrie);
         return NULL;
     }
-    ret = buddy_init(poptrie->cnodes, sz1, sz1, sizeof(u32));
+    ret = buddy_init2(poptrie->cnodes, sz1, sz1, sizeof(u32), flags,
+                      sz1_max);
     if ( ret < 0 ) {
         free(poptrie->cnodes);
         poptrie->cnodes = NULL;
@@ -73,30 +135,47 @@ poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
         poptrie_release(poptrie);
         return NULL;
     }
-    ret = buddy_init(poptrie->cleaves, sz0, sz0, sizeof(u32));
+    ret = buddy_init2(poptrie->cleaves, sz0, sz0, sizeof(u32), flags,
+                      sz0_max);
     if ( ret < 0 ) {
-        free(poptrie->cnodes);
-        poptrie->cnodes = NULL;
+        free(poptrie->cleaves);
+        poptrie->cleaves = NULL;
         poptrie_release(poptrie);
         return NULL;
     }
 
-    /* Prepare the direct pointing array */
-    poptrie->dir = malloc(sizeof(u32) << POPTRIE_S);
-    if ( NULL == poptrie->dir ) {
+    /* Prepare the pool of the radix tree nodes */
+    poptrie->cradix = malloc(sizeof(struct slab));
+    if ( NULL == poptrie->cradix ) {
         poptrie_release(poptrie);
         return NULL;
     }
-    for ( i = 0; i < (1 << POPTRIE_S); i++ ) {
-        poptrie->dir[i] = (u32)1 << 31;
+    slab_init(poptrie->cradix, sizeof(struct radix_node));
+
+    /* Prepare the working buffers of the update so that it does not consume
+       the stack in proportion to the depth of the trie */
+    poptrie->scratch = malloc(sizeof(struct poptrie_scratch)
+                              * POPTRIE_SCRATCH_LEVELS);
+    if ( NULL == poptrie->scratch ) {
+        poptrie_release(poptrie);
+        return NULL;
     }
+    poptrie->level = 0;
 
-    /* Prepare the alternative direct pointing array for the update procedure */
-    poptrie->altdir = malloc(sizeof(u32) << POPTRIE_S);
-    if ( NULL == poptrie->altdir ) {
+    /* Prepare the direct pointing array and the alternative one for the
+       update procedure in a region */
+    ret = region_alloc(&poptrie->dir_region, sizeof(u32) << (poptrie->s + 1),
+                       flags);
+    if ( ret < 0 ) {
         poptrie_release(poptrie);
         return NULL;
     }
+    poptrie->dir = poptrie->dir_region.ptr;
+    poptrie->altdir = poptrie->dir + ((size_t)1 << poptrie->s);
+    for ( i = 0; i < (1 << poptrie->s); i++ ) {
+        poptrie->dir[i] = (u32)1 << 31;
+        poptrie->altdir[i] = (u32)1 << 31;
+    }
 
     /* Prepare the FIB mapping table */
     poptrie->fib.entries = malloc(sizeof(struct poptrie_fib_entry)
@@ -108,9 +187,45 @@ poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
     memset(poptrie->fib.entries, 0, sizeof(struct poptrie_fib_entry)
            * POPTRIE_INIT_FIB_SIZE);
     poptrie->fib.sz = POPTRIE_INIT_FIB_SIZE;
-    /* Insert a NULL entry as the default route */
+    poptrie->fib.hash = malloc(sizeof(int) * POPTRIE_INIT_FIB_SIZE);
+    if ( NULL == poptrie->fib.hash ) {
+        poptrie_release(poptrie);
+        return NULL;
+    }
+    for ( i = 0; i < POPTRIE_INIT_FIB_SIZE; i++ ) {
+        poptrie->fib.hash[i] = -1;
+    }
+    /* Chain the free entries in the ascending order */
+    for ( i = 0; i < POPTRIE_INIT_FIB_SIZE; i++ ) {
+        poptrie->fib.entries[i].next = i + 1;
+    }
+    poptrie->fib.entries[POPTRIE_INIT_FIB_SIZE - 1].next = -1;
+    poptrie->fib.free = 1;
+    /* Insert a NULL entry as the default route; NULL is hashed to the bucket
+       zero */
     poptrie->fib.entries[0].entry = NULL;
     poptrie->fib.entries[0].refs = 1;
+    poptrie->fib.entries[0].next = -1;
+    poptrie->fib.hash[0] = 0;
+
+    /* Defer the release of the nodes and leaves for the readers */
+    if ( flags & POPTRIE_QSBR ) {
+        ret = qsbr_init(poptrie);
+        if ( ret < 0 ) {
+            poptrie_release(poptrie);
+            return NULL;
+        }
+    }
+
+    /* Replicate the arrays to the NUMA nodes */
+    if ( flags & POPTRIE_REPLICATE ) {
+        ret = replica_init(poptrie,
+                           flags & ~(POPTRIE_REPLICATE | POPTRIE_QSBR));
+        if ( ret < 0 ) {
+            poptrie_release(poptrie);
+            return NULL;
+        }
+    }
 
     return poptrie;
 }
@@ -121,15 +236,19 @@ poptrie_init(struct poptrie *poptrie, int sz1, int sz0)
 void
 poptrie_release(struct poptrie *poptrie)
 {
-    /* Release the radix tree */
-    _release_radix(poptrie->radix);
+    int i;
 
-    if ( poptrie->nodes ) {
-        free(poptrie->nodes);
+    /* Release the radix tree at once */
+    if ( poptrie->cradix ) {
+        slab_release(poptrie->cradix);
+        free(poptrie->cradix);
     }
-    if ( poptrie->leaves ) {
-        free(poptrie->leaves);
+    if ( poptrie->scratch ) {
+        free(poptrie->scratch);
     }
+
+    region_free(&poptrie->nodes_region);
+    region_free(&poptrie->leaves_region);
     if ( poptrie->cnodes ) {
         buddy_release(poptrie->cnodes);
         free(poptrie->cnodes);
@@ -138,33 +257,137 @@ poptrie_release(struct poptrie *poptrie)
         buddy_release(poptrie->cleaves);
         free(poptrie->cleaves);
     }
-    if ( poptrie->dir ) {
-        free(poptrie->dir);
-    }
-    if ( poptrie->altdir ) {
-        free(poptrie->altdir);
-    }
+    region_free(&poptrie->dir_region);
+    replica_release(poptrie);
+    shm_release(poptrie);
+    qsbr_release(poptrie);
     if ( poptrie->fib.entries ) {
         free(poptrie->fib.entries);
     }
+    if ( poptrie->fib.hash ) {
+        free(poptrie->fib.hash);
+    }
+    for ( i = 0; i < poptrie->fib.nretired; i++ ) {
+        free(poptrie->fib.retired[i]);
+    }
     if ( poptrie->_allocated ) {
         free(poptrie);
     }
 }
 
 /*
- * Free the allocated memory by the radix tree
+ * Get the backing of a memory region
  */
-static void
-_release_radix(struct radix_node *node)
+int
+poptrie_backing(struct poptrie *poptrie, int region)
 {
-    if ( NULL != node ) {
-        _release_radix(node->left);
-        _release_radix(node->right);
-        free(node);
+    switch ( region ) {
+    case POPTRIE_REGION_NODES:
+        return poptrie->nodes_region.backing;
+    case POPTRIE_REGION_LEAVES:
+        return poptrie->leaves_region.backing;
+    case POPTRIE_REGION_DIR:
+        return poptrie->dir_region.backing;
+    case POPTRIE_REGION_CNODES:
+        return ((struct buddy *)poptrie->cnodes)->region.backing;
+    case POPTRIE_REGION_CLEAVES:
+        return ((struct buddy *)poptrie->cleaves)->region.backing;
+    default:
+        return -1;
     }
 }
 
+/*
+ * Double the internal node or leaf array in place, with its buddy system and
+ * its replicas
+ */
+int
+poptrie_grow(struct poptrie *poptrie, int region)
+{
+    struct buddy *bs;
+    struct poptrie_region *r;
+    size_t sz;
+    int ret;
+
+    switch ( region ) {
+    case POPTRIE_REGION_NODES:
+        bs = poptrie->cnodes;
+        r = &poptrie->nodes_region;
+        sz = sizeof(poptrie_node_t) << (bs->sz + 1);
+        break;
+    case POPTRIE_REGION_LEAVES:
+        bs = poptrie->cleaves;
+        r = &poptrie->leaves_region;
+        sz = sizeof(poptrie_leaf_t) << (bs->sz + 1);
+        break;
+    default:
+        return -1;
+    }
+    if ( bs->sz >= bs->maxsz ) {
+        return -1;
+    }
+
+    /* Make the array accessible before the buddy system hands it out */
+    ret = region_grow(r, sz);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = replica_grow(poptrie, region, sz);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = buddy_grow(bs);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    if ( POPTRIE_REGION_NODES == region ) {
+        poptrie->nodesz = bs->sz;
+    } else {
+        poptrie->leafsz = bs->sz;
+    }
+
+    return 0;
+}
+
+/*
+ * Set the callback to be called when the used entries of the internal node or
+ * leaf array exceed the percent of its maximum size
+ */
+void
+poptrie_set_watermark(struct poptrie *poptrie, int percent,
+                      poptrie_watermark_f func, void *arg)
+{
+    poptrie->watermark = percent;
+    poptrie->watermark_func = func;
+    poptrie->watermark_arg = arg;
+    poptrie->watermark_hit = 0;
+}
+
+/*
+ * Get the number of the nodes in the RIB (radix tree)
+ */
+int
+poptrie_rib_nodes(struct poptrie *poptrie)
+{
+    return ((struct slab *)poptrie->cradix)->used;
+}
+
+/*
+ * Rebuild the RIB in a new pool without the nodes neither holding a route nor
+ * branching, e.g., those left by failed updates, and release the memory of the
+ * nodes deleted so far
+ */
+int
+poptrie_rib_compact(struct poptrie *poptrie)
+{
+    if ( poptrie->batch ) {
+        /* Not from the callbacks during a route batch */
+        return -1;
+    }
+
+    return radix_compact(poptrie);
+}
+
 /*
  * Local variables:
  * tab-width: 4
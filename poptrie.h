@@ -6,6 +6,7 @@
 #ifndef _POPTRIE_H
 #define _POPTRIE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef uint8_t u8;
@@ -15,12 +16,89 @@ typedef uint64_t u64;
 
 
 /* The bit length used for direct pointing.  The most significant POPTRIE_S bits
-   of keys will be tested at the first stage of the trie search in O(1). */
+   of keys will be tested at the first stage of the trie search in O(1).  This
+   is the default value, and can be changed per data structure at the
+   initialization within the range from POPTRIE_S_MIN to POPTRIE_S_MAX. */
 #define POPTRIE_S               18
-/* The initial size of forwarding information base (FIB).  In the current
-   version of this software, new entries exceeding this size will result in an
-   error.  This parameter must be less than 65535. */
+#define POPTRIE_S_MIN           6
+#define POPTRIE_S_MAX           24
+/* The initial size of forwarding information base (FIB).  The FIB is doubled
+   when it is full up to POPTRIE_FIB_MAX entries.  This parameter must be a
+   power of two. */
 #define POPTRIE_INIT_FIB_SIZE   4096
+/* The maximum size of the FIB, limited by the width of the leaves.  Define
+   POPTRIE_FIB32 (configure --enable-fib32) for 32-bit leaves to have more than
+   65535 next hops; the library and its users must be compiled with the same
+   definition. */
+#ifdef POPTRIE_FIB32
+#define POPTRIE_FIB_MAX         (1 << 30)
+#else
+#define POPTRIE_FIB_MAX         (1 << 16)
+#endif
+/* The maximum number of the retired FIB arrays kept until the release */
+#define POPTRIE_FIB_RETIRED_MAX 32
+
+/* FIB mapping table of a poptrie.  It may be replaced by a larger one while
+   the lookups are running, so that it must be loaded after the leaf for each
+   lookup. */
+#define POPTRIE_FIB_ENTRIES(poptrie) \
+    __atomic_load_n(&(poptrie)->fib.entries, __ATOMIC_ACQUIRE)
+/* Hash of a next hop to a bucket of the FIB mapping table with sz entries */
+#define POPTRIE_FIB_HASH(nexthop, sz) \
+    ((int)(((u64)(uintptr_t)(nexthop) * 0x9e3779b97f4a7c15ULL) >> 32 \
+           & (u64)((sz) - 1)))
+/* The version of the snapshot format written by poptrie_save() */
+#define POPTRIE_SNAPSHOT_VERSION    3
+/* The version of the read-only image format written by poptrie_save_image(),
+   and the alignment of the sections in the image */
+#define POPTRIE_IMAGE_VERSION   1
+#define POPTRIE_IMAGE_ALIGN     4096
+/* The version of the layout of the shared-memory segment */
+#define POPTRIE_SHM_VERSION     1
+/* The default number of doublings of the internal node and leaf arrays when
+   they run out, and the limit of their sizes in the power of two */
+#define POPTRIE_GROW_BITS       4
+#define POPTRIE_SZ_MAX          30
+/* The maximum number of the levels of the internal nodes below the direct
+   pointing array, to which the working buffers of the update are preallocated
+   per data structure */
+#define POPTRIE_SCRATCH_LEVELS  ((128 - POPTRIE_S_MIN + 5) / 6)
+
+
+/* Flags of the memory backing for the arrays of nodes, leaves, and direct
+   pointing, and the blocks of the buddy systems */
+#define POPTRIE_HUGEPAGE        0x1     /* MAP_HUGETLB, or THP as a fallback */
+#define POPTRIE_PREFAULT        0x2     /* Fault in all the pages at init */
+#define POPTRIE_MLOCK           0x4     /* Lock the pages in memory */
+/* Flag to keep a replica of the arrays on each NUMA node */
+#define POPTRIE_REPLICATE       0x8
+/* Flag to defer the release of the nodes and leaves until the registered
+   readers pass a quiescent state */
+#define POPTRIE_QSBR            0x10
+
+/* Backing obtained for a memory region */
+#define POPTRIE_BACKING_MALLOC  0       /* malloc() */
+#define POPTRIE_BACKING_MMAP    1       /* Anonymous mapping of base pages */
+#define POPTRIE_BACKING_THP     2       /* madvise(MADV_HUGEPAGE) */
+#define POPTRIE_BACKING_HUGETLB 3       /* MAP_HUGETLB */
+#define POPTRIE_BACKING_SHM     4       /* Shared-memory segment */
+#define POPTRIE_BACKING_MASK    0xff
+#define POPTRIE_BACKING_PREFAULTED  0x100
+#define POPTRIE_BACKING_LOCKED  0x200
+#define POPTRIE_BACKING_BOUND   0x400   /* Bound to a NUMA node */
+
+/* Types of the operations of a route batch */
+#define POPTRIE_ROUTE_ADD       1
+#define POPTRIE_ROUTE_CHANGE    2
+#define POPTRIE_ROUTE_UPDATE    3
+#define POPTRIE_ROUTE_DEL       4
+
+/* Memory regions to query the backing */
+#define POPTRIE_REGION_NODES    0
+#define POPTRIE_REGION_LEAVES   1
+#define POPTRIE_REGION_DIR      2
+#define POPTRIE_REGION_CNODES   3
+#define POPTRIE_REGION_CLEAVES  4
 
 
 /* 64-bit popcnt intrinsic.  To use popcnt instruction in x86-64, the "-mpopcnt"
@@ -40,29 +118,45 @@ typedef struct poptrie_node {
     u32 base1;
 } poptrie_node_t;
 
+#ifdef POPTRIE_FIB32
+/* Leaf node; 32-bit value */
+typedef u32 poptrie_leaf_t;
+
+/* FIB index */
+typedef u32 poptrie_fib_index_t;
+#else
 /* Leaf node; 16-bit value */
 typedef u16 poptrie_leaf_t;
 
 /* FIB index */
 typedef u16 poptrie_fib_index_t;
+#endif
 
 /*
- * Radix tree node
+ * Radix tree node.  The tree is path-compressed; the nodes that neither hold a
+ * route nor branch are omitted except for the root.
  */
 struct radix_node {
-    int valid;
+    /* Prefix left-aligned to 128 bits, and its length (the depth) */
+    __uint128_t key;
     struct radix_node *left;
     struct radix_node *right;
 
+    /* Nearest valid node from the root, including the node itself.  It is
+       resolved from the parent when the update descends to the node (see
+       radix_child()), so that it is only up to date on the path updated. */
+    struct radix_node *ext;
+
     /* Next hop */
-    int len;
     poptrie_leaf_t nexthop;
+    u8 len;
+    u8 valid;
 
-    /* Propagated route for invalid intermediate nodes from a valid parent */
-    struct radix_node *ext;
-
-    /* Mark for update */
-    int mark;
+    /* Mark for update, and that the route of the node is added, changed, or
+       deleted; the descendants not holding a route are to be marked with it
+       when the update descends to them */
+    u8 mark;
+    u8 lazy;
 };
 
 /*
@@ -71,12 +165,190 @@ struct radix_node {
 struct poptrie_fib_entry {
     void *entry;
     int refs;
+    /* Next entry in the hash chain, or in the free list if refs is zero */
+    int next;
 };
 struct poptrie_fib {
     struct poptrie_fib_entry *entries;
     int sz;
+    /* Hash table from the next hop to the head of the chain of the indices;
+       the number of buckets is sz */
+    int *hash;
+    /* Head of the list of the free entries */
+    int free;
+    /* Arrays replaced by the larger ones; they are kept until the release
+       since the lookups in progress may still refer to them */
+    struct poptrie_fib_entry *retired[POPTRIE_FIB_RETIRED_MAX];
+    int nretired;
+};
+
+/*
+ * Reader thread of the quiescent-state-based reclamation.  Each one occupies a
+ * cache line to avoid false sharing between the readers.
+ */
+struct poptrie_reader {
+    /* The epoch observed at the last quiescent state; (u64)-1 when offline */
+    volatile u64 epoch;
+    struct poptrie *poptrie;
+    struct poptrie_reader *next;
+    /* Unregistered, and to be released by the writer */
+    volatile int dead;
+} __attribute__ ((aligned (64)));
+
+/*
+ * Block released by an update and waiting for the readers to pass the epoch
+ */
+struct poptrie_limbo {
+    u64 epoch;
+    /* POPTRIE_REGION_NODES or POPTRIE_REGION_LEAVES with the index off, or
+       -1 for the memory pointed by ptr */
+    int region;
+    u32 off;
+    void *ptr;
+};
+
+/*
+ * Memory region
+ */
+struct poptrie_region {
+    void *ptr;
+    /* Allocated size, and reserved size to which the region can grow */
+    size_t sz;
+    size_t rsz;
+    int backing;
+    /* Flags and NUMA node to allocate the pages on growth */
+    int flags;
+    int node;
+};
+
+/*
+ * Replica of the arrays for lookups on a NUMA node
+ */
+struct poptrie_replica {
+    poptrie_node_t *nodes;
+    poptrie_leaf_t *leaves;
+    u32 *dir;
+    struct poptrie_region nodes_region;
+    struct poptrie_region leaves_region;
+    struct poptrie_region dir_region;
+};
+
+/*
+ * Shared-memory segment with a copy of the arrays and the FIB entries for the
+ * reader processes
+ */
+struct poptrie_shm {
+    /* Name of the segment, unlinked at the release by the writer; NULL in
+       the reader processes */
+    char *name;
+    /* Header and the slots of the reader processes */
+    struct poptrie_region header_region;
+    int nslots;
+    /* Arrays, mapped read-only in the reader processes */
+    struct poptrie_replica replica;
+    struct poptrie_fib_entry *fib;
+    struct poptrie_region fib_region;
+};
+
+/*
+ * Block of nodes or leaves written since the last synchronization of the
+ * replicas
+ */
+struct poptrie_dirty {
+    /* Index of the first entry */
+    u32 off;
+    /* 2^order entries */
+    u16 order;
+    /* Leaves if non-zero, otherwise internal nodes */
+    u16 leaf;
+};
+
+/*
+ * Route of the list to build a poptrie from
+ */
+struct poptrie_prefix {
+    u32 prefix;
+    int len;
+    void *nexthop;
+};
+struct poptrie6_prefix {
+    __uint128_t prefix;
+    int len;
+    void *nexthop;
+};
+
+/*
+ * Part of the direct pointing array to be updated at the end of a route batch
+ */
+struct poptrie_span {
+    /* The first entry, and the prefix length (up to s) covering the part */
+    int idx;
+    int len;
+};
+
+/*
+ * Prefix deleted by a route batch, whose radix nodes are released at the end
+ * of the batch
+ */
+struct poptrie_prune {
+    __uint128_t key;
+    int len;
+};
+
+/*
+ * Working buffers to update an internal node, one per level
+ */
+struct poptrie_scratch {
+    struct radix_node nodes[1 << 6];
+    poptrie_node_t children[1 << 6];
+    poptrie_leaf_t leaves[1 << 6];
+};
+
+/*
+ * Optional parameters for the initialization
+ */
+struct poptrie_params {
+    /* The bit length used for direct pointing (0 for POPTRIE_S) */
+    int s;
+    /* Memory backing (POPTRIE_HUGEPAGE, POPTRIE_PREFAULT, POPTRIE_MLOCK),
+       POPTRIE_REPLICATE, and POPTRIE_QSBR */
+    int flags;
+    /* The maximum sizes in the power of two to which the internal node and
+       leaf arrays grow (0 for sz1 and sz0 plus POPTRIE_GROW_BITS) */
+    int sz1_max;
+    int sz0_max;
+};
+
+/*
+ * Operation of a route batch; nexthop is ignored for POPTRIE_ROUTE_DEL
+ */
+struct poptrie_route_op {
+    int type;
+    u32 prefix;
+    int len;
+    void *nexthop;
+};
+struct poptrie6_route_op {
+    int type;
+    __uint128_t prefix;
+    int len;
+    void *nexthop;
 };
 
+/*
+ * Callback when the used entries of the internal node or leaf array exceed the
+ * high watermark
+ */
+struct poptrie;
+typedef void (*poptrie_watermark_f)(struct poptrie *, int, int, int, void *);
+
+/*
+ * Callbacks to map a next hop to the ID written to a snapshot, and the ID back
+ * to the next hop when it is loaded
+ */
+typedef u64 (*poptrie_save_f)(void *, void *);
+typedef void * (*poptrie_load_f)(u64, void *);
+
 /*
  * Poptrie management data structure
  */
@@ -84,6 +356,9 @@ struct poptrie {
     /* Root */
     u32 root;
 
+    /* The bit length used for direct pointing */
+    int s;
+
     /* FIB */
     struct poptrie_fib fib;
 
@@ -93,42 +368,209 @@ struct poptrie {
     void *cnodes;
     void *cleaves;
 
-    /* Allocated sizes for internal nodes and leaves */
+    /* Pool of the radix tree nodes */
+    void *cradix;
+
+    /* Allocated sizes for internal nodes and leaves in the power of two */
     int nodesz;
     int leafsz;
 
+    /* High watermark in percent of the maximum sizes, and the regions over
+       it already notified */
+    int watermark;
+    poptrie_watermark_f watermark_func;
+    void *watermark_arg;
+    int watermark_hit;
+
     /* Array for direct pointing */
     u32 *dir;
     u32 *altdir;
 
+    /* Memory regions of the arrays above; dir and altdir share one */
+    struct poptrie_region nodes_region;
+    struct poptrie_region leaves_region;
+    struct poptrie_region dir_region;
+
+    /* Replicas per NUMA node, the shared-memory segment, and the log of
+       the written blocks to be applied to them (ndirty < 0 when the log is
+       overflowed) */
+    struct poptrie_replica *replicas;
+    int nreplicas;
+    struct poptrie_shm *shm;
+    struct poptrie_dirty *dirty;
+    int ndirty;
+    int dirtysz;
+
+    /* Epoch of the reclamation, the registered readers, and the blocks
+       released by the updates in the order of the epochs; the blocks from
+       nsealed have been released by the update in progress */
+    volatile u64 epoch;
+    struct poptrie_reader *volatile readers;
+    struct poptrie_limbo *limbo;
+    int limbohead;
+    int nlimbo;
+    int nsealed;
+    int limbosz;
+
+    /* Set while the operations of a route batch are applied to the RIB; the
+       parts of the direct pointing to be updated, the next hops to be
+       dereferenced, and the deleted prefixes to be pruned from the RIB after
+       the update */
+    int batch;
+    struct poptrie_span *spans;
+    int nspans;
+    int *unref;
+    int nunref;
+    struct poptrie_prune *prune;
+    int nprune;
+
     /* RIB */
     struct radix_node *radix;
 
+    /* Working buffers of the update, and the level of the internal node in
+       progress */
+    struct poptrie_scratch *scratch;
+    int level;
+
+    /* Control */
+    int _allocated;
+};
+
+/*
+ * Ring of in-flight lookups for the asynchronous lookup
+ */
+struct poptrie_amac {
+    /* Poptrie to be looked up */
+    struct poptrie *poptrie;
+
+    /* Lookup state machines */
+    struct poptrie_amac_slot *slots;
+    int sz;
+
+    /* Next slot to be advanced */
+    int cur;
+    /* The number of in-flight lookups */
+    int n;
+
     /* Control */
     int _allocated;
 };
 
+/*
+ * Read-only poptrie mapped from an image.  The arrays of the poptrie point to
+ * the mapping, and the FIB entries hold the IDs of the next hops.
+ */
+struct poptrie_map {
+    struct poptrie poptrie;
+    void *addr;
+    size_t len;
+};
+
+/*
+ * Reader process attached to a shared-memory segment.  The poptrie is looked
+ * up on the segment.
+ */
+struct poptrie_shm_reader {
+    struct poptrie poptrie;
+    struct poptrie_shm shm;
+    /* Slot of this reader in the segment */
+    int slot;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
     /* in poptrie.c */
     struct poptrie * poptrie_init(struct poptrie *, int, int);
+    struct poptrie *
+    poptrie_init2(struct poptrie *, int, int, const struct poptrie_params *);
     void poptrie_release(struct poptrie *);
+    int poptrie_backing(struct poptrie *, int);
+    int poptrie_grow(struct poptrie *, int);
+    void poptrie_set_watermark(struct poptrie *, int, poptrie_watermark_f,
+                               void *);
+    int poptrie_rib_nodes(struct poptrie *);
+    int poptrie_rib_compact(struct poptrie *);
     int poptrie_route_add(struct poptrie *, u32, int, void *);
     int poptrie_route_change(struct poptrie *, u32, int, void *);
     int poptrie_route_update(struct poptrie *, u32, int, void *);
     int poptrie_route_del(struct poptrie *, u32, int);
+    int poptrie_route_batch(struct poptrie *, const struct poptrie_route_op *,
+                            int);
+    int poptrie_build(struct poptrie *, const struct poptrie_prefix *, size_t);
+    int poptrie_build2(struct poptrie *, const struct poptrie_prefix *, size_t,
+                       int);
     void * poptrie_lookup(struct poptrie *, u32);
+    void poptrie_lookup_batch(struct poptrie *, const u32 *, void **, int);
+    poptrie_fib_index_t poptrie_lookup_index(struct poptrie *, u32);
+    void poptrie_lookup_index_batch(struct poptrie *, const u32 *,
+                                    poptrie_fib_index_t *, int);
+    struct poptrie_amac *
+    poptrie_amac_init(struct poptrie_amac *, struct poptrie *, int);
+    void poptrie_amac_release(struct poptrie_amac *);
+    void poptrie_amac_submit(struct poptrie_amac *, u32, void **);
+    void poptrie_amac_flush(struct poptrie_amac *);
+    void poptrie_amac_lookup(struct poptrie_amac *, const u32 *, void **, int);
     void * poptrie_rib_lookup(struct poptrie *, u32);
+    void * poptrie_replica_lookup(struct poptrie *, int, u32);
+    void * poptrie_lookup_local(struct poptrie *, u32);
+
+    /* in poptrie4_simd.c */
+    int poptrie_lookup_avx2(struct poptrie *, const u32 *, void **, int);
+    int poptrie_lookup_avx512(struct poptrie *, const u32 *, void **, int);
+    void poptrie_lookup_simd(struct poptrie *, const u32 *, void **, int);
 
     /* in poptrie6.c */
     int poptrie6_route_add(struct poptrie *, __uint128_t, int, void *);
     int poptrie6_route_change(struct poptrie *, __uint128_t, int, void *);
     int poptrie6_route_update(struct poptrie *, __uint128_t, int, void *);
     int poptrie6_route_del(struct poptrie *, __uint128_t, int);
+    int poptrie6_route_batch(struct poptrie *,
+                             const struct poptrie6_route_op *, int);
+    int poptrie6_build(struct poptrie *, const struct poptrie6_prefix *,
+                       size_t);
+    int poptrie6_build2(struct poptrie *, const struct poptrie6_prefix *,
+                        size_t, int);
     void * poptrie6_lookup(struct poptrie *, __uint128_t);
+    void poptrie6_lookup_batch(struct poptrie *, const __uint128_t *, void **,
+                               int);
+    poptrie_fib_index_t poptrie6_lookup_index(struct poptrie *, __uint128_t);
+    void poptrie6_lookup_index_batch(struct poptrie *, const __uint128_t *,
+                                     poptrie_fib_index_t *, int);
     void * poptrie6_rib_lookup(struct poptrie *, __uint128_t);
+    void * poptrie6_replica_lookup(struct poptrie *, int, __uint128_t);
+    void * poptrie6_lookup_local(struct poptrie *, __uint128_t);
+
+    /* in replica.c */
+    int poptrie_numa_nodes(void);
+    int poptrie_local_node(void);
+
+    /* in snapshot.c */
+    int poptrie_save(struct poptrie *, int, poptrie_save_f, void *);
+    struct poptrie *
+    poptrie_load(struct poptrie *, int, const struct poptrie_params *,
+                 poptrie_load_f, void *);
+    int poptrie_save_image(struct poptrie *, int, poptrie_save_f, void *);
+    struct poptrie_map * poptrie_map(int);
+    int poptrie_remap(struct poptrie_map **, int, struct poptrie_map **);
+    void poptrie_unmap(struct poptrie_map *);
+
+    /* in shm.c */
+    int poptrie_shm_create(struct poptrie *, const char *, int);
+    struct poptrie_shm_reader * poptrie_shm_attach(const char *);
+    void poptrie_shm_detach(struct poptrie_shm_reader *);
+    void poptrie_shm_online(struct poptrie_shm_reader *);
+    void poptrie_shm_offline(struct poptrie_shm_reader *);
+    void poptrie_shm_quiescent(struct poptrie_shm_reader *);
+
+    /* in qsbr.c */
+    struct poptrie_reader * poptrie_reader_register(struct poptrie *);
+    void poptrie_reader_unregister(struct poptrie_reader *);
+    void poptrie_reader_online(struct poptrie_reader *);
+    void poptrie_reader_offline(struct poptrie_reader *);
+    void poptrie_quiescent(struct poptrie_reader *);
+    int poptrie_reclaim(struct poptrie *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,294 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_HPP
+#define _POPTRIE_HPP
+
+#include "poptrie.h"
+#include <new>
+#include <stdexcept>
+
+/*
+ * Key type dependent operations.  Only u32 (IPv4) and __uint128_t (IPv6) keys
+ * are supported.
+ */
+template <typename Key> struct PoptrieKey;
+
+template <>
+struct PoptrieKey<u32>
+{
+    static inline int
+    index(u32 a, int s, int n)
+    {
+        return ((u64)a << 32 >> (64 - (s + n))) & ((1 << n) - 1);
+    }
+    static inline int
+    route_add(struct poptrie *poptrie, u32 prefix, int len, void *nexthop)
+    {
+        return poptrie_route_add(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_change(struct poptrie *poptrie, u32 prefix, int len, void *nexthop)
+    {
+        return poptrie_route_change(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_update(struct poptrie *poptrie, u32 prefix, int len, void *nexthop)
+    {
+        return poptrie_route_update(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_del(struct poptrie *poptrie, u32 prefix, int len)
+    {
+        return poptrie_route_del(poptrie, prefix, len);
+    }
+    static inline void *
+    rib_lookup(struct poptrie *poptrie, u32 addr)
+    {
+        return poptrie_rib_lookup(poptrie, addr);
+    }
+};
+
+template <>
+struct PoptrieKey<__uint128_t>
+{
+    static inline int
+    index(__uint128_t a, int s, int n)
+    {
+        if ( 0 == s + n ) {
+            return 0;
+        }
+        return (int)(a >> (128 - (s + n))) & ((1 << n) - 1);
+    }
+    static inline int
+    route_add(struct poptrie *poptrie, __uint128_t prefix, int len,
+              void *nexthop)
+    {
+        return poptrie6_route_add(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_change(struct poptrie *poptrie, __uint128_t prefix, int len,
+                 void *nexthop)
+    {
+        return poptrie6_route_change(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_update(struct poptrie *poptrie, __uint128_t prefix, int len,
+                 void *nexthop)
+    {
+        return poptrie6_route_update(poptrie, prefix, len, nexthop);
+    }
+    static inline int
+    route_del(struct poptrie *poptrie, __uint128_t prefix, int len)
+    {
+        return poptrie6_route_del(poptrie, prefix, len);
+    }
+    static inline void *
+    rib_lookup(struct poptrie *poptrie, __uint128_t addr)
+    {
+        return poptrie6_rib_lookup(poptrie, addr);
+    }
+};
+
+/*
+ * Poptrie with the lookup defined inline over struct poptrie.  S is the bit
+ * length of the direct pointing, and Stride is the bit length of the internal
+ * nodes.  Updates are performed by libpoptrie.
+ */
+template <typename Key, int S = POPTRIE_S, int Stride = 6>
+class Poptrie
+{
+    static_assert(S >= POPTRIE_S_MIN && S <= POPTRIE_S_MAX,
+                  "S is out of the range of the direct pointing");
+    static_assert(Stride == 6,
+                  "Internal nodes of libpoptrie have 64-bit vectors");
+
+public:
+    /*
+     * Initialize a new poptrie with 2^sz1 internal nodes and 2^sz0 leaves
+     */
+    Poptrie(int sz1 = 19, int sz0 = 22) : _allocated(true)
+    {
+        struct poptrie_params params = {};
+
+        params.s = S;
+        _poptrie = poptrie_init2(NULL, sz1, sz0, &params);
+        if ( NULL == _poptrie ) {
+            throw std::bad_alloc();
+        }
+    }
+
+    /*
+     * Wrap an existing poptrie initialized with the same S
+     */
+    explicit Poptrie(struct poptrie *poptrie)
+        : _poptrie(poptrie), _allocated(false)
+    {
+        if ( S != poptrie->s ) {
+            throw std::invalid_argument("Direct pointing width mismatch");
+        }
+    }
+
+    ~Poptrie()
+    {
+        if ( _allocated ) {
+            poptrie_release(_poptrie);
+        }
+    }
+
+    Poptrie(const Poptrie &) = delete;
+    Poptrie & operator=(const Poptrie &) = delete;
+
+    /*
+     * Underlying data structure to be passed to the C API
+     */
+    struct poptrie *
+    get(void) const
+    {
+        return _poptrie;
+    }
+
+    /*
+     * Route operations
+     */
+    int
+    route_add(Key prefix, int len, void *nexthop)
+    {
+        return PoptrieKey<Key>::route_add(_poptrie, prefix, len, nexthop);
+    }
+    int
+    route_change(Key prefix, int len, void *nexthop)
+    {
+        return PoptrieKey<Key>::route_change(_poptrie, prefix, len, nexthop);
+    }
+    int
+    route_update(Key prefix, int len, void *nexthop)
+    {
+        return PoptrieKey<Key>::route_update(_poptrie, prefix, len, nexthop);
+    }
+    int
+    route_del(Key prefix, int len)
+    {
+        return PoptrieKey<Key>::route_del(_poptrie, prefix, len);
+    }
+    void *
+    rib_lookup(Key addr) const
+    {
+        return PoptrieKey<Key>::rib_lookup(_poptrie, addr);
+    }
+
+    /*
+     * Lookup the FIB index of the route by the specified address
+     */
+    inline poptrie_fib_index_t
+    lookup_index(Key addr) const
+    {
+        return _lookup_index(_poptrie->dir, _poptrie->nodes, _poptrie->leaves,
+                             addr);
+    }
+
+    /*
+     * Lookup a route by the specified address
+     */
+    inline void *
+    lookup(Key addr) const
+    {
+        poptrie_fib_index_t idx;
+
+        idx = lookup_index(addr);
+
+        return POPTRIE_FIB_ENTRIES(_poptrie)[idx].entry;
+    }
+
+    /*
+     * Lookup multiple addresses.  The arrays are loaded once for the burst
+     * except for the FIB mapping table, which may be replaced by a larger one
+     * during the burst.
+     */
+    inline void
+    lookup_index(const Key *addrs, poptrie_fib_index_t *out, int n) const
+    {
+        const u32 *dir = _poptrie->dir;
+        const poptrie_node_t *nodes = _poptrie->nodes;
+        const poptrie_leaf_t *leaves = _poptrie->leaves;
+        int i;
+
+        for ( i = 0; i < n; i++ ) {
+            out[i] = _lookup_index(dir, nodes, leaves, addrs[i]);
+        }
+    }
+    inline void
+    lookup(const Key *addrs, void **out, int n) const
+    {
+        const u32 *dir = _poptrie->dir;
+        const poptrie_node_t *nodes = _poptrie->nodes;
+        const poptrie_leaf_t *leaves = _poptrie->leaves;
+        poptrie_fib_index_t idx;
+        int i;
+
+        for ( i = 0; i < n; i++ ) {
+            idx = _lookup_index(dir, nodes, leaves, addrs[i]);
+            out[i] = POPTRIE_FIB_ENTRIES(_poptrie)[idx].entry;
+        }
+    }
+
+private:
+    /*
+     * Population count of the bits from 0 to i
+     */
+    static inline int
+    _popcnt_ls(u64 v, int i)
+    {
+        return popcnt(v & (((u64)2 << i) - 1));
+    }
+
+    /*
+     * Traverse the trie and return the FIB index
+     */
+    static inline poptrie_fib_index_t
+    _lookup_index(const u32 *dir, const poptrie_node_t *nodes,
+                  const poptrie_leaf_t *leaves, Key addr)
+    {
+        const poptrie_node_t *node;
+        u32 base;
+        int idx;
+        int pos;
+
+        /* Direct pointing */
+        base = dir[PoptrieKey<Key>::index(addr, 0, S)];
+        if ( base & ((u32)1 << 31) ) {
+            return base & (((u32)1 << 31) - 1);
+        }
+        idx = PoptrieKey<Key>::index(addr, S, Stride);
+        pos = S + Stride;
+
+        for ( ;; ) {
+            node = &nodes[base];
+            if ( (node->vector >> idx) & 1 ) {
+                /* Internal node */
+                base = node->base1 + _popcnt_ls(node->vector, idx) - 1;
+                idx = PoptrieKey<Key>::index(addr, pos, Stride);
+                pos += Stride;
+            } else {
+                /* Leaf */
+                return leaves[node->base0 + _popcnt_ls(node->leafvec, idx) - 1];
+            }
+        }
+    }
+
+    struct poptrie *_poptrie;
+    bool _allocated;
+};
+
+#endif /* _POPTRIE_HPP */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
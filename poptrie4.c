@@ -6,6 +6,7 @@
 #include "buddy.h"
 #include "poptrie.h"
 #include "poptrie_private.h"
+#include "radix.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -14,11 +15,13 @@
 
 #define KEYLENGTH       32
 
+/* Key of the radix tree, left-aligned to 128 bits */
+#define RADIX_KEY(a)    ((__uint128_t)(a) << (128 - KEYLENGTH))
+
 
 /* Prototype declarations */
 static int
-_route_add(struct poptrie *, struct radix_node **, u32, int, poptrie_leaf_t,
-           int, struct radix_node *);
+_route_add(struct poptrie *, u32, int, poptrie_leaf_t);
 static int
 _update_subtree(struct poptrie *, struct radix_node *, u32, int);
 static int
@@ -33,21 +36,26 @@ _update_inode(struct poptrie *, struct radix_node *, int, poptrie_node_t *,
 static int
 _update_dp1(struct poptrie *, struct radix_node *, int, u32, int, int);
 static int
-_update_dp2(struct poptrie *, struct radix_node *, int, u32, int, int);
+_update_dp2(struct poptrie *, struct radix_node *, int, u32, int);
 static void
 _parse_triangle(struct radix_node *, u64 *, struct radix_node *, int, int);
 static void _clear_mark(struct radix_node *);
+static int _build_insert(struct poptrie *, u32, int, poptrie_leaf_t);
 static int
-_route_change(struct poptrie *, struct radix_node **, u32, int, poptrie_leaf_t,
-              int);
+_route_change(struct poptrie *, u32, int, poptrie_leaf_t);
 static int
-_route_update(struct poptrie *, struct radix_node **, u32, int, poptrie_leaf_t,
-              int, struct radix_node *);
+_route_update(struct poptrie *, u32, int, poptrie_leaf_t);
 static int
-_route_del(struct poptrie *, struct radix_node **, u32, int, int,
-           struct radix_node *);
-static poptrie_fib_index_t
-_rib_lookup(struct radix_node *, u32, int, struct radix_node *);
+_route_del(struct poptrie *, u32, int);
+static __inline__ __attribute__((always_inline)) poptrie_fib_index_t
+_lookup_index(int, const u32 *, const poptrie_node_t *, const poptrie_leaf_t *,
+              u32);
+static __inline__ __attribute__((always_inline)) poptrie_fib_index_t
+_lookup_index_s(const u32 *, const poptrie_node_t *, const poptrie_leaf_t *,
+                u32, int);
+static void
+_lookup_batch(struct poptrie *, const u32 *, poptrie_fib_index_t *, int);
+static __inline__ int _amac_step(struct poptrie *, struct poptrie_amac_slot *);
 
 /*
  * Add a route
@@ -60,10 +68,14 @@ poptrie_route_add(struct poptrie *poptrie, u32 prefix, int len, void *nexthop)
 
     /* Find the FIB entry mapping first */
     n = poptrie_fib_ref(poptrie, nexthop);
+    if ( n < 0 ) {
+        /* The FIB mapping table is full */
+        return -1;
+    }
 
     /* Insert the prefix to the radix tree, then incrementally update the
        poptrie data structure */
-    ret = _route_add(poptrie, &poptrie->radix, prefix, len, n, 0, NULL);
+    ret = _route_add(poptrie, prefix, len, n);
     if ( ret < 0 ) {
         poptrie_fib_deref(poptrie, nexthop);
         return ret;
@@ -83,8 +95,12 @@ poptrie_route_change(struct poptrie *poptrie, u32 prefix, int len,
 
     /* Find the FIB entry mapping first */
     n = poptrie_fib_ref(poptrie, nexthop);
+    if ( n < 0 ) {
+        /* The FIB mapping table is full */
+        return -1;
+    }
 
-    return _route_change(poptrie, &poptrie->radix, prefix, len, n, 0);
+    return _route_change(poptrie, prefix, len, n);
 }
 
 /*
@@ -99,9 +115,13 @@ poptrie_route_update(struct poptrie *poptrie, u32 prefix, int len,
 
     /* Find the FIB entry mapping first */
     n = poptrie_fib_ref(poptrie, nexthop);
+    if ( n < 0 ) {
+        /* The FIB mapping table is full */
+        return -1;
+    }
 
     /* Insert to the radix tree */
-    ret = _route_update(poptrie, &poptrie->radix, prefix, len, n, 0, NULL);
+    ret = _route_update(poptrie, prefix, len, n);
     if ( ret < 0 ) {
         return ret;
     }
@@ -116,7 +136,176 @@ int
 poptrie_route_del(struct poptrie *poptrie, u32 prefix, int len)
 {
     /* Search and delete the corresponding entry */
-    return _route_del(poptrie, &poptrie->radix, prefix, len, 0, NULL);
+    return _route_del(poptrie, prefix, len);
+}
+
+/*
+ * Apply multiple route operations to the RIB, then update each affected part
+ * of the direct pointing array once
+ */
+int
+poptrie_route_batch(struct poptrie *poptrie, const struct poptrie_route_op *ops,
+                    int n)
+{
+    struct radix_node *node;
+    u32 prefix;
+    int failed;
+    int ret;
+    int end;
+    int i;
+
+    if ( n <= 0 ) {
+        return 0;
+    }
+    if ( _batch_begin(poptrie, n) < 0 ) {
+        return -1;
+    }
+
+    /* Apply the operations to the RIB; the updates are deferred */
+    failed = 0;
+    for ( i = 0; i < n; i++ ) {
+        switch ( ops[i].type ) {
+        case POPTRIE_ROUTE_ADD:
+            ret = poptrie_route_add(poptrie, ops[i].prefix, ops[i].len,
+                                    ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_CHANGE:
+            ret = poptrie_route_change(poptrie, ops[i].prefix, ops[i].len,
+                                       ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_UPDATE:
+            ret = poptrie_route_update(poptrie, ops[i].prefix, ops[i].len,
+                                       ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_DEL:
+            ret = poptrie_route_del(poptrie, ops[i].prefix, ops[i].len);
+            break;
+        default:
+            ret = -1;
+        }
+        if ( ret < 0 ) {
+            failed++;
+        }
+    }
+    poptrie->batch = 0;
+
+    /* Update the parts in the ascending order, skipping those covered by a
+       shorter prefix updated just before */
+    qsort(poptrie->spans, poptrie->nspans, sizeof(struct poptrie_span),
+          _batch_cmp);
+    end = 0;
+    ret = 0;
+    for ( i = 0; i < poptrie->nspans; i++ ) {
+        if ( poptrie->spans[i].idx < end ) {
+            continue;
+        }
+        prefix = (u32)poptrie->spans[i].idx << (KEYLENGTH - poptrie->s);
+        node = radix_mark_path(poptrie->radix, RADIX_KEY(prefix),
+                               poptrie->spans[i].len, 1);
+        if ( NULL == node ) {
+            continue;
+        }
+        if ( _update_subtree(poptrie, node, prefix, poptrie->spans[i].len)
+             < 0 ) {
+            ret = -1;
+        }
+        end = poptrie->spans[i].idx
+            + (1 << (poptrie->s - poptrie->spans[i].len));
+    }
+
+    /* Clear the marks left on the paths, including those of failed updates */
+    for ( i = 0; i < poptrie->nspans; i++ ) {
+        prefix = (u32)poptrie->spans[i].idx << (KEYLENGTH - poptrie->s);
+        node = radix_mark_path(poptrie->radix, RADIX_KEY(prefix),
+                               poptrie->spans[i].len, 0);
+        if ( NULL != node ) {
+            _clear_mark(node);
+        }
+    }
+    _batch_end(poptrie);
+
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    return failed;
+}
+
+/*
+ * Build the poptrie from a list of routes.  The RIB is built first without the
+ * propagation, and then the whole poptrie is constructed from the bottom in a
+ * single pass.
+ */
+int
+poptrie_build(struct poptrie *poptrie, const struct poptrie_prefix *prefixes,
+              size_t n)
+{
+    return poptrie_build2(poptrie, prefixes, n, 1);
+}
+
+/*
+ * Build the poptrie from a list of routes with the specified number of
+ * threads.  The entries of the direct pointing array are partitioned into
+ * chunks built by the threads in parallel.
+ */
+int
+poptrie_build2(struct poptrie *poptrie, const struct poptrie_prefix *prefixes,
+               size_t n, int nthreads)
+{
+    u32 key;
+    u32 pkey;
+    int plen;
+    int sorted;
+    size_t i;
+    int ret;
+    int nh;
+
+    if ( NULL != poptrie->radix ) {
+        /* Must be empty */
+        return -1;
+    }
+
+    /* Build the radix tree */
+    pkey = 0;
+    plen = 0;
+    sorted = 1;
+    for ( i = 0; i < n; i++ ) {
+        nh = poptrie_fib_ref(poptrie, prefixes[i].nexthop);
+        if ( nh < 0 ) {
+            /* The FIB mapping table is full */
+            return -1;
+        }
+        ret = _build_insert(poptrie, prefixes[i].prefix, prefixes[i].len, nh);
+        if ( ret < 0 ) {
+            poptrie_fib_unref(poptrie, nh);
+            return -1;
+        }
+        /* The routes covering a route come before it if sorted */
+        if ( prefixes[i].len > 0 ) {
+            key = prefixes[i].prefix >> (KEYLENGTH - prefixes[i].len)
+                << (KEYLENGTH - prefixes[i].len);
+        } else {
+            key = 0;
+        }
+        if ( key < pkey || (key == pkey && prefixes[i].len < plen) ) {
+            sorted = 0;
+        }
+        pkey = key;
+        plen = prefixes[i].len;
+    }
+    if ( NULL == poptrie->radix ) {
+        return 0;
+    }
+    if ( !sorted ) {
+        /* The nearest valid nodes set at the insertion are not final */
+        _build_ext(poptrie->radix, NULL);
+    }
+
+    /* Construct all the entries of the direct pointing from the root */
+    if ( nthreads > 1 ) {
+        return _build_parallel(poptrie, nthreads);
+    }
+    return _update_subtree(poptrie, poptrie->radix, 0, 0);
 }
 
 /*
@@ -124,6 +313,50 @@ poptrie_route_del(struct poptrie *poptrie, u32 prefix, int len)
  */
 void *
 poptrie_lookup(struct poptrie *poptrie, u32 addr)
+{
+    poptrie_fib_index_t idx;
+
+    idx = _lookup_index(poptrie->s, poptrie->dir, poptrie->nodes,
+                        poptrie->leaves, addr);
+
+    return POPTRIE_FIB_ENTRIES(poptrie)[idx].entry;
+}
+
+/*
+ * Lookup the FIB index of the route by the specified address
+ */
+poptrie_fib_index_t
+poptrie_lookup_index(struct poptrie *poptrie, u32 addr)
+{
+    return _lookup_index(poptrie->s, poptrie->dir, poptrie->nodes,
+                         poptrie->leaves, addr);
+}
+
+/*
+ * Traverse the trie and return the FIB index.  The common widths of the direct
+ * pointing are specialized so that the compiler generates constant shifts for
+ * them.
+ */
+static __inline__ poptrie_fib_index_t
+_lookup_index(int s, const u32 *dir, const poptrie_node_t *nodes,
+              const poptrie_leaf_t *leaves, u32 addr)
+{
+    switch ( s ) {
+    case 16:
+        return _lookup_index_s(dir, nodes, leaves, addr, 16);
+    case 18:
+        return _lookup_index_s(dir, nodes, leaves, addr, 18);
+    case 20:
+        return _lookup_index_s(dir, nodes, leaves, addr, 20);
+    case 22:
+        return _lookup_index_s(dir, nodes, leaves, addr, 22);
+    default:
+        return _lookup_index_s(dir, nodes, leaves, addr, s);
+    }
+}
+static __inline__ poptrie_fib_index_t
+_lookup_index_s(const u32 *dir, const poptrie_node_t *nodes,
+                const poptrie_leaf_t *leaves, u32 addr, int s)
 {
     int inode;
     int base;
@@ -131,25 +364,24 @@ poptrie_lookup(struct poptrie *poptrie, u32 addr)
     int pos;
 
     /* Top tier */
-    idx = INDEX(addr, 0, POPTRIE_S);
-    pos = POPTRIE_S;
-    base = poptrie->root;
+    idx = INDEX(addr, 0, s);
+    pos = s;
 
     /* Direct pointing */
-    if ( poptrie->dir[idx] & ((u32)1 << 31) ) {
-        return poptrie->fib.entries[poptrie->dir[idx] & (((u32)1 << 31) - 1)].entry;
+    if ( dir[idx] & ((u32)1 << 31) ) {
+        return dir[idx] & (((u32)1 << 31) - 1);
     } else {
-        base = poptrie->dir[idx];
+        base = dir[idx];
         idx = INDEX(addr, pos, 6);
         pos += 6;
     }
 
     for ( ;; ) {
         inode = base;
-        if ( VEC_BT(poptrie->nodes[inode].vector, idx) ) {
+        if ( VEC_BT(nodes[inode].vector, idx) ) {
             /* Internal node */
-            base = poptrie->nodes[inode].base1;
-            idx = POPCNT_LS(poptrie->nodes[inode].vector, idx);
+            base = nodes[inode].base1;
+            idx = POPCNT_LS(nodes[inode].vector, idx);
             /* Next internal node index */
             base = base + (idx - 1);
             /* Next node vector */
@@ -157,9 +389,9 @@ poptrie_lookup(struct poptrie *poptrie, u32 addr)
             pos += 6;
         } else {
             /* Leaf */
-            base = poptrie->nodes[inode].base0;
-            idx = POPCNT_LS(poptrie->nodes[inode].leafvec, idx);
-            return poptrie->fib.entries[poptrie->leaves[base + idx - 1]].entry;
+            base = nodes[inode].base0;
+            idx = POPCNT_LS(nodes[inode].leafvec, idx);
+            return leaves[base + idx - 1];
         }
     }
 
@@ -167,6 +399,328 @@ poptrie_lookup(struct poptrie *poptrie, u32 addr)
     return 0;
 }
 
+/*
+ * Lookup routes for multiple addresses at once
+ */
+void
+poptrie_lookup_batch(struct poptrie *poptrie, const u32 *addrs, void **out,
+                     int n)
+{
+    int i;
+    int j;
+    int k;
+    poptrie_fib_index_t fib[POPTRIE_LOOKUP_BATCH];
+
+    for ( i = 0; i < n; i += POPTRIE_LOOKUP_BATCH ) {
+        if ( n - i < POPTRIE_LOOKUP_BATCH ) {
+            k = n - i;
+        } else {
+            k = POPTRIE_LOOKUP_BATCH;
+        }
+        _lookup_batch(poptrie, addrs + i, fib, k);
+        for ( j = 0; j < k; j++ ) {
+            out[i + j] = POPTRIE_FIB_ENTRIES(poptrie)[fib[j]].entry;
+        }
+    }
+}
+
+/*
+ * Lookup the FIB indices of the routes for multiple addresses at once
+ */
+void
+poptrie_lookup_index_batch(struct poptrie *poptrie, const u32 *addrs,
+                           poptrie_fib_index_t *out, int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i += POPTRIE_LOOKUP_BATCH ) {
+        if ( n - i < POPTRIE_LOOKUP_BATCH ) {
+            _lookup_batch(poptrie, addrs + i, out + i, n - i);
+        } else {
+            _lookup_batch(poptrie, addrs + i, out + i, POPTRIE_LOOKUP_BATCH);
+        }
+    }
+}
+
+/*
+ * Lookup the FIB indices for a burst of up to POPTRIE_LOOKUP_BATCH addresses.
+ * The keys proceed stage by stage (direct pointing, then each level of
+ * internal nodes, then leaves), and the memory to be read at the next stage of
+ * every key is prefetched so that the cache misses of the keys overlap.
+ */
+static void
+_lookup_batch(struct poptrie *poptrie, const u32 *addrs,
+              poptrie_fib_index_t *fib, int n)
+{
+    int i;
+    int j;
+    int np;
+    int nnp;
+    int pos;
+    int idx;
+    u32 base[POPTRIE_LOOKUP_BATCH];
+    int pending[POPTRIE_LOOKUP_BATCH];
+    poptrie_node_t *node;
+
+    /* Prefetch the direct pointing entries */
+    for ( i = 0; i < n; i++ ) {
+        PREFETCH(&poptrie->dir[INDEX(addrs[i], 0, poptrie->s)]);
+    }
+
+    /* Direct pointing */
+    np = 0;
+    for ( i = 0; i < n; i++ ) {
+        base[i] = poptrie->dir[INDEX(addrs[i], 0, poptrie->s)];
+        if ( base[i] & ((u32)1 << 31) ) {
+            /* Leaf */
+            fib[i] = base[i] & (((u32)1 << 31) - 1);
+            base[i] = (u32)-1;
+        } else {
+            /* Internal node */
+            PREFETCH(&poptrie->nodes[base[i]]);
+            pending[np] = i;
+            np++;
+        }
+    }
+
+    /* Descend the internal nodes level by level */
+    pos = poptrie->s;
+    while ( np > 0 ) {
+        nnp = 0;
+        for ( j = 0; j < np; j++ ) {
+            i = pending[j];
+            node = &poptrie->nodes[base[i]];
+            idx = INDEX(addrs[i], pos, 6);
+            if ( VEC_BT(node->vector, idx) ) {
+                /* Internal node */
+                base[i] = node->base1 + POPCNT_LS(node->vector, idx) - 1;
+                PREFETCH(&poptrie->nodes[base[i]]);
+                pending[nnp] = i;
+                nnp++;
+            } else {
+                /* Leaf */
+                base[i] = node->base0 + POPCNT_LS(node->leafvec, idx) - 1;
+                PREFETCH(&poptrie->leaves[base[i]]);
+            }
+        }
+        np = nnp;
+        pos += 6;
+    }
+
+    /* Leaves */
+    for ( i = 0; i < n; i++ ) {
+        if ( (u32)-1 != base[i] ) {
+            fib[i] = poptrie->leaves[base[i]];
+        }
+    }
+}
+
+/*
+ * Initialize a ring of sz in-flight lookups for the asynchronous lookup
+ */
+struct poptrie_amac *
+poptrie_amac_init(struct poptrie_amac *amac, struct poptrie *poptrie, int sz)
+{
+    int i;
+
+    if ( sz <= 0 ) {
+        return NULL;
+    }
+
+    if ( NULL == amac ) {
+        /* Allocate new one */
+        amac = malloc(sizeof(struct poptrie_amac));
+        if ( NULL == amac ) {
+            return NULL;
+        }
+        (void)memset(amac, 0, sizeof(struct poptrie_amac));
+        amac->_allocated = 1;
+    } else {
+        (void)memset(amac, 0, sizeof(struct poptrie_amac));
+    }
+
+    amac->slots = malloc(sizeof(struct poptrie_amac_slot) * sz);
+    if ( NULL == amac->slots ) {
+        poptrie_amac_release(amac);
+        return NULL;
+    }
+    for ( i = 0; i < sz; i++ ) {
+        amac->slots[i].stage = POPTRIE_AMAC_EMPTY;
+    }
+    amac->poptrie = poptrie;
+    amac->sz = sz;
+    amac->cur = 0;
+    amac->n = 0;
+
+    return amac;
+}
+
+/*
+ * Release the ring of the asynchronous lookup
+ */
+void
+poptrie_amac_release(struct poptrie_amac *amac)
+{
+    if ( amac->slots ) {
+        free(amac->slots);
+    }
+    if ( amac->_allocated ) {
+        free(amac);
+    }
+}
+
+/*
+ * Submit a lookup of addr.  If all the slots are in flight, the lookups in the
+ * ring are advanced in a round-robin manner until one of them completes.  The
+ * next hop is stored to *out when the lookup completes.
+ */
+void
+poptrie_amac_submit(struct poptrie_amac *amac, u32 addr, void **out)
+{
+    struct poptrie_amac_slot *slot;
+
+    for ( ;; ) {
+        slot = &amac->slots[amac->cur];
+        amac->cur++;
+        if ( amac->cur >= amac->sz ) {
+            amac->cur = 0;
+        }
+        if ( POPTRIE_AMAC_EMPTY == slot->stage ) {
+            break;
+        }
+        /* Advance the lookup in this slot by one stage */
+        if ( _amac_step(amac->poptrie, slot) ) {
+            /* Completed */
+            amac->n--;
+            break;
+        }
+    }
+
+    /* Start the new lookup from the direct pointing */
+    slot->stage = POPTRIE_AMAC_DIR;
+    slot->key = addr;
+    slot->base = INDEX(addr, 0, amac->poptrie->s);
+    slot->out = out;
+    PREFETCH(&amac->poptrie->dir[slot->base]);
+    amac->n++;
+}
+
+/*
+ * Complete all the in-flight lookups
+ */
+void
+poptrie_amac_flush(struct poptrie_amac *amac)
+{
+    struct poptrie_amac_slot *slot;
+
+    while ( amac->n > 0 ) {
+        slot = &amac->slots[amac->cur];
+        amac->cur++;
+        if ( amac->cur >= amac->sz ) {
+            amac->cur = 0;
+        }
+        if ( POPTRIE_AMAC_EMPTY != slot->stage
+             && _amac_step(amac->poptrie, slot) ) {
+            amac->n--;
+        }
+    }
+}
+
+/*
+ * Lookup routes for multiple addresses through the ring
+ */
+void
+poptrie_amac_lookup(struct poptrie_amac *amac, const u32 *addrs, void **out,
+                    int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        poptrie_amac_submit(amac, addrs[i], out + i);
+    }
+    poptrie_amac_flush(amac);
+}
+
+/*
+ * Advance a lookup state machine by one stage, and prefetch the memory for
+ * the next stage.  This returns 1 when the lookup is completed.
+ */
+static __inline__ int
+_amac_step(struct poptrie *poptrie, struct poptrie_amac_slot *slot)
+{
+    u32 d;
+    int idx;
+    poptrie_node_t *node;
+
+    switch ( slot->stage ) {
+    case POPTRIE_AMAC_DIR:
+        d = poptrie->dir[slot->base];
+        if ( d & ((u32)1 << 31) ) {
+            /* Leaf */
+            *slot->out
+                = POPTRIE_FIB_ENTRIES(poptrie)[d & (((u32)1 << 31) - 1)].entry;
+            slot->stage = POPTRIE_AMAC_EMPTY;
+            return 1;
+        }
+        slot->base = d;
+        slot->pos = poptrie->s;
+        slot->stage = POPTRIE_AMAC_NODE;
+        PREFETCH(&poptrie->nodes[slot->base]);
+        return 0;
+    case POPTRIE_AMAC_NODE:
+        node = &poptrie->nodes[slot->base];
+        idx = INDEX(slot->key, slot->pos, 6);
+        if ( VEC_BT(node->vector, idx) ) {
+            /* Internal node */
+            slot->base = node->base1 + POPCNT_LS(node->vector, idx) - 1;
+            slot->pos += 6;
+            PREFETCH(&poptrie->nodes[slot->base]);
+        } else {
+            /* Leaf */
+            slot->base = node->base0 + POPCNT_LS(node->leafvec, idx) - 1;
+            slot->stage = POPTRIE_AMAC_LEAF;
+            PREFETCH(&poptrie->leaves[slot->base]);
+        }
+        return 0;
+    case POPTRIE_AMAC_LEAF:
+        d = poptrie->leaves[slot->base];
+        *slot->out = POPTRIE_FIB_ENTRIES(poptrie)[d].entry;
+        slot->stage = POPTRIE_AMAC_EMPTY;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Lookup a route by the specified address on the replica of a NUMA node
+ */
+void *
+poptrie_replica_lookup(struct poptrie *poptrie, int node, u32 addr)
+{
+    struct poptrie_replica *r;
+    poptrie_fib_index_t idx;
+
+    if ( node < 0 || node >= poptrie->nreplicas ) {
+        /* No replica */
+        return poptrie_lookup(poptrie, addr);
+    }
+    r = &poptrie->replicas[node];
+    idx = _lookup_index(poptrie->s, r->dir, r->nodes, r->leaves, addr);
+
+    return POPTRIE_FIB_ENTRIES(poptrie)[idx].entry;
+}
+
+/*
+ * Lookup a route by the specified address on the replica of the NUMA node of
+ * the current thread
+ */
+void *
+poptrie_lookup_local(struct poptrie *poptrie, u32 addr)
+{
+    return poptrie_replica_lookup(poptrie, replica_local(), addr);
+}
+
 /*
  * Lookup the next hop from the radix tree (RIB table)
  */
@@ -175,7 +729,7 @@ poptrie_rib_lookup(struct poptrie *poptrie, u32 addr)
 {
     poptrie_fib_index_t idx;
 
-    idx = _rib_lookup(poptrie->radix, addr, 0, NULL);
+    idx = radix_lookup(poptrie->radix, RADIX_KEY(addr));
     return poptrie->fib.entries[idx].entry;
 }
 
@@ -189,6 +743,7 @@ _update_subtree(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
     int ret;
     struct poptrie_stack stack[KEYLENGTH / 6 + 1];
     struct radix_node *ntnode;
+    struct radix_node tmp;
     int idx;
     int i;
     u32 *tmpdir;
@@ -199,12 +754,22 @@ _update_subtree(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
     stack[0].idx = -1;
     stack[0].width = -1;
 
-    if ( depth < POPTRIE_S ) {
+    if ( poptrie->batch ) {
+        /* Mark the path to this node, and defer the update to the end of the
+           route batch */
+        radix_mark_path(poptrie->radix, RADIX_KEY(prefix), depth, 1);
+        node->mark = 1;
+        _batch_defer(poptrie, INDEX(prefix, 0, poptrie->s), depth);
+        return 0;
+    }
+
+    if ( depth < poptrie->s ) {
          /* The update is performed from more than one entries in the direct
            pointing array. */
 
-        /* Copy the direct pointing array from the current one */
-        memcpy(poptrie->altdir, poptrie->dir, sizeof(u32) << POPTRIE_S);
+        /* The alternative direct pointing array is kept identical to the
+           current one between updates, so that only the entries covered by
+           the prefix are rewritten and swapped in at once. */
 
         /* Perform the update from the direct pointing at altdir */
         ret = _update_dp1(poptrie, poptrie->radix, 1, prefix, depth, 0);
@@ -216,18 +781,18 @@ _update_subtree(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
 
         /* Get the starting index at the direct pointing corresponding to the
            depth */
-        idx = INDEX(prefix, 0, POPTRIE_S)
-            >> (POPTRIE_S - depth)
-            << (POPTRIE_S - depth);
+        idx = INDEX(prefix, 0, poptrie->s)
+            >> (poptrie->s - depth)
+            << (poptrie->s - depth);
         /* Clean the old trie */
-        for ( i = 0; i < (1 << (POPTRIE_S - depth)); i++ ) {
+        for ( i = 0; i < (1 << (poptrie->s - depth)); i++ ) {
             if ( poptrie->dir[idx + i] != poptrie->altdir[idx + i] ) {
                 /* This entry is updated then clean up the subtree */
                 if ( (poptrie->dir[idx + i] & ((u32)1 << 31))
                      && !(poptrie->altdir[idx + i] & ((u32)1 << 31)) ) {
                     /* Updated from internal node to leaf */
                     _update_clean_subtree(poptrie, poptrie->altdir[idx + i]);
-                    buddy_free2(poptrie->cnodes, poptrie->altdir[idx + i]);
+                    _free_nodes(poptrie, poptrie->altdir[idx + i]);
                 } else if ( !(poptrie->altdir[idx + i] & ((u32)1 << 31)) ) {
                     /* Updated from internal node to internal node */
                     _update_clean_root(poptrie, poptrie->dir[idx + i],
@@ -235,18 +800,23 @@ _update_subtree(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
                 }
             }
         }
-    } else if ( depth == POPTRIE_S ) {
+        /* Bring the old array up to date for the next update */
+        memcpy(poptrie->altdir + idx, poptrie->dir + idx,
+               sizeof(u32) << (poptrie->s - depth));
+    } else if ( depth == poptrie->s ) {
         /* The update is performed from an entry in the direct pointing
            array. */
         ret = _update_dp1(poptrie, poptrie->radix, 0, prefix, depth, 0);
+        idx = INDEX(prefix, 0, poptrie->s);
+        poptrie->altdir[idx] = poptrie->dir[idx];
     } else {
         /* The update is performed at some triangles under the direct pointing
            array. */
 
         /* Get the index at direct pointing */
-        idx = INDEX(prefix, 0, POPTRIE_S);
+        idx = INDEX(prefix, 0, poptrie->s);
         /* Get the corresponding node in the radix tree */
-        ntnode = _next_block(poptrie->radix, idx, 0, POPTRIE_S);
+        ntnode = _next_block(poptrie->radix, idx, 0, poptrie->s, &tmp);
         /* Get the corresponding node */
         if ( poptrie->dir[idx] & ((u32)1 << 31) ) {
             /* If the entry points to a leaf */
@@ -256,8 +826,27 @@ _update_subtree(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
             inode = poptrie->dir[idx];
         }
         ret = _descend_and_update(poptrie, ntnode, inode, &stack[1], prefix,
-                                  depth, POPTRIE_S, &poptrie->dir[idx]);
+                                  depth, poptrie->s, &poptrie->dir[idx]);
+        poptrie->altdir[idx] = poptrie->dir[idx];
     }
+    /* Apply the updated part to the replicas even if the update has failed
+       halfway */
+    if ( NULL != poptrie->dirty ) {
+        if ( depth < poptrie->s ) {
+            idx = INDEX(prefix, 0, poptrie->s)
+                >> (poptrie->s - depth)
+                << (poptrie->s - depth);
+            replica_sync(poptrie, idx, 1 << (poptrie->s - depth));
+        } else {
+            replica_sync(poptrie, INDEX(prefix, 0, poptrie->s), 1);
+        }
+    }
+
+    /* Return the released blocks that the readers have passed */
+    if ( NULL != poptrie->limbo ) {
+        qsbr_reclaim(poptrie);
+    }
+
     if ( ret < 0 ) {
         return -1;
     }
@@ -278,56 +867,61 @@ _descend_and_update(struct poptrie *poptrie, struct radix_node *tnode,
 {
     int idx;
     int p;
-    int n;
     struct poptrie_node *node;
     struct radix_node *ntnode;
+    struct radix_node tmp[2];
+    int t;
     int width;
-    int ninode;
 
-    /* Get the corresponding child */
-    if ( 0 == depth ) {
-        width = POPTRIE_S;
-    } else {
-        width = 6;
-    }
-
-    if ( len <= depth + width ) {
-        /* This is the top of the marked part */
-        return _update_part(poptrie, tnode, inode, stack, root, 0);
-    } else {
-        /* This is not the top of the marked part, then traverse to a child */
-        idx = INDEX(prefix, depth, width);
+    /* The root of the next block is materialized in tmp[t], and tnode may be
+       the other one */
+    t = 0;
+    for ( ;; ) {
+        /* Get the corresponding child */
+        if ( 0 == depth ) {
+            width = poptrie->s;
+        } else {
+            width = 6;
+        }
 
+        if ( len <= depth + width ) {
+            /* This is the top of the marked part */
+            return _update_part(poptrie, tnode, inode, stack, root, 0);
+        }
         if ( inode < 0 ) {
             /* If the current node was leaf, then update the partial tree. */
             return _update_part(poptrie, tnode, inode, stack, root, 0);
         }
 
+        /* This is not the top of the marked part, then traverse to a child */
+        idx = INDEX(prefix, depth, width);
+
         /* Get the corresponding node */
         node = poptrie->nodes + inode + NODEINDEX(idx);
 
         /* The root of the next block */
-        ntnode = _next_block(tnode, idx, 0, width);
+        ntnode = _next_block(tnode, idx, 0, width, &tmp[t]);
         if ( NULL == ntnode ) {
             return _update_part(poptrie, tnode, inode, stack, root, 0);
         }
+        t ^= 1;
+
+        stack->inode = inode;
+        stack->idx = idx;
+        stack->width = width;
+        stack++;
 
         /* Check the vector */
         if ( VEC_BT(node->vector, BITINDEX(idx)) ) {
             /* Internal node, then traverse to the child */
             p = POPCNT_LS(node->vector, BITINDEX(idx));
-            n = (p - 1);
-            ninode = node->base1 + n;
+            inode = node->base1 + (p - 1);
         } else {
             /* Leaf node, then update from this node */
-            ninode = -1;
+            inode = -1;
         }
-        stack->inode = inode;
-        stack->idx = idx;
-        stack->width = width;
-        stack++;
-        return _descend_and_update(poptrie, ntnode, ninode, stack, prefix, len,
-                                   depth + width, root);
+        tnode = ntnode;
+        depth += width;
     }
 }
 
@@ -338,423 +932,302 @@ static int
 _update_dp1(struct poptrie *poptrie, struct radix_node *tnode, int alt,
             u32 prefix, int len, int depth)
 {
-    int i;
     int idx;
-
-    if ( depth == len ) {
-        return _update_dp2(poptrie, tnode, alt, prefix, len, depth);
-    }
-
-    if ( BT(prefix, KEYLENGTH - depth - 1) ) {
-        /* Right */
-        if ( tnode->right ) {
-            return _update_dp1(poptrie, tnode->right, alt, prefix, len,
-                               depth + 1);
-        } else {
-            idx = INDEX(prefix, 0, POPTRIE_S)
-                >> (POPTRIE_S - len)
-                << (POPTRIE_S - len);
-            for ( i = 0; i < (1 << (POPTRIE_S - len)); i++ ) {
-                if ( alt ) {
-                    poptrie->altdir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                } else {
-                    poptrie->dir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                    _update_clean_subtree(poptrie, poptrie->dir[idx + i]);
-                    if ( (int)poptrie->dir[idx + i] >= 0 ) {
-                        buddy_free2(poptrie->cnodes, poptrie->dir[idx + i]);
-                    }
-                }
-            }
-            return 0;
-        }
-    } else {
-        /* Left */
-        if ( tnode->left ) {
-            return _update_dp1(poptrie, tnode->left, alt, prefix, len,
-                               depth + 1);
-        } else {
-            idx = INDEX(prefix, 0, POPTRIE_S)
-                >> (POPTRIE_S - len)
-                << (POPTRIE_S - len);
-            for ( i = 0; i < (1 << (POPTRIE_S - len)); i++ ) {
-                if ( alt ) {
-                    poptrie->altdir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                } else {
-                    poptrie->dir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                    _update_clean_subtree(poptrie, poptrie->dir[idx + i]);
-                    if ( (int)poptrie->dir[idx + i] >= 0 ) {
-                        buddy_free2(poptrie->cnodes, poptrie->dir[idx + i]);
-                    }
-                }
-            }
+    struct radix_node tmp;
+    struct radix_node *child;
+
+    /* Descend to the prefix; radix_child() does not modify tmp when it returns
+       NULL */
+    while ( depth < len ) {
+        child = radix_child(tnode, BT(prefix, KEYLENGTH - depth - 1), &tmp);
+        if ( NULL == child ) {
+            idx = INDEX(prefix, 0, poptrie->s)
+                >> (poptrie->s - len)
+                << (poptrie->s - len);
+            _update_dp_leaves(poptrie, alt, idx, 1 << (poptrie->s - len),
+                              EXT_NH(tnode));
             return 0;
         }
+        tnode = child;
+        depth++;
     }
+
+    return _update_dp2(poptrie, tnode, alt, prefix, depth);
 }
+
+/*
+ * Update the entries of the direct pointing array under the node at the depth.
+ * The subtree is traversed in the preorder with the path held in the arrays
+ * indexed by the depth; the node omitted at a depth is materialized in
+ * tmp[depth].
+ */
 static int
 _update_dp2(struct poptrie *poptrie, struct radix_node *tnode, int alt,
-            u32 prefix, int len, int depth)
+            u32 prefix, int depth)
 {
-    int i;
     int idx;
     int ret;
-    struct poptrie_stack stack[KEYLENGTH / 6 + 1];
+    int top;
+    int right;
+    int inode;
+    struct poptrie_stack stack[2];
+    struct radix_node *nodes[POPTRIE_S_MAX + 1];
+    struct radix_node tmp[POPTRIE_S_MAX + 1];
+    u32 prefixes[POPTRIE_S_MAX + 1];
+    u8 state[POPTRIE_S_MAX + 1];
+    struct radix_node *child;
 
-    if ( depth == POPTRIE_S ) {
-        idx = INDEX(prefix, 0, POPTRIE_S);
-        stack[0].inode = -1;
-        stack[0].idx = -1;
-        stack[0].width = -1;
+    /* Sentinel */
+    stack[0].inode = -1;
+    stack[0].idx = -1;
+    stack[0].width = -1;
 
-        if ( poptrie->dir[idx] & ((u32)1 << 31) ) {
-            if ( alt ) {
-                ret = _update_part(poptrie, tnode, -1, &stack[1],
-                                   &poptrie->altdir[idx], alt);
+    ret = 0;
+    top = depth;
+    nodes[depth] = tnode;
+    prefixes[depth] = prefix;
+    state[depth] = 0;
+    while ( depth >= top ) {
+        tnode = nodes[depth];
+        prefix = prefixes[depth];
+        if ( depth == poptrie->s ) {
+            /* Update the entry */
+            idx = INDEX(prefix, 0, poptrie->s);
+            if ( poptrie->dir[idx] & ((u32)1 << 31) ) {
+                inode = -1;
             } else {
-                ret = _update_part(poptrie, tnode, -1, &stack[1],
-                                   &poptrie->dir[idx], alt);
+                inode = poptrie->dir[idx];
             }
-        } else {
-            if ( alt ) {
-                ret = _update_part(poptrie, tnode, poptrie->dir[idx], &stack[1],
-                                   &poptrie->altdir[idx], alt);
-            } else {
-                ret = _update_part(poptrie, tnode, poptrie->dir[idx], &stack[1],
-                                   &poptrie->dir[idx], alt);
+            if ( _update_part(poptrie, tnode, inode, &stack[1],
+                              alt ? &poptrie->altdir[idx] : &poptrie->dir[idx],
+                              alt) < 0 ) {
+                ret = -1;
             }
+            depth--;
+            continue;
+        }
+        if ( state[depth] > 1 ) {
+            /* Both the children are done */
+            depth--;
+            continue;
         }
-        return ret;
-    }
 
-    if ( tnode->left ) {
-        _update_dp2(poptrie, tnode->left, alt, prefix, len, depth + 1);
-    } else {
-        idx = INDEX(prefix, 0, POPTRIE_S)
-            >> (POPTRIE_S - depth) << (POPTRIE_S - depth);
-        for ( i = 0; i < (1 << (POPTRIE_S - depth - 1)); i++ ) {
-            if ( alt ) {
-                poptrie->altdir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-            } else {
-                poptrie->dir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                _update_clean_subtree(poptrie, poptrie->dir[idx + i]);
-                if ( (int)poptrie->dir[idx + i] >= 0 ) {
-                    buddy_free2(poptrie->cnodes, poptrie->dir[idx + i]);
-                }
-            }
+        /* Left, and then right */
+        right = state[depth]++;
+        if ( right ) {
+            prefix |= (u32)1 << (KEYLENGTH - depth - 1);
         }
-    }
-    if ( tnode->right ) {
-        prefix |= 1 << (KEYLENGTH - depth - 1);
-        return _update_dp2(poptrie, tnode->right, alt, prefix, len, depth + 1);
-    } else {
-        idx = INDEX(prefix, 0, POPTRIE_S)
-            >> (POPTRIE_S - depth)
-            << (POPTRIE_S - depth);
-        idx += 1 << (POPTRIE_S - depth - 1);
-        for ( i = 0; i < (1 << (POPTRIE_S - depth - 1)); i++ ) {
-            if ( alt ) {
-                poptrie->altdir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-            } else {
-                poptrie->dir[idx + i] = ((u32)1 << 31) | EXT_NH(tnode);
-                _update_clean_subtree(poptrie, poptrie->dir[idx + i]);
-                if ( (int)poptrie->dir[idx + i] >= 0 ) {
-                    buddy_free2(poptrie->cnodes, poptrie->dir[idx + i]);
-                }
-            }
+        child = radix_child(tnode, right, &tmp[depth + 1]);
+        if ( child ) {
+            nodes[depth + 1] = child;
+            prefixes[depth + 1] = prefix;
+            state[depth + 1] = 0;
+            depth++;
+        } else {
+            idx = INDEX(prefix, 0, poptrie->s)
+                >> (poptrie->s - depth)
+                << (poptrie->s - depth);
+            idx += right << (poptrie->s - depth - 1);
+            _update_dp_leaves(poptrie, alt, idx,
+                              1 << (poptrie->s - depth - 1), EXT_NH(tnode));
         }
     }
 
-    return 0;
+    return ret;
 }
 
 /*
- * Recursive function to add a route to the poptrie data structure while
- * inserting the route to the RIB (radix tree)
+ * Add a route at the node of the prefix in the radix tree, and update the
+ * poptrie data structure
  */
 static int
-_route_add(struct poptrie *poptrie, struct radix_node **node,
-           u32 prefix, int len, poptrie_leaf_t nexthop, int depth,
-           struct radix_node *ext)
-{
-    if ( NULL == *node ) {
-        *node = malloc(sizeof(struct radix_node));
-        if ( NULL == *node ) {
-            /* Memory error */
-            return -1;
-        }
-        (*node)->valid = 0;
-        (*node)->left = NULL;
-        (*node)->right = NULL;
-        (*node)->ext = ext;
-        (*node)->mark = 0;
+_add_node(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
+          int len, poptrie_leaf_t nexthop)
+{
+    if ( node->valid ) {
+        /* Already exists */
+        return -1;
     }
+    node->valid = 1;
+    node->nexthop = nexthop;
+    node->ext = node;
 
-    if ( len == depth ) {
-        /* Matched */
-        if ( (*node)->valid ) {
-            /* Already exists */
-            return -1;
-        }
-        (*node)->valid = 1;
-        (*node)->nexthop = nexthop;
-        (*node)->len = len;
-
-        /* Propagate this route to children */
-        (*node)->mark = poptrie_route_add_propagate(*node, *node);
+    /* Propagate this route to children */
+    poptrie_route_propagate(node);
 
-        /* Update the poptrie subtree */
-        return _update_subtree(poptrie, *node, prefix, depth);
-    } else {
-        if ( (*node)->valid ) {
-            ext = *node;
-        }
-        if ( BT(prefix, KEYLENGTH - depth - 1) ) {
-            /* Search to the right */
-            return _route_add(poptrie, &((*node)->right), prefix, len, nexthop,
-                              depth + 1, ext);
-        } else {
-            /* Search to the left */
-            return _route_add(poptrie, &((*node)->left), prefix, len, nexthop,
-                              depth + 1, ext);
-        }
-    }
+    /* Update the poptrie subtree */
+    return _update_subtree(poptrie, node, prefix, len);
 }
 
 /*
- * Change a route
+ * Change the next hop of the route at the node of the prefix
  */
 static int
-_route_change(struct poptrie *poptrie, struct radix_node **node, u32 prefix,
-              int len, poptrie_leaf_t nexthop, int depth)
+_change_node(struct poptrie *poptrie, struct radix_node *node, u32 prefix,
+             int len, poptrie_leaf_t nexthop)
 {
     int ret;
     int n;
 
-    if ( NULL == *node ) {
-        /* Must have the entry for route_change() */
+    if ( !node->valid ) {
+        /* Not exists */
         return -1;
     }
 
-    if ( len == depth ) {
-        /* Matched */
-        if ( !(*node)->valid ) {
-            /* Not exists */
-            return -1;
-        }
-        /* Update the entry */
-        if ( (*node)->nexthop != nexthop ) {
-            n = (*node)->nexthop;
-            (*node)->nexthop = nexthop;
-            (*node)->mark = poptrie_route_change_propagate(*node, *node);
-
-            /* Marked root */
-            ret =  _update_subtree(poptrie, *node, prefix, depth);
+    /* Update the entry */
+    if ( node->nexthop != nexthop ) {
+        n = node->nexthop;
+        node->nexthop = nexthop;
+        poptrie_route_propagate(node);
 
-            /* Dereference this entry */
-            poptrie->fib.entries[n].refs--;
+        /* Marked root */
+        ret = _update_subtree(poptrie, node, prefix, len);
 
-            return ret;
-        } else {
-            n = nexthop;
-            /* Dereference this entry */
-            poptrie->fib.entries[n].refs--;
+        /* Dereference this entry */
+        poptrie_fib_unref(poptrie, n);
 
-            return 0;
-        }
+        return ret;
     } else {
-        if ( BT(prefix, KEYLENGTH - depth - 1) ) {
-            /* Right */
-            return _route_change(poptrie, &((*node)->right), prefix, len,
-                                 nexthop, depth + 1);
-        } else {
-            /* Left */
-            return _route_change(poptrie, &((*node)->left), prefix, len,
-                                 nexthop, depth + 1);
-        }
+        n = nexthop;
+        /* Dereference this entry */
+        poptrie_fib_unref(poptrie, n);
+
+        return 0;
     }
 }
 
 /*
- * Update a route
+ * Add a route to the poptrie data structure while inserting the route to the
+ * RIB (radix tree)
  */
 static int
-_route_update(struct poptrie *poptrie, struct radix_node **node, u32 prefix,
-              int len, poptrie_leaf_t nexthop, int depth,
-              struct radix_node *ext)
+_route_add(struct poptrie *poptrie, u32 prefix, int len,
+           poptrie_leaf_t nexthop)
 {
-    int ret;
-    int n;
+    struct radix_node *node;
 
-    if ( NULL == *node ) {
-        *node = malloc(sizeof(struct radix_node));
-        if ( NULL == *node ) {
-            /* Memory error */
-            return -1;
-        }
-        (*node)->valid = 0;
-        (*node)->left = NULL;
-        (*node)->right = NULL;
-        (*node)->ext = ext;
-        (*node)->mark = 0;
+    if ( len < 0 || len > KEYLENGTH ) {
+        return -1;
+    }
+    node = radix_insert(poptrie, RADIX_KEY(prefix), len);
+    if ( NULL == node ) {
+        /* Memory error */
+        return -1;
     }
 
-    if ( len == depth ) {
-        /* Matched */
-        if ( (*node)->valid ) {
-            /* Already exists */
-            if ( (*node)->nexthop != nexthop ) {
-                n = (*node)->nexthop;
-                (*node)->nexthop = nexthop;
-                (*node)->mark = poptrie_route_change_propagate(*node, *node);
+    return _add_node(poptrie, node, prefix, len, nexthop);
+}
 
-                /* Marked root */
-                ret = _update_subtree(poptrie, *node, prefix, depth);
+/*
+ * Change a route
+ */
+static int
+_route_change(struct poptrie *poptrie, u32 prefix, int len,
+              poptrie_leaf_t nexthop)
+{
+    struct radix_node *node;
 
-                /* Dereference this entry */
-                poptrie->fib.entries[n].refs--;
+    node = radix_find(poptrie->radix, RADIX_KEY(prefix), len, NULL);
+    if ( NULL == node ) {
+        /* Must have the entry for route_change() */
+        return -1;
+    }
 
-                return ret;
-            } else {
-                n = nexthop;
-                /* Dereference this entry */
-                poptrie->fib.entries[n].refs--;
+    return _change_node(poptrie, node, prefix, len, nexthop);
+}
 
-                return 0;
-            }
-        } else {
-            (*node)->valid = 1;
-            (*node)->nexthop = nexthop;
-            (*node)->len = len;
+/*
+ * Update a route
+ */
+static int
+_route_update(struct poptrie *poptrie, u32 prefix, int len,
+              poptrie_leaf_t nexthop)
+{
+    struct radix_node *node;
 
-            /* Propagate this route to children */
-            (*node)->mark = poptrie_route_add_propagate(*node, *node);
+    if ( len < 0 || len > KEYLENGTH ) {
+        return -1;
+    }
+    node = radix_insert(poptrie, RADIX_KEY(prefix), len);
+    if ( NULL == node ) {
+        /* Memory error */
+        return -1;
+    }
 
-            /* Update MBT */
-            return _update_subtree(poptrie, *node, prefix, depth);
-        }
-    } else {
-        if ( (*node)->valid ) {
-            ext = *node;
-        }
-        if ( BT(prefix, KEYLENGTH - depth - 1) ) {
-            /* Right */
-            return _route_update(poptrie, &((*node)->right), prefix, len,
-                                 nexthop, depth + 1, ext);
-        } else {
-            /* Left */
-            return _route_update(poptrie, &((*node)->left), prefix, len,
-                                 nexthop, depth + 1, ext);
-        }
+    if ( node->valid ) {
+        /* Already exists */
+        return _change_node(poptrie, node, prefix, len, nexthop);
     }
+
+    return _add_node(poptrie, node, prefix, len, nexthop);
 }
 
 /*
  * Delete a route
  */
 static int
-_route_del(struct poptrie *poptrie, struct radix_node **node, u32 prefix,
-           int len, int depth, struct radix_node *ext)
+_route_del(struct poptrie *poptrie, u32 prefix, int len)
 {
+    struct radix_node *node;
     int ret;
     int n;
 
-    if ( NULL == *node ) {
+    node = radix_find(poptrie->radix, RADIX_KEY(prefix), len, NULL);
+    if ( NULL == node || !node->valid ) {
+        /* No entry found */
         return -1;
     }
 
-    if ( len == depth ) {
-        if ( !(*node)->valid ) {
-            /* No entry found */
-            return -1;
-        }
-
-        /* Propagate first */
-        (*node)->mark = poptrie_route_del_propagate(*node, *node, ext);
-
-        /* Invalidate the node */
-        n = (*node)->nexthop;
-        (*node)->valid = 0;
-        (*node)->nexthop = 0;
+    /* Invalidate the node, and propagate the nearest valid route of the
+       parent, which is resolved by the update (or none at the root) */
+    n = node->nexthop;
+    node->valid = 0;
+    node->nexthop = 0;
+    node->ext = NULL;
+    poptrie_route_propagate(node);
 
-        /* Marked root */
-        ret = _update_subtree(poptrie, *node, prefix, depth);
-        if ( ret < 0 ) {
-            return -1;
-        }
-
-        /* May need to delete this node if both children are empty, but we do
-           not care in this implementation because we have a large amount
-           memory and the unused memory does not affect the performance. */
+    /* Marked root */
+    ret = _update_subtree(poptrie, node, prefix, len);
+    if ( ret < 0 ) {
+        return -1;
+    }
 
-        /* Dereference this entry */
-        poptrie->fib.entries[n].refs--;
+    /* Release the nodes neither holding a route nor branching any longer */
+    _rib_prune(poptrie, RADIX_KEY(prefix), len);
 
-        return 0;
-    } else {
-        /* Update the propagate node if valid */
-        if ( (*node)->valid ) {
-            ext = *node;
-        }
-        /* Traverse a child node */
-        if ( BT(prefix, KEYLENGTH - depth - 1) ) {
-            /* Right */
-            ret = _route_del(poptrie, &((*node)->right), prefix, len, depth + 1,
-                             ext);
-        } else {
-            /* Left */
-            ret = _route_del(poptrie, &((*node)->left), prefix, len, depth + 1,
-                             ext);
-        }
-        if ( ret < 0 ) {
-            return ret;
-        }
-        /* Delete this node if both children are empty */
-        if ( NULL == (*node)->left && NULL == (*node)->right ) {
-            free(*node);
-            *node = NULL;
-        }
-        return ret;
-    }
+    /* Dereference this entry */
+    poptrie_fib_unref(poptrie, n);
 
-    return -1;
+    return 0;
 }
 
 /*
- * Lookup from the RIB table
+ * Insert a route to the radix tree without the propagation; the nearest valid
+ * nodes are set as of the insertion
  */
-static poptrie_fib_index_t
-_rib_lookup(struct radix_node *node, u32 addr, int depth, struct radix_node *en)
+static int
+_build_insert(struct poptrie *poptrie, u32 prefix, int len,
+              poptrie_leaf_t nexthop)
 {
+    struct radix_node *node;
+
+    if ( len < 0 || len > KEYLENGTH ) {
+        return -1;
+    }
+    node = radix_insert(poptrie, RADIX_KEY(prefix), len);
     if ( NULL == node ) {
-        return 0;
+        /* Memory error */
+        return -1;
     }
     if ( node->valid ) {
-        en = node;
+        /* Duplicate */
+        return -1;
     }
+    node->valid = 1;
+    node->nexthop = nexthop;
+    node->ext = node;
 
-    if ( BT(addr, KEYLENGTH - depth - 1) ) {
-        /* Right */
-        if ( NULL == node->right ) {
-            if ( NULL != en ) {
-                return en->nexthop;
-            } else {
-                return 0;
-            }
-        } else {
-            return _rib_lookup(node->right, addr, depth + 1, en);
-        }
-    } else {
-        /* Left */
-        if ( NULL == node->left ) {
-            if ( NULL != en ) {
-                return en->nexthop;
-            } else {
-                return 0;
-            }
-        } else {
-            return _rib_lookup(node->left, addr, depth + 1, en);
-        }
-    }
+    return 0;
 }
 
 /*
@@ -0,0 +1,404 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "poptrie.h"
+#include <stdlib.h>
+
+/*
+ * Vectorized IPv4 lookup.  Each key is kept in a 64-bit lane together with its
+ * current internal node index, and all lanes descend one level of the trie at
+ * the same time.  Since every level below the direct pointing consumes six
+ * bits of the key, the bit position is common to all the lanes; the lanes
+ * that have reached a leaf are just masked off from the following gathers.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+#define POPTRIE_SIMD    1
+
+/* Leaves are read as the aligned 64-bit word containing 2^LEAF_SHIFT of them,
+   each of which is 2^LEAF_BITS_SHIFT bits */
+#ifdef POPTRIE_FIB32
+#define LEAF_SHIFT      1
+#define LEAF_BITS_SHIFT 5
+#else
+#define LEAF_SHIFT      2
+#define LEAF_BITS_SHIFT 4
+#endif
+#define LEAF_MASK       (((u64)1 << (1 << LEAF_BITS_SHIFT)) - 1)
+
+/*
+ * Population count of each 64-bit lane (AVX2 does not have vpopcntq)
+ */
+__attribute__ ((target ("avx2")))
+static inline __m256i
+_popcnt_avx2(__m256i v)
+{
+    __m256i lut;
+    __m256i mask;
+    __m256i lo;
+    __m256i hi;
+
+    lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    mask = _mm256_set1_epi8(0x0f);
+    lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+    hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                                   mask));
+
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+/*
+ * Lookup 8 keys as two groups of four 64-bit lanes
+ */
+__attribute__ ((target ("avx2")))
+static void
+_lookup8_avx2(struct poptrie *poptrie, const u32 *addrs, void **out)
+{
+    int g;
+    int pos;
+    __m256i key[2];
+    __m256i base[2];
+    __m256i active[2];
+    __m256i leaf[2];
+    __m256i res[2];
+    __m256i k32;
+    __m256i d32;
+    __m256i word;
+    __m256i idx;
+    __m256i mask;
+    __m256i vector;
+    __m256i leafvec;
+    __m256i base0;
+    __m256i base1;
+    __m256i inode3;
+    __m256i inode6;
+    __m256i isint;
+    __m256i one;
+    __m256i two;
+    __m256i flag;
+    __m256i lmask;
+    __m128i cnt;
+
+    one = _mm256_set1_epi64x(1);
+    two = _mm256_set1_epi64x(2);
+    flag = _mm256_set1_epi64x((u32)1 << 31);
+    lmask = _mm256_set1_epi64x(LEAF_MASK);
+
+    /* Direct pointing for all the 8 keys */
+    k32 = _mm256_loadu_si256((const __m256i *)addrs);
+    cnt = _mm_cvtsi32_si128(32 - poptrie->s);
+    d32 = _mm256_i32gather_epi32((const int *)poptrie->dir,
+                                 _mm256_srl_epi32(k32, cnt), 4);
+
+    for ( g = 0; g < 2; g++ ) {
+        /* Keys are placed on the most significant 32 bits of each lane */
+        if ( 0 == g ) {
+            key[g] = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(k32, 0));
+            base[g] = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(d32, 0));
+        } else {
+            key[g] = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(k32, 1));
+            base[g] = _mm256_cvtepu32_epi64(_mm256_extracti128_si256(d32, 1));
+        }
+        key[g] = _mm256_slli_epi64(key[g], 32);
+        active[g] = _mm256_cmpeq_epi64(_mm256_and_si256(base[g], flag),
+                                       _mm256_setzero_si256());
+        res[g] = _mm256_andnot_si256(flag, base[g]);
+        leaf[g] = _mm256_setzero_si256();
+    }
+
+    /* Internal nodes */
+    pos = poptrie->s;
+    while ( !_mm256_testz_si256(active[0], active[0])
+            || !_mm256_testz_si256(active[1], active[1]) ) {
+        cnt = _mm_cvtsi32_si128(pos);
+        for ( g = 0; g < 2; g++ ) {
+            if ( _mm256_testz_si256(active[g], active[g]) ) {
+                continue;
+            }
+            /* Index in the node: the next 6 bits of the key */
+            idx = _mm256_srli_epi64(_mm256_sll_epi64(key[g], cnt), 58);
+            mask = _mm256_sub_epi64(_mm256_sllv_epi64(two, idx), one);
+
+            /* Gather the node: leafvec and vector at 24 * inode, base0 and
+               base1 at 24 * inode + 16 and + 20 */
+            inode3 = _mm256_add_epi64(base[g], _mm256_add_epi64(base[g],
+                                                                base[g]));
+            inode6 = _mm256_add_epi64(inode3, inode3);
+            leafvec = _mm256_mask_i64gather_epi64(
+                _mm256_setzero_si256(), (const long long *)poptrie->nodes,
+                inode3, active[g], 8);
+            vector = _mm256_mask_i64gather_epi64(
+                _mm256_setzero_si256(), (const long long *)poptrie->nodes + 1,
+                inode3, active[g], 8);
+            base0 = _mm256_cvtepu32_epi64(_mm256_mask_i64gather_epi32(
+                _mm_setzero_si128(), (const int *)poptrie->nodes + 4, inode6,
+                _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+                    active[g], _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6))),
+                4));
+            base1 = _mm256_cvtepu32_epi64(_mm256_mask_i64gather_epi32(
+                _mm_setzero_si128(), (const int *)poptrie->nodes + 5, inode6,
+                _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(
+                    active[g], _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6))),
+                4));
+
+            /* Test the vector */
+            isint = _mm256_cmpeq_epi64(
+                _mm256_and_si256(_mm256_srlv_epi64(vector, idx), one), one);
+            isint = _mm256_and_si256(isint, active[g]);
+
+            /* Internal node: base1 + POPCNT_LS(vector, idx) - 1 */
+            base[g] = _mm256_blendv_epi8(
+                base[g], _mm256_sub_epi64(_mm256_add_epi64(
+                    base1, _popcnt_avx2(_mm256_and_si256(vector, mask))), one),
+                isint);
+
+            /* Leaf: base0 + POPCNT_LS(leafvec, idx) - 1 */
+            res[g] = _mm256_blendv_epi8(
+                res[g], _mm256_sub_epi64(_mm256_add_epi64(
+                    base0, _popcnt_avx2(_mm256_and_si256(leafvec, mask))), one),
+                _mm256_andnot_si256(isint, active[g]));
+            leaf[g] = _mm256_or_si256(leaf[g],
+                                      _mm256_andnot_si256(isint, active[g]));
+            active[g] = isint;
+        }
+        pos += 6;
+    }
+
+    for ( g = 0; g < 2; g++ ) {
+        /* Leaves; read as the aligned 64-bit word */
+        word = _mm256_mask_i64gather_epi64(
+            _mm256_setzero_si256(), (const long long *)poptrie->leaves,
+            _mm256_srli_epi64(res[g], LEAF_SHIFT), leaf[g], 8);
+        word = _mm256_and_si256(
+            _mm256_srlv_epi64(word, _mm256_slli_epi64(
+                                  _mm256_and_si256(
+                                      res[g], _mm256_set1_epi64x(
+                                          (1 << LEAF_SHIFT) - 1)),
+                                  LEAF_BITS_SHIFT)),
+            lmask);
+        res[g] = _mm256_blendv_epi8(res[g], word, leaf[g]);
+
+        /* FIB: 16-byte entries starting with the pointer to the next hop */
+        _mm256_storeu_si256((__m256i *)(out + 4 * g),
+                            _mm256_i64gather_epi64(
+                                (const long long *)
+                                POPTRIE_FIB_ENTRIES(poptrie),
+                                _mm256_add_epi64(res[g], res[g]), 8));
+    }
+}
+
+/*
+ * Lookup 16 keys as two groups of eight 64-bit lanes
+ */
+__attribute__ ((target ("avx512f,avx512vpopcntdq")))
+static void
+_lookup16_avx512(struct poptrie *poptrie, const u32 *addrs, void **out)
+{
+    int g;
+    int pos;
+    __m512i key[2];
+    __m512i base[2];
+    __mmask8 active[2];
+    __mmask8 leaf[2];
+    __mmask8 isint;
+    __m512i res[2];
+    __m512i k32;
+    __m512i d32;
+    __m512i word;
+    __m512i idx;
+    __m512i mask;
+    __m512i vector;
+    __m512i leafvec;
+    __m512i base0;
+    __m512i base1;
+    __m512i inode3;
+    __m512i inode6;
+    __m512i one;
+    __m512i two;
+    __m128i cnt;
+
+    one = _mm512_set1_epi64(1);
+    two = _mm512_set1_epi64(2);
+
+    /* Direct pointing for all the 16 keys */
+    k32 = _mm512_loadu_si512((const void *)addrs);
+    cnt = _mm_cvtsi32_si128(32 - poptrie->s);
+    d32 = _mm512_i32gather_epi32(_mm512_srl_epi32(k32, cnt),
+                                 (const void *)poptrie->dir, 4);
+
+    for ( g = 0; g < 2; g++ ) {
+        /* Keys are placed on the most significant 32 bits of each lane */
+        if ( 0 == g ) {
+            key[g] = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(k32, 0));
+            base[g] = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(d32, 0));
+        } else {
+            key[g] = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(k32, 1));
+            base[g] = _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(d32, 1));
+        }
+        key[g] = _mm512_slli_epi64(key[g], 32);
+        active[g] = _mm512_testn_epi64_mask(
+            base[g], _mm512_set1_epi64((u32)1 << 31));
+        res[g] = _mm512_and_epi64(base[g],
+                                  _mm512_set1_epi64(((u32)1 << 31) - 1));
+        leaf[g] = 0;
+    }
+
+    /* Internal nodes */
+    pos = poptrie->s;
+    while ( active[0] || active[1] ) {
+        cnt = _mm_cvtsi32_si128(pos);
+        for ( g = 0; g < 2; g++ ) {
+            if ( !active[g] ) {
+                continue;
+            }
+            /* Index in the node: the next 6 bits of the key */
+            idx = _mm512_srli_epi64(_mm512_sll_epi64(key[g], cnt), 58);
+            mask = _mm512_sub_epi64(_mm512_sllv_epi64(two, idx), one);
+
+            /* Gather the node */
+            inode3 = _mm512_add_epi64(base[g], _mm512_add_epi64(base[g],
+                                                                base[g]));
+            inode6 = _mm512_add_epi64(inode3, inode3);
+            leafvec = _mm512_mask_i64gather_epi64(
+                _mm512_setzero_si512(), active[g], inode3,
+                (const void *)poptrie->nodes, 8);
+            vector = _mm512_mask_i64gather_epi64(
+                _mm512_setzero_si512(), active[g], inode3,
+                (const void *)((const long long *)poptrie->nodes + 1), 8);
+            base0 = _mm512_cvtepu32_epi64(_mm512_mask_i64gather_epi32(
+                _mm256_setzero_si256(), active[g], inode6,
+                (const void *)((const int *)poptrie->nodes + 4), 4));
+            base1 = _mm512_cvtepu32_epi64(_mm512_mask_i64gather_epi32(
+                _mm256_setzero_si256(), active[g], inode6,
+                (const void *)((const int *)poptrie->nodes + 5), 4));
+
+            /* Test the vector */
+            isint = _mm512_mask_test_epi64_mask(
+                active[g], _mm512_srlv_epi64(vector, idx), one);
+
+            /* Internal node: base1 + POPCNT_LS(vector, idx) - 1 */
+            base[g] = _mm512_mask_sub_epi64(
+                base[g], isint, _mm512_add_epi64(
+                    base1, _mm512_popcnt_epi64(_mm512_and_epi64(vector, mask))),
+                one);
+
+            /* Leaf: base0 + POPCNT_LS(leafvec, idx) - 1 */
+            res[g] = _mm512_mask_sub_epi64(
+                res[g], active[g] & ~isint, _mm512_add_epi64(
+                    base0,
+                    _mm512_popcnt_epi64(_mm512_and_epi64(leafvec, mask))),
+                one);
+            leaf[g] |= active[g] & ~isint;
+            active[g] = isint;
+        }
+        pos += 6;
+    }
+
+    for ( g = 0; g < 2; g++ ) {
+        /* Leaves; read as the aligned 64-bit word */
+        word = _mm512_mask_i64gather_epi64(
+            _mm512_setzero_si512(), leaf[g],
+            _mm512_srli_epi64(res[g], LEAF_SHIFT),
+            (const void *)poptrie->leaves, 8);
+        word = _mm512_and_epi64(
+            _mm512_srlv_epi64(word, _mm512_slli_epi64(
+                                  _mm512_and_epi64(
+                                      res[g], _mm512_set1_epi64(
+                                          (1 << LEAF_SHIFT) - 1)),
+                                  LEAF_BITS_SHIFT)),
+            _mm512_set1_epi64(LEAF_MASK));
+        res[g] = _mm512_mask_mov_epi64(res[g], leaf[g], word);
+
+        /* FIB: 16-byte entries starting with the pointer to the next hop */
+        _mm512_storeu_si512((void *)(out + 8 * g),
+                            _mm512_i64gather_epi64(
+                                _mm512_add_epi64(res[g], res[g]),
+                                (const void *)POPTRIE_FIB_ENTRIES(poptrie),
+                                8));
+    }
+}
+
+#endif
+
+/*
+ * Lookup routes for multiple addresses with AVX2 (8 addresses at once)
+ */
+int
+poptrie_lookup_avx2(struct poptrie *poptrie, const u32 *addrs, void **out,
+                    int n)
+{
+#ifdef POPTRIE_SIMD
+    int i;
+
+    if ( !__builtin_cpu_supports("avx2") ) {
+        return -1;
+    }
+    for ( i = 0; i + 8 <= n; i += 8 ) {
+        _lookup8_avx2(poptrie, addrs + i, out + i);
+    }
+    /* Remaining addresses */
+    poptrie_lookup_batch(poptrie, addrs + i, out + i, n - i);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Lookup routes for multiple addresses with AVX-512 (16 addresses at once)
+ */
+int
+poptrie_lookup_avx512(struct poptrie *poptrie, const u32 *addrs, void **out,
+                      int n)
+{
+#ifdef POPTRIE_SIMD
+    int i;
+
+    if ( !__builtin_cpu_supports("avx512f")
+         || !__builtin_cpu_supports("avx512vpopcntdq") ) {
+        return -1;
+    }
+    for ( i = 0; i + 16 <= n; i += 16 ) {
+        _lookup16_avx512(poptrie, addrs + i, out + i);
+    }
+    /* Remaining addresses */
+    poptrie_lookup_batch(poptrie, addrs + i, out + i, n - i);
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Lookup routes for multiple addresses with the widest SIMD instructions
+ * supported by the processor
+ */
+void
+poptrie_lookup_simd(struct poptrie *poptrie, const u32 *addrs, void **out,
+                    int n)
+{
+    if ( 0 == poptrie_lookup_avx512(poptrie, addrs, out, n) ) {
+        return;
+    }
+    if ( 0 == poptrie_lookup_avx2(poptrie, addrs, out, n) ) {
+        return;
+    }
+    poptrie_lookup_batch(poptrie, addrs, out, n);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
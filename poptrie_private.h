@@ -8,6 +8,10 @@
 
 #include "buddy.h"
 #include "poptrie.h"
+#include "qsbr.h"
+#include "radix.h"
+#include "replica.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -26,6 +30,36 @@
 #define POPCNT_LS(v, i) popcnt((v) & (((u64)2 << (i)) - 1))
 #define ZEROCNT_LS(v, i) popcnt((~(v)) & (((u64)2 << (i)) - 1))
 
+/* Prefetch a cache line for a read in the batched lookup */
+#define PREFETCH(p)     __builtin_prefetch((p), 0, 3)
+
+/* The number of keys processed together in a batched lookup.  The lookup state
+   of the keys is kept on the stack, and a burst larger than this is split. */
+#define POPTRIE_LOOKUP_BATCH    64
+
+/* Stages of a lookup state machine in the asynchronous lookup */
+#define POPTRIE_AMAC_EMPTY      0
+#define POPTRIE_AMAC_DIR        1
+#define POPTRIE_AMAC_NODE       2
+#define POPTRIE_AMAC_LEAF       3
+
+/*
+ * Lookup state machine; the memory to be read at the current stage has been
+ * prefetched when the previous stage was processed.
+ */
+struct poptrie_amac_slot {
+    /* Current stage */
+    int stage;
+    /* Key */
+    u32 key;
+    /* Index of the direct pointing entry, the internal node, or the leaf */
+    u32 base;
+    /* Bit position of the key for the internal node */
+    int pos;
+    /* Pointer to the next hop to be returned */
+    void **out;
+};
+
 struct poptrie_stack {
     int inode;
     int idx;
@@ -34,17 +68,15 @@ struct poptrie_stack {
 };
 
 /* Prototype declarations */
-static int
-poptrie_route_add_propagate(struct radix_node *, struct radix_node *);
-static int
-poptrie_route_change_propagate(struct radix_node *, struct radix_node *);
-static int
-poptrie_route_del_propagate(struct radix_node *, struct radix_node *,
-                            struct radix_node *);
+static void poptrie_route_propagate(struct radix_node *);
 static int
 _update_inode(struct poptrie *, struct radix_node *, int, poptrie_node_t *,
               poptrie_leaf_t *);
 static int
+_update_inode_level(struct poptrie *, struct radix_node *, int,
+                    poptrie_node_t *, poptrie_leaf_t *,
+                    struct poptrie_scratch *);
+static int
 _update_inode_chunk(struct poptrie *, struct radix_node *, int,
                     poptrie_node_t *, poptrie_leaf_t *);
 static int
@@ -62,7 +94,8 @@ _update_part_loop2(struct poptrie *, struct poptrie_stack *,
                    struct poptrie_node *);
 static int
 _update_part_dp(struct poptrie *, struct radix_node *, int, u32 *, int);
-static struct radix_node * _next_block(struct radix_node *, int, int, int);
+static struct radix_node *
+_next_block(struct radix_node *, int, int, int, struct radix_node *);
 static void
 _parse_triangle(struct radix_node *, u64 *, struct radix_node *, int, int);
 static void _update_clean_node(struct poptrie *, poptrie_node_t *, int);
@@ -84,102 +117,154 @@ bsr(u64 x)
 }
 
 /*
- * Mark the descendant node to be updated after the route_add operation
+ * Release internal nodes allocated from the index off.  The release is
+ * deferred until the readers pass it if the reclamation is enabled.
  */
-static int
-poptrie_route_add_propagate(struct radix_node *node, struct radix_node *ext)
+static __inline__ void
+_free_nodes(struct poptrie *poptrie, int off)
 {
-    if ( NULL != node->ext ) {
-        if ( ext->len > node->ext->len ) {
-            /* This new node is more specific. */
-            if ( ext->nexthop != EXT_NH(node) ) {
-                /* Prefix and next hop are updated. */
-                node->mark = 1;
-            }
-            node->mark = 1;
-            node->ext = ext;
-        } else {
-            /* This new node is less specific, then terminate. */
-            node->mark = 1;
-            return node->mark;
-        }
+    if ( NULL != poptrie->limbo ) {
+        qsbr_defer(poptrie, POPTRIE_REGION_NODES, off, NULL);
     } else {
-        /* The new route is propagated. */
-        node->mark = 1;
-        node->ext = ext;
-    }
-    if ( NULL != node->left ) {
-        node->mark |= poptrie_route_add_propagate(node->left, ext);
-    }
-    if ( NULL != node->right ) {
-        node->mark |= poptrie_route_add_propagate(node->right, ext);
+        buddy_free2(poptrie->cnodes, off);
     }
+}
 
-    return node->mark;
+/*
+ * Release leaves allocated from the index off
+ */
+static __inline__ void
+_free_leaves(struct poptrie *poptrie, int off)
+{
+    if ( NULL != poptrie->limbo ) {
+        qsbr_defer(poptrie, POPTRIE_REGION_LEAVES, off, NULL);
+    } else {
+        buddy_free2(poptrie->cleaves, off);
+    }
 }
 
 /*
- * Mark the descendant node to be updated after the route_change operation
+ * Notify the usage of a buddy system over the high watermark.  It is notified
+ * again only after the usage goes below three quarters of the watermark, so
+ * that the allocations and releases of an update do not repeat it.
  */
-static int
-poptrie_route_change_propagate(struct radix_node *node, struct radix_node *ext)
+static __inline__ void
+_watermark(struct poptrie *poptrie, int region, struct buddy *bs)
 {
-    /* Mark if the cache is updated */
-    if ( ext == node->ext ) {
-        node->mark = 1;
+    u64 used;
+    u64 wm;
+
+    if ( NULL == poptrie->watermark_func ) {
+        return;
+    }
+    used = (u64)bs->used * 100;
+    wm = (u64)poptrie->watermark << bs->maxsz;
+    if ( poptrie->watermark_hit & (1 << region) ) {
+        if ( used * 4 < wm * 3 ) {
+            poptrie->watermark_hit &= ~(1 << region);
+        }
+    } else if ( used >= wm ) {
+        poptrie->watermark_hit |= 1 << region;
+        poptrie->watermark_func(poptrie, region, bs->used, 1 << bs->maxsz,
+                                poptrie->watermark_arg);
     }
+}
 
-    if ( NULL != node->left ) {
-        node->mark |= poptrie_route_change_propagate(node->left, ext);
+/*
+ * Allocate 2^n internal nodes, growing the array if it runs out, and log them
+ * for the replicas
+ */
+static __inline__ int
+_alloc_nodes(struct poptrie *poptrie, int n)
+{
+    int ret;
+
+    ret = buddy_alloc2(poptrie->cnodes, n);
+    while ( ret < 0 && 0 == poptrie_grow(poptrie, POPTRIE_REGION_NODES) ) {
+        ret = buddy_alloc2(poptrie->cnodes, n);
+    }
+    if ( ret < 0 ) {
+        return -1;
     }
-    if ( NULL != node->right ) {
-        node->mark |= poptrie_route_change_propagate(node->right, ext);
+    if ( NULL != poptrie->dirty ) {
+        replica_dirty(poptrie, 0, ret, n);
     }
+    _watermark(poptrie, POPTRIE_REGION_NODES, poptrie->cnodes);
 
-    return node->mark;
+    return ret;
 }
 
 /*
- * Mark the descendant node to be updated after the route_del operation
+ * Allocate 2^n leaves, growing the array if it runs out, and log them for the
+ * replicas
  */
-static int
-poptrie_route_del_propagate(struct radix_node *node, struct radix_node *oext,
-                            struct radix_node *next)
+static __inline__ int
+_alloc_leaves(struct poptrie *poptrie, int n)
 {
-    if ( oext == node->ext ) {
-        if ( oext->nexthop != EXT_NH(node) ) {
-            /* Next hop will change */
-            node->mark = 1;
-        }
-        /* Replace the extracted node */
-        node->ext = next;
-        node->mark = 1;
+    int ret;
+
+    ret = buddy_alloc2(poptrie->cleaves, n);
+    while ( ret < 0 && 0 == poptrie_grow(poptrie, POPTRIE_REGION_LEAVES) ) {
+        ret = buddy_alloc2(poptrie->cleaves, n);
     }
-    if ( NULL != node->left ) {
-        node->mark |= poptrie_route_del_propagate(node->left, oext, next);
+    if ( ret < 0 ) {
+        return -1;
     }
-    if ( NULL != node->right ) {
-        node->mark |= poptrie_route_del_propagate(node->right, oext, next);
+    if ( NULL != poptrie->dirty ) {
+        replica_dirty(poptrie, 1, ret, n);
     }
+    _watermark(poptrie, POPTRIE_REGION_LEAVES, poptrie->cleaves);
 
-    return node->mark;
+    return ret;
 }
 
 /*
- * Update an internal node
+ * Mark the node of a route added, changed, or deleted.  The descendants are
+ * not visited here; their nearest valid nodes are resolved, and those not
+ * covered by a more specific route are marked, when the update descends to
+ * them.  This takes the constant time regardless of the routes covered.
+ */
+static void
+poptrie_route_propagate(struct radix_node *node)
+{
+    node->lazy = 1;
+    node->mark = 1;
+}
+
+/*
+ * Update an internal node.  The update descends to the marked children one
+ * level at a time, and the working buffers of each level are taken from the
+ * ones preallocated to the data structure instead of the stack.
  */
 static int
 _update_inode(struct poptrie *poptrie, struct radix_node *node, int inode,
               poptrie_node_t *n, poptrie_leaf_t *leaf)
+{
+    int ret;
+
+    if ( poptrie->level >= POPTRIE_SCRATCH_LEVELS ) {
+        return -1;
+    }
+    poptrie->level++;
+    ret = _update_inode_level(poptrie, node, inode, n, leaf,
+                              &poptrie->scratch[poptrie->level - 1]);
+    poptrie->level--;
+
+    return ret;
+}
+static int
+_update_inode_level(struct poptrie *poptrie, struct radix_node *node,
+                    int inode, poptrie_node_t *n, poptrie_leaf_t *leaf,
+                    struct poptrie_scratch *scratch)
 {
     int i;
     u64 vector;
     u64 leafvec;
     int nvec;
     int nlvec;
-    struct radix_node nodes[1 << 6];
-    poptrie_node_t children[1 << 6];
-    poptrie_leaf_t leaves[1 << 6];
+    struct radix_node *nodes;
+    poptrie_node_t *children;
+    poptrie_leaf_t *leaves;
     u64 prev;
     int base0;
     int base1;
@@ -189,6 +274,10 @@ _update_inode(struct poptrie *poptrie, struct radix_node *node, int inode,
     int ninode;
     int num;
 
+    nodes = scratch->nodes;
+    children = scratch->children;
+    leaves = scratch->leaves;
+
     /* Parse triangle */
     VEC_INIT(vector);
     _parse_triangle(node, &vector, nodes, 0, 0);
@@ -201,9 +290,8 @@ _update_inode(struct poptrie *poptrie, struct radix_node *node, int inode,
     for ( i = 0; i < (1 << 6); i++ ) {
         if ( VEC_BT(vector, i) ) {
             /* Internal node */
-            if ( (nodes[i].left && nodes[i].left->mark)
-                 || (nodes[i].right && nodes[i].right->mark)
-                 || inode < 0 ) {
+            if ( nodes[i].mark || radix_marked(nodes[i].left)
+                 || radix_marked(nodes[i].right) || inode < 0 ) {
                 /* One or more child is marked */
                 if ( inode >= 0 ) {
                     if ( VEC_BT(poptrie->nodes[inode].vector, i) ) {
@@ -272,7 +360,7 @@ _update_inode(struct poptrie *poptrie, struct radix_node *node, int inode,
     base1 = -1;
     if ( nvec > 0 ) {
         p = nvec;
-        base1 = buddy_alloc2(poptrie->cnodes, bsr(p - 1) + 1);
+        base1 = _alloc_nodes(poptrie, bsr(p - 1) + 1);
         if ( base1 < 0 ) {
             return -1;
         }
@@ -281,10 +369,10 @@ _update_inode(struct poptrie *poptrie, struct radix_node *node, int inode,
     base0 = -1;
     if ( nlvec > 0 ) {
         p = nlvec;
-        base0 = buddy_alloc2(poptrie->cleaves, bsr(p - 1) + 1);
+        base0 = _alloc_leaves(poptrie, bsr(p - 1) + 1);
         if ( base0 < 0 ) {
             if ( base1 >= 0 ) {
-                buddy_free2(poptrie->cnodes, base1);
+                _free_nodes(poptrie, base1);
             }
             return -1;
         }
@@ -330,7 +418,7 @@ _update_inode_chunk(struct poptrie *poptrie, struct radix_node *node,
     ret = _update_inode_chunk_rec(poptrie, node, inode, nodes, leaf, 0, 0);
     if ( ret > 0 ) {
         /* Clean */
-        buddy_free2(poptrie->cleaves, nodes[0].base0);
+        _free_leaves(poptrie, nodes[0].base0);
     }
 
     return ret;
@@ -344,6 +432,8 @@ _update_inode_chunk_rec(struct poptrie *poptrie, struct radix_node *node,
     int ret0;
     int ret1;
     struct radix_node tmp;
+    struct radix_node ctmp;
+    struct radix_node *child;
     poptrie_leaf_t sleaf0;
     poptrie_leaf_t sleaf1;
 
@@ -370,8 +460,9 @@ _update_inode_chunk_rec(struct poptrie *poptrie, struct radix_node *node,
     r--;
 
     /* Left */
-    if ( node->left ) {
-        ret0 = _update_inode_chunk_rec(poptrie, node->left, inode, nodes,
+    child = radix_child(node, 0, &ctmp);
+    if ( child ) {
+        ret0 = _update_inode_chunk_rec(poptrie, child, inode, nodes,
                                        leaf ? &sleaf0 : NULL, pos, r);
         if ( ret0 < 0 ) {
             return -1;
@@ -388,8 +479,9 @@ _update_inode_chunk_rec(struct poptrie *poptrie, struct radix_node *node,
     }
 
     /* Right */
-    if ( node->right ) {
-        ret1 = _update_inode_chunk_rec(poptrie, node->right, inode, nodes,
+    child = radix_child(node, 1, &ctmp);
+    if ( child ) {
+        ret1 = _update_inode_chunk_rec(poptrie, child, inode, nodes,
                                        leaf ? &sleaf1 : NULL,
                                        pos + (1 << r), r);
         if ( ret1 < 0 ) {
@@ -421,12 +513,13 @@ static int
 _update_part(struct poptrie *poptrie, struct radix_node *tnode, int inode,
              struct poptrie_stack *stack, u32 *root, int alt)
 {
-    struct poptrie_node *cnodes;
+    struct poptrie_node cnodes[1];
     int ret;
     poptrie_leaf_t sleaf;
     int vcomp;
     int nroot;
     int oroot;
+    struct poptrie_stack *sp;
 
     /* Pop from the stack */
     stack--;
@@ -437,14 +530,12 @@ _update_part(struct poptrie *poptrie, struct radix_node *tnode, int inode,
         return _update_part_dp(poptrie, tnode, inode, root, alt);
     }
 
-    /* Allocate descendant nodes */
-#if POPTRIE_S < 6
-    cnodes = alloca(sizeof(struct poptrie_node));
-#else
-    cnodes = alloca(sizeof(struct poptrie_node) << (POPTRIE_S - 6));
-#endif
-    if ( NULL == cnodes ) {
-        return -1;
+    /* The levels in the stack are below the direct pointing array, and each
+       of them has one node in cnodes */
+    for ( sp = stack; sp->idx >= 0; sp-- ) {
+        if ( 6 != sp->width ) {
+            return -1;
+        }
     }
 
     /* Not the root */
@@ -454,7 +545,7 @@ _update_part(struct poptrie *poptrie, struct radix_node *tnode, int inode,
     }
     if ( ret > 0 ) {
         vcomp = 1;
-        buddy_free2(poptrie->cleaves, cnodes[0].base0);
+        _free_leaves(poptrie, cnodes[0].base0);
         cnodes[0].base0 = -1;
     } else {
         vcomp = 0;
@@ -482,7 +573,7 @@ _update_part(struct poptrie *poptrie, struct radix_node *tnode, int inode,
     }
 
     /* Replace the root */
-    nroot = buddy_alloc2(poptrie->cnodes, 0);
+    nroot = _alloc_nodes(poptrie, 0);
     if ( nroot < 0 ) {
         return -1;
     }
@@ -528,7 +619,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                 if ( i == NODEINDEX(stack->idx) ) {
                     if ( 0 == BITINDEX(stack->idx) ) {
                         /* Insert to the left */
-                        base0 = buddy_alloc2(poptrie->cleaves, 1);
+                        base0 = _alloc_leaves(poptrie, 1);
                         if ( base0 < 0 ) {
                             return -1;
                         }
@@ -538,7 +629,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                         VEC_SET(cnodes[i].leafvec, 1);
                     } else if ( ((1 << 6) - 1) == BITINDEX(stack->idx) ) {
                         /* Insert to the right */
-                        base0 = buddy_alloc2(poptrie->cleaves, 1);
+                        base0 = _alloc_leaves(poptrie, 1);
                         if ( base0 < 0 ) {
                             return -1;
                         }
@@ -548,7 +639,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                         VEC_SET(cnodes[i].leafvec, BITINDEX(stack->idx));
                     } else {
                         /* Insert to the middle */
-                        base0 = buddy_alloc2(poptrie->cleaves, 2);
+                        base0 = _alloc_leaves(poptrie, 2);
                         if ( base0 < 0 ) {
                             return -1;
                         }
@@ -561,7 +652,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                                 BITINDEX(stack->idx) + 1);
                     }
                 } else {
-                    base0 = buddy_alloc2(poptrie->cleaves, 0);
+                    base0 = _alloc_leaves(poptrie, 0);
                     if ( base0 < 0 ) {
                         return -1;
                     }
@@ -604,7 +695,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
 
             if ( 1 != n || 0 != POPCNT(vector) || (stack - 1)->idx < 0 ) {
                 *vcomp = 0;
-                base0 = buddy_alloc2(poptrie->cleaves, bsr(n - 1) + 1);
+                base0 = _alloc_leaves(poptrie, bsr(n - 1) + 1);
                 if ( base0 < 0 ) {
                     return -1;
                 }
@@ -614,7 +705,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                 p = POPCNT(vector);
                 n = p;
                 if ( n > 0 ) {
-                    base1 = buddy_alloc2(poptrie->cnodes, bsr(n - 1) + 1);
+                    base1 = _alloc_nodes(poptrie, bsr(n - 1) + 1);
                     if ( base1 < 0 ) {
                         return -1;
                     }
@@ -675,7 +766,7 @@ _update_part_loop1(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                     return 1;
                 }
 
-                base0 = buddy_alloc2(poptrie->cleaves, bsr(n - 1) + 1);
+                base0 = _alloc_leaves(poptrie, bsr(n - 1) + 1);
                 if ( base0 < 0 ) {
                     return -1;
                 }
@@ -712,7 +803,7 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
 
     if ( stack->inode < 0 ) {
         /* Create a new node */
-        base1 = buddy_alloc2(poptrie->cnodes, 0);
+        base1 = _alloc_nodes(poptrie, 0);
         if ( base1 < 0 ) {
             return -1;
         }
@@ -728,7 +819,7 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
         cnodes[NODEINDEX(stack->idx)].base1 = base1;
 
         for ( i = 0; i < (1 << (stack->width - 6)); i++ ) {
-            base0 = buddy_alloc2(poptrie->cleaves, 0);
+            base0 = _alloc_leaves(poptrie, 0);
             if ( base0 < 0 ) {
                 return -1;
             }
@@ -747,7 +838,7 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
             /* Same vector, then allocate and replace */
             p = POPCNT(node->vector);
             n = p;
-            base1 = buddy_alloc2(poptrie->cnodes, bsr(n - 1) + 1);
+            base1 = _alloc_nodes(poptrie, bsr(n - 1) + 1);
             if ( base1 < 0 ) {
                 return -1;
             }
@@ -768,6 +859,11 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
             }
             oroot = node->base1;
             node->base1 = base1;
+            if ( NULL != poptrie->dirty ) {
+                /* Written in place */
+                replica_dirty(poptrie, 0,
+                              stack->inode + NODEINDEX(stack->idx), 0);
+            }
 
             _update_clean_node(poptrie, node, oroot);
 
@@ -779,7 +875,7 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
 
             p = POPCNT(vector);
             n = p;
-            base1 = buddy_alloc2(poptrie->cnodes, bsr(n - 1) + 1);
+            base1 = _alloc_nodes(poptrie, bsr(n - 1) + 1);
             if ( base1 < 0 ) {
                 return -1;
             }
@@ -800,7 +896,7 @@ _update_part_loop2(struct poptrie *poptrie, struct poptrie_stack *stack,
                         }
                     }
                 }
-                base0 = buddy_alloc2(poptrie->cleaves, bsr(n - 1) + 1);
+                base0 = _alloc_leaves(poptrie, bsr(n - 1) + 1);
                 if ( base0 < 0 ) {
                     return -1;
                 }
@@ -842,23 +938,19 @@ static int
 _update_part_dp(struct poptrie *poptrie, struct radix_node *tnode, int inode,
                 u32 *root, int alt)
 {
-    struct poptrie_node *cnodes;
+    struct poptrie_node cnodes[1];
     int ret;
     poptrie_leaf_t sleaf;
     int nroot;
     int oroot;
 
-    cnodes = alloca(sizeof(struct poptrie_node));
-    if ( NULL == cnodes ) {
-        return -1;
-    }
     ret = _update_inode_chunk_rec(poptrie, tnode, inode, cnodes, &sleaf, 0, 0);
     if ( ret < 0 ) {
         return -1;
     }
     if ( ret > 0 ) {
         /* Clean */
-        buddy_free2(poptrie->cleaves, cnodes[0].base0);
+        _free_leaves(poptrie, cnodes[0].base0);
         cnodes[0].base0 = -1;
 
         /* Replace the root with an atomic instruction */
@@ -868,14 +960,14 @@ _update_part_dp(struct poptrie *poptrie, struct radix_node *tnode, int inode,
         if ( !alt ) {
             _update_clean_subtree(poptrie, oroot);
             if ( (int)oroot >= 0 ) {
-                buddy_free2(poptrie->cnodes, oroot);
+                _free_nodes(poptrie, oroot);
             }
         }
 
         return 0;
     } else {
         /* Replace the root */
-        nroot = buddy_alloc2(poptrie->cnodes, 0);
+        nroot = _alloc_nodes(poptrie, 0);
         if ( nroot < 0 ) {
             return -1;
         }
@@ -897,26 +989,42 @@ _update_part_dp(struct poptrie *poptrie, struct radix_node *tnode, int inode,
 }
 
 /*
- * Get the descending block from the index and shift
+ * Set a leaf to the num entries of the direct pointing array from idx.  The
+ * alternative array is only written when alt is set.
  */
-static struct radix_node *
-_next_block(struct radix_node *node, int idx, int shift, int depth)
+static void
+_update_dp_leaves(struct poptrie *poptrie, int alt, int idx, int num,
+                  poptrie_leaf_t leaf)
 {
-    if ( NULL == node ) {
-        return NULL;
-    }
+    int i;
 
-    if ( shift == depth ) {
-        return node;
+    for ( i = 0; i < num; i++ ) {
+        if ( alt ) {
+            poptrie->altdir[idx + i] = ((u32)1 << 31) | leaf;
+        } else {
+            poptrie->dir[idx + i] = ((u32)1 << 31) | leaf;
+            _update_clean_subtree(poptrie, poptrie->dir[idx + i]);
+            if ( (int)poptrie->dir[idx + i] >= 0 ) {
+                _free_nodes(poptrie, poptrie->dir[idx + i]);
+            }
+        }
     }
+}
 
-    if ( (idx >> (depth - shift - 1)) & 0x1 ) {
-        /* Right */
-        return _next_block(node->right, idx, shift + 1, depth);
-    } else {
-        /* Left */
-        return _next_block(node->left, idx, shift + 1, depth);
+/*
+ * Get the descending block from the index and shift.  The block omitted from
+ * the radix tree is materialized in tmp.
+ */
+static struct radix_node *
+_next_block(struct radix_node *node, int idx, int shift, int depth,
+            struct radix_node *tmp)
+{
+    while ( NULL != node && shift < depth ) {
+        node = radix_child(node, (idx >> (depth - shift - 1)) & 0x1, tmp);
+        shift++;
     }
+
+    return node;
 }
 
 /*
@@ -928,6 +1036,8 @@ _parse_triangle(struct radix_node *node, u64 *vector, struct radix_node *nodes,
 {
     int i;
     int hlen;
+    struct radix_node tmp;
+    struct radix_node *child;
 
     if ( 6 == depth ) {
         /* Bottom of the triangle */
@@ -943,8 +1053,9 @@ _parse_triangle(struct radix_node *node, u64 *vector, struct radix_node *nodes,
     hlen = (1 << (6 - depth - 1));
 
     /* Left */
-    if ( node->left ) {
-        _parse_triangle(node->left, vector, nodes, pos, depth + 1);
+    child = radix_child(node, 0, &tmp);
+    if ( child ) {
+        _parse_triangle(child, vector, nodes, pos, depth + 1);
     } else {
         for ( i = pos; i < pos + hlen; i++ ) {
             memcpy(&nodes[i], node, sizeof(struct radix_node));
@@ -953,8 +1064,9 @@ _parse_triangle(struct radix_node *node, u64 *vector, struct radix_node *nodes,
         }
     }
     /* Right */
-    if ( node->right ) {
-        _parse_triangle(node->right, vector, nodes, pos + hlen, depth + 1);
+    child = radix_child(node, 1, &tmp);
+    if ( child ) {
+        _parse_triangle(child, vector, nodes, pos + hlen, depth + 1);
     } else {
         for ( i = pos + hlen; i < pos + hlen * 2; i++ ) {
             memcpy(&nodes[i], node, sizeof(struct radix_node));
@@ -970,15 +1082,24 @@ _parse_triangle(struct radix_node *node, u64 *vector, struct radix_node *nodes,
 static void
 _clear_mark(struct radix_node *node)
 {
-    if ( !node->mark ) {
-        return;
-    }
-    node->mark = 0;
-    if ( node->left ) {
-        _clear_mark(node->left);
-    }
-    if ( node->right ) {
-        _clear_mark(node->right);
+    struct radix_node *stack[RADIX_DEPTH + 1];
+    int sp;
+
+    sp = 0;
+    stack[sp++] = node;
+    while ( sp > 0 ) {
+        node = stack[--sp];
+        if ( !node->mark ) {
+            continue;
+        }
+        node->mark = 0;
+        node->lazy = 0;
+        if ( node->right ) {
+            stack[sp++] = node->right;
+        }
+        if ( node->left ) {
+            stack[sp++] = node->left;
+        }
     }
 }
 
@@ -1005,7 +1126,7 @@ _update_clean_node(struct poptrie *poptrie, poptrie_node_t *node, int oinode)
 
     /* Clear */
     if ( (int)node->base1 != oinode ) {
-         buddy_free2(poptrie->cnodes, oinode);
+         _free_nodes(poptrie, oinode);
     }
 }
 static void
@@ -1041,11 +1162,11 @@ _update_clean_inode(struct poptrie *poptrie, int ninode, int oinode)
 
         if ( (u32)-1 != poptrie->nodes[oinode].base1
              && poptrie->nodes[oinode].base1 != poptrie->nodes[ninode].base1 ) {
-            buddy_free2(poptrie->cnodes, poptrie->nodes[oinode].base1);
+            _free_nodes(poptrie, poptrie->nodes[oinode].base1);
         }
         if ( (u32)-1 != poptrie->nodes[oinode].base0
              && poptrie->nodes[oinode].base0 != poptrie->nodes[ninode].base0 ) {
-            buddy_free2(poptrie->cleaves, poptrie->nodes[oinode].base0);
+            _free_leaves(poptrie, poptrie->nodes[oinode].base0);
         }
     } else {
         obase = poptrie->nodes[oinode].base1;
@@ -1057,10 +1178,10 @@ _update_clean_inode(struct poptrie *poptrie, int ninode, int oinode)
         }
 
         if ( (u32)-1 != poptrie->nodes[oinode].base1 ) {
-            buddy_free2(poptrie->cnodes, poptrie->nodes[oinode].base1);
+            _free_nodes(poptrie, poptrie->nodes[oinode].base1);
         }
         if ( (u32)-1 != poptrie->nodes[oinode].base0 ) {
-            buddy_free2(poptrie->cleaves, poptrie->nodes[oinode].base0);
+            _free_leaves(poptrie, poptrie->nodes[oinode].base0);
         }
     }
 }
@@ -1091,11 +1212,11 @@ _update_clean_subtree(struct poptrie *poptrie, int oinode)
 
     /* Clear */
     if ( (int)node->base1 >= 0 ) {
-        buddy_free2(poptrie->cnodes, node->base1);
+        _free_nodes(poptrie, node->base1);
     }
 
     if ( (int)node->base0 >= 0 ) {
-        buddy_free2(poptrie->cleaves, node->base0);
+        _free_leaves(poptrie, node->base0);
     }
 }
 
@@ -1128,72 +1249,580 @@ _update_clean_root(struct poptrie *poptrie, int nroot, int oroot)
 
     if ( poptrie->nodes[nroot].base1 != poptrie->nodes[oroot].base1
          && (u32)-1 != poptrie->nodes[oroot].base1 ) {
-        buddy_free2(poptrie->cnodes, poptrie->nodes[oroot].base1);
+        _free_nodes(poptrie, poptrie->nodes[oroot].base1);
     }
     if ( poptrie->nodes[nroot].base0 != poptrie->nodes[oroot].base0
          && (u32)-1 != poptrie->nodes[oroot].base0 ) {
-        buddy_free2(poptrie->cleaves, poptrie->nodes[oroot].base0);
+        _free_leaves(poptrie, poptrie->nodes[oroot].base0);
     }
     /* Clear */
     if ( oroot != nroot ) {
-        buddy_free2(poptrie->cnodes, oroot);
+        _free_nodes(poptrie, oroot);
     }
 }
 
+/*
+ * Hash of a next hop to a bucket of the FIB mapping table
+ */
+static __inline__ int
+_fib_hash(void *nexthop, int sz)
+{
+    return POPTRIE_FIB_HASH(nexthop, sz);
+}
+
+/*
+ * Find the index of a next hop in the FIB mapping table
+ */
+static __inline__ int
+_fib_find(struct poptrie *poptrie, void *nexthop)
+{
+    int n;
+
+    for ( n = poptrie->fib.hash[_fib_hash(nexthop, poptrie->fib.sz)];
+          n >= 0; n = poptrie->fib.entries[n].next ) {
+        if ( poptrie->fib.entries[n].entry == nexthop ) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Double the FIB mapping table.  The new array is published with a full
+ * barrier before the old one is retired and before any leaf refers to the new
+ * entries, so that a lookup loading the array after the leaf with
+ * POPTRIE_FIB_ENTRIES() never indexes the old array beyond its end.
+ */
+static int
+_fib_grow(struct poptrie *poptrie)
+{
+    struct poptrie_fib_entry *entries;
+    struct poptrie_fib_entry *old;
+    int *hash;
+    int sz;
+    int h;
+    int i;
+
+    sz = poptrie->fib.sz * 2;
+    if ( sz > POPTRIE_FIB_MAX
+         || (NULL == poptrie->limbo
+             && poptrie->fib.nretired >= POPTRIE_FIB_RETIRED_MAX) ) {
+        return -1;
+    }
+    entries = malloc(sizeof(struct poptrie_fib_entry) * sz);
+    if ( NULL == entries ) {
+        return -1;
+    }
+    hash = malloc(sizeof(int) * sz);
+    if ( NULL == hash ) {
+        free(entries);
+        return -1;
+    }
+    memcpy(entries, poptrie->fib.entries,
+           sizeof(struct poptrie_fib_entry) * poptrie->fib.sz);
+    memset(entries + poptrie->fib.sz, 0,
+           sizeof(struct poptrie_fib_entry) * (sz - poptrie->fib.sz));
+
+    /* Rehash the entries in use, and chain the others to the free list in the
+       ascending order */
+    for ( i = 0; i < sz; i++ ) {
+        hash[i] = -1;
+    }
+    poptrie->fib.free = -1;
+    for ( i = sz - 1; i >= 0; i-- ) {
+        if ( i < poptrie->fib.sz && (entries[i].refs > 0 || 0 == i) ) {
+            h = _fib_hash(entries[i].entry, sz);
+            entries[i].next = hash[h];
+            hash[h] = i;
+        } else {
+            entries[i].next = poptrie->fib.free;
+            poptrie->fib.free = i;
+        }
+    }
+
+    /* Publish the new array, then retire the old one */
+    old = __sync_lock_test_and_set(&poptrie->fib.entries, entries);
+    if ( NULL != poptrie->limbo ) {
+        qsbr_defer(poptrie, -1, 0, old);
+    } else {
+        poptrie->fib.retired[poptrie->fib.nretired++] = old;
+    }
+    free(poptrie->fib.hash);
+    poptrie->fib.hash = hash;
+    poptrie->fib.sz = sz;
+
+    return 0;
+}
+
 /*
  * Insert an entry to the FIB mapping table
  */
 static int
 poptrie_fib_ref(struct poptrie *poptrie, void *nexthop)
 {
-    int i;
+    int h;
     int n;
 
     /* Find the FIB entry mapping first */
-    for ( i = 0; i < poptrie->fib.sz; i++ ) {
-        if ( poptrie->fib.entries[i].entry == nexthop ) {
-            /* Found the matched entry */
-            poptrie->fib.entries[i].refs++;
-            n = i;
-            break;
+    n = _fib_find(poptrie, nexthop);
+    if ( n >= 0 ) {
+        /* Found the matched entry */
+        poptrie->fib.entries[n].refs++;
+        return n;
+    }
+
+    /* No matching FIB entry was found, then take an available slot */
+    if ( poptrie->fib.free < 0 && _fib_grow(poptrie) < 0 ) {
+        /* The FIB mapping table is full and cannot be extended */
+        return -1;
+    }
+    n = poptrie->fib.free;
+    poptrie->fib.free = poptrie->fib.entries[n].next;
+
+    /* Append new FIB entry */
+    h = _fib_hash(nexthop, poptrie->fib.sz);
+    poptrie->fib.entries[n].entry = nexthop;
+    poptrie->fib.entries[n].refs = 1;
+    if ( NULL != poptrie->shm ) {
+        /* Publish the next hop to the reader processes before the leaves
+           referring to it */
+        poptrie->shm->fib[n].entry = nexthop;
+    }
+    poptrie->fib.entries[n].next = poptrie->fib.hash[h];
+    poptrie->fib.hash[h] = n;
+
+    return n;
+}
+
+/*
+ * Dereference an entry from the FIB mapping table by the index, and return the
+ * entry to the free list when it is no longer referred to
+ */
+static void
+poptrie_fib_unref(struct poptrie *poptrie, int n)
+{
+    int *p;
+
+    if ( poptrie->batch ) {
+        /* The leaves may refer to the entry until the end of the batch */
+        poptrie->unref[poptrie->nunref++] = n;
+        return;
+    }
+
+    poptrie->fib.entries[n].refs--;
+    if ( 0 != poptrie->fib.entries[n].refs || 0 == n ) {
+        /* Still referred to, already freed, or the default entry */
+        return;
+    }
+
+    /* Remove from the hash chain */
+    p = &poptrie->fib.hash[_fib_hash(poptrie->fib.entries[n].entry,
+                                     poptrie->fib.sz)];
+    while ( *p != n ) {
+        p = &poptrie->fib.entries[*p].next;
+    }
+    *p = poptrie->fib.entries[n].next;
+
+    /* The entry is kept for the lookups in progress until reused */
+    poptrie->fib.entries[n].next = poptrie->fib.free;
+    poptrie->fib.free = n;
+}
+
+/*
+ * Record the part of the direct pointing array to be updated at the end of the
+ * route batch
+ */
+static void
+_batch_defer(struct poptrie *poptrie, int idx, int len)
+{
+    struct poptrie_span *span;
+
+    span = &poptrie->spans[poptrie->nspans];
+    if ( len < poptrie->s ) {
+        span->idx = idx >> (poptrie->s - len) << (poptrie->s - len);
+        span->len = len;
+    } else {
+        span->idx = idx;
+        span->len = poptrie->s;
+    }
+    poptrie->nspans++;
+}
+
+/*
+ * Release the radix nodes no longer needed after a route is deleted.  The
+ * release is deferred to the end of the route batch, whose update still
+ * traverses them.
+ */
+static void
+_rib_prune(struct poptrie *poptrie, __uint128_t key, int len)
+{
+    if ( poptrie->batch ) {
+        poptrie->prune[poptrie->nprune].key = key;
+        poptrie->prune[poptrie->nprune].len = len;
+        poptrie->nprune++;
+        return;
+    }
+
+    radix_prune(poptrie, key, len);
+}
+
+/*
+ * Compare the parts of the direct pointing array; a part precedes those
+ * covered by it
+ */
+static int
+_batch_cmp(const void *a, const void *b)
+{
+    const struct poptrie_span *x;
+    const struct poptrie_span *y;
+
+    x = a;
+    y = b;
+    if ( x->idx != y->idx ) {
+        return x->idx < y->idx ? -1 : 1;
+    }
+
+    return x->len - y->len;
+}
+
+/*
+ * Prepare the buffers of a route batch of n operations
+ */
+static int
+_batch_begin(struct poptrie *poptrie, int n)
+{
+    poptrie->spans = malloc(sizeof(struct poptrie_span) * n);
+    if ( NULL == poptrie->spans ) {
+        return -1;
+    }
+    poptrie->unref = malloc(sizeof(int) * n);
+    if ( NULL == poptrie->unref ) {
+        free(poptrie->spans);
+        poptrie->spans = NULL;
+        return -1;
+    }
+    poptrie->prune = malloc(sizeof(struct poptrie_prune) * n);
+    if ( NULL == poptrie->prune ) {
+        free(poptrie->spans);
+        free(poptrie->unref);
+        poptrie->spans = NULL;
+        poptrie->unref = NULL;
+        return -1;
+    }
+    poptrie->nspans = 0;
+    poptrie->nunref = 0;
+    poptrie->nprune = 0;
+    poptrie->batch = 1;
+
+    return 0;
+}
+
+/*
+ * Dereference the next hops released by a route batch, prune the RIB, and
+ * release the buffers
+ */
+static void
+_batch_end(struct poptrie *poptrie)
+{
+    int i;
+
+    for ( i = 0; i < poptrie->nunref; i++ ) {
+        poptrie_fib_unref(poptrie, poptrie->unref[i]);
+    }
+    for ( i = 0; i < poptrie->nprune; i++ ) {
+        radix_prune(poptrie, poptrie->prune[i].key, poptrie->prune[i].len);
+    }
+    free(poptrie->spans);
+    free(poptrie->unref);
+    free(poptrie->prune);
+    poptrie->spans = NULL;
+    poptrie->unref = NULL;
+    poptrie->prune = NULL;
+    poptrie->nspans = 0;
+    poptrie->nunref = 0;
+    poptrie->nprune = 0;
+}
+
+/*
+ * Set the nearest valid node from the root, including the node itself, to
+ * each node of the radix tree built without the propagation.  The nearest
+ * valid node of the parent is set to a node when it is pushed.
+ */
+static void
+_build_ext(struct radix_node *node, struct radix_node *ext)
+{
+    struct radix_node *stack[RADIX_DEPTH + 1];
+    int sp;
+
+    node->ext = ext;
+    sp = 0;
+    stack[sp++] = node;
+    while ( sp > 0 ) {
+        node = stack[--sp];
+        if ( node->valid ) {
+            node->ext = node;
+        }
+        if ( NULL != node->right ) {
+            node->right->ext = node->ext;
+            stack[sp++] = node->right;
+        }
+        if ( NULL != node->left ) {
+            node->left->ext = node->ext;
+            stack[sp++] = node->left;
         }
     }
-    if ( i == poptrie->fib.sz ) {
-        /* No matching FIB entry was found, then find an available slot */
-        for ( i = 0; i < poptrie->fib.sz; i++ ) {
-            if ( poptrie->fib.entries[i].refs <= 0 ) {
-                /* Found */
-                n = i;
-                break;
-            }
+}
+
+/*
+ * Worker of the parallel build, constructing the chunks of the direct
+ * pointing array in its own parts of the internal node and leaf arrays
+ */
+struct poptrie_build_worker {
+    pthread_t thread;
+    /* The poptrie allocating from the parts */
+    struct poptrie view;
+    struct buddy cnodes;
+    struct buddy cleaves;
+    /* Offsets of the parts */
+    int base1;
+    int base0;
+    /* The next chunk shared by the workers, and the size and the number of
+       the chunks */
+    int *next;
+    int chunk;
+    int nchunks;
+    /* The chunk failed to build as the parts run out, or -1 */
+    int failed;
+};
+
+/*
+ * Construct the entries of the direct pointing array from idx0 to idx1 (not
+ * inclusive) under the radix node at the depth.  idx is the index of the node
+ * at the depth.
+ */
+static int
+_build_range(struct poptrie *poptrie, struct radix_node *node, int idx,
+             int depth, int idx0, int idx1)
+{
+    struct poptrie_stack stack[2];
+    struct radix_node tmp;
+    struct radix_node *child;
+    int lo;
+    int hi;
+    int mid;
+    int i;
+    int ret;
+
+    lo = idx << (poptrie->s - depth);
+    hi = (idx + 1) << (poptrie->s - depth);
+    if ( hi <= idx0 || lo >= idx1 ) {
+        /* Out of the range */
+        return 0;
+    }
+    if ( depth == poptrie->s ) {
+        stack[0].inode = -1;
+        stack[0].idx = -1;
+        stack[0].width = -1;
+        return _update_part(poptrie, node, -1, &stack[1], &poptrie->dir[lo],
+                            0);
+    }
+
+    mid = (lo + hi) >> 1;
+    child = radix_child(node, 0, &tmp);
+    if ( child ) {
+        ret = _build_range(poptrie, child, idx << 1, depth + 1, idx0, idx1);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    } else {
+        for ( i = lo > idx0 ? lo : idx0; i < mid && i < idx1; i++ ) {
+            poptrie->dir[i] = ((u32)1 << 31) | EXT_NH(node);
         }
-        if ( i == poptrie->fib.sz ) {
-            /* The FIB mapping table is full */
+    }
+    child = radix_child(node, 1, &tmp);
+    if ( child ) {
+        ret = _build_range(poptrie, child, (idx << 1) + 1, depth + 1, idx0,
+                           idx1);
+        if ( ret < 0 ) {
             return -1;
         }
+    } else {
+        for ( i = mid > idx0 ? mid : idx0; i < hi && i < idx1; i++ ) {
+            poptrie->dir[i] = ((u32)1 << 31) | EXT_NH(node);
+        }
+    }
 
-        /* Append new FIB entry */
-        poptrie->fib.entries[n].entry = nexthop;
-        poptrie->fib.entries[n].refs = 1;
+    return 0;
+}
+
+/*
+ * Build the chunks taken one by one until the parts run out
+ */
+static void *
+_build_worker(void *arg)
+{
+    struct poptrie_build_worker *w;
+    int c;
+
+    w = arg;
+    for ( ;; ) {
+        c = __sync_fetch_and_add(w->next, 1);
+        if ( c >= w->nchunks ) {
+            break;
+        }
+        if ( _build_range(&w->view, w->view.radix, 0, 0, c * w->chunk,
+                          (c + 1) * w->chunk) < 0 ) {
+            w->failed = c;
+            break;
+        }
     }
 
-    return n;
+    return NULL;
 }
 
 /*
- * Dereference an entry from the FIB mapping table
+ * Construct the direct pointing array from the radix tree with nthreads
+ * threads.  Each thread builds the chunks of the entries it takes in its own
+ * parts split from the internal node and leaf arrays, and writes the entries
+ * in place.  The chunks left by the threads running out of the parts are
+ * built by the calling thread.
  */
-static void
-poptrie_fib_deref(struct poptrie *poptrie, void *nexthop)
+static int
+_build_parallel(struct poptrie *poptrie, int nthreads)
 {
+    struct poptrie_build_worker *workers;
+    struct poptrie_build_worker *w;
+    struct buddy *bn;
+    struct buddy *bl;
+    int nworkers;
+    int ncreated;
+    int next;
+    int chunk;
+    int nchunks;
+    int sz1;
+    int sz0;
+    int ret;
+    int c;
     int i;
 
-    for ( i = 0; i < poptrie->fib.sz; i++ ) {
-        if ( poptrie->fib.entries[i].entry == nexthop ) {
-            /* Found the matched entry */
-            poptrie->fib.entries[i].refs--;
+    /* Chunks small enough to balance the load */
+    chunk = (1 << poptrie->s) / (nthreads * 64);
+    if ( chunk < 1 ) {
+        chunk = 1;
+    }
+    chunk = 1 << bsr(chunk);
+    nchunks = (1 << poptrie->s) / chunk;
+
+    workers = calloc(nthreads, sizeof(struct poptrie_build_worker));
+    if ( NULL == workers ) {
+        return -1;
+    }
+
+    /* Split the arrays into the parts of the workers; those not split, e.g.,
+       from small arrays, are left to the calling thread */
+    bn = poptrie->cnodes;
+    bl = poptrie->cleaves;
+    sz1 = bn->sz - bsr(2 * nthreads - 1);
+    sz0 = bl->sz - bsr(2 * nthreads - 1);
+    next = 0;
+    for ( nworkers = 0; nworkers < nthreads; nworkers++ ) {
+        w = &workers[nworkers];
+        w->base1 = buddy_split(bn, sz1, &w->cnodes);
+        if ( w->base1 < 0 ) {
+            break;
+        }
+        w->base0 = buddy_split(bl, sz0, &w->cleaves);
+        if ( w->base0 < 0 ) {
+            buddy_join(bn, &w->cnodes, w->base1);
+            break;
+        }
+        memcpy(&w->view, poptrie, sizeof(struct poptrie));
+        w->view.scratch = malloc(sizeof(struct poptrie_scratch)
+                                 * POPTRIE_SCRATCH_LEVELS);
+        if ( NULL == w->view.scratch ) {
+            buddy_join(bn, &w->cnodes, w->base1);
+            buddy_join(bl, &w->cleaves, w->base0);
             break;
         }
+        w->view.level = 0;
+        w->view.cnodes = &w->cnodes;
+        w->view.cleaves = &w->cleaves;
+        w->view.watermark_func = NULL;
+        w->view.dirty = NULL;
+        w->view.limbo = NULL;
+        w->next = &next;
+        w->chunk = chunk;
+        w->nchunks = nchunks;
+        w->failed = -1;
+    }
+
+    /* Build the chunks in parallel */
+    for ( ncreated = 0; ncreated < nworkers; ncreated++ ) {
+        if ( 0 != pthread_create(&workers[ncreated].thread, NULL,
+                                 _build_worker, &workers[ncreated]) ) {
+            /* Build the rest by the threads already created */
+            break;
+        }
+    }
+    if ( nworkers > 0 && 0 == ncreated ) {
+        /* No thread can be created */
+        _build_worker(&workers[0]);
+    }
+    for ( i = 0; i < ncreated; i++ ) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    /* Return the parts, and log them for the replicas */
+    for ( i = 0; i < nworkers; i++ ) {
+        w = &workers[i];
+        buddy_join(bn, &w->cnodes, w->base1);
+        buddy_join(bl, &w->cleaves, w->base0);
+        if ( NULL != poptrie->dirty ) {
+            replica_dirty(poptrie, 0, w->base1, sz1);
+            replica_dirty(poptrie, 1, w->base0, sz0);
+        }
+        free(w->view.scratch);
+    }
+    _watermark(poptrie, POPTRIE_REGION_NODES, bn);
+    _watermark(poptrie, POPTRIE_REGION_LEAVES, bl);
+
+    /* Build the chunks left, growing the arrays as needed.  The entries of a
+       chunk partly built are replaced and cleaned as updated ones. */
+    ret = 0;
+    for ( i = 0; 0 == ret && i < nworkers; i++ ) {
+        c = workers[i].failed;
+        if ( c >= 0 ) {
+            ret = _build_range(poptrie, poptrie->radix, 0, 0, c * chunk,
+                               (c + 1) * chunk);
+        }
+    }
+    if ( 0 == ret && next < nchunks ) {
+        ret = _build_range(poptrie, poptrie->radix, 0, 0, next * chunk,
+                           1 << poptrie->s);
+    }
+    memcpy(poptrie->altdir, poptrie->dir, sizeof(u32) << poptrie->s);
+    if ( NULL != poptrie->dirty ) {
+        replica_sync(poptrie, 0, 1 << poptrie->s);
+    }
+
+    free(workers);
+
+    return ret;
+}
+
+/*
+ * Dereference an entry from the FIB mapping table
+ */
+static void
+poptrie_fib_deref(struct poptrie *poptrie, void *nexthop)
+{
+    int n;
+
+    n = _fib_find(poptrie, nexthop);
+    if ( n >= 0 ) {
+        /* Found the matched entry */
+        poptrie_fib_unref(poptrie, n);
     }
 }
 
@@ -0,0 +1,272 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "buddy.h"
+#include "poptrie.h"
+#include "qsbr.h"
+#include "shm.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Quiescent-state-based reclamation.  The writer releases the nodes and leaves
+ * unlinked by an update to the limbo list, and seals them with a new epoch at
+ * the end of the update.  Each reader records the epoch it observes whenever
+ * it holds no reference to the nodes and leaves, i.e., at a quiescent state.
+ * Once every online reader has recorded the epoch of a block, no reader can
+ * reach it anymore, and the block is returned to the buddy system.
+ */
+
+/*
+ * Prepare the limbo list
+ */
+int
+qsbr_init(struct poptrie *poptrie)
+{
+    poptrie->limbo = malloc(sizeof(struct poptrie_limbo)
+                            * QSBR_INIT_LIMBO_SIZE);
+    if ( NULL == poptrie->limbo ) {
+        return -1;
+    }
+    poptrie->limbosz = QSBR_INIT_LIMBO_SIZE;
+    poptrie->limbohead = 0;
+    poptrie->nlimbo = 0;
+    poptrie->nsealed = 0;
+    poptrie->epoch = 1;
+    poptrie->readers = NULL;
+
+    return 0;
+}
+
+/*
+ * Release the limbo list and the readers.  The readers must have stopped.
+ */
+void
+qsbr_release(struct poptrie *poptrie)
+{
+    struct poptrie_reader *r;
+    int i;
+
+    if ( NULL != poptrie->limbo ) {
+        for ( i = poptrie->limbohead; i < poptrie->nlimbo; i++ ) {
+            if ( poptrie->limbo[i].region < 0 ) {
+                free(poptrie->limbo[i].ptr);
+            }
+        }
+        free(poptrie->limbo);
+        poptrie->limbo = NULL;
+    }
+    while ( NULL != poptrie->readers ) {
+        r = poptrie->readers;
+        poptrie->readers = r->next;
+        free(r);
+    }
+}
+
+/*
+ * Append a released block to the limbo list
+ */
+void
+qsbr_defer(struct poptrie *poptrie, int region, u32 off, void *ptr)
+{
+    struct poptrie_limbo *limbo;
+
+    if ( poptrie->nlimbo >= poptrie->limbosz && poptrie->limbohead > 0 ) {
+        /* Compact the list first */
+        memmove(poptrie->limbo, poptrie->limbo + poptrie->limbohead,
+                sizeof(struct poptrie_limbo)
+                * (poptrie->nlimbo - poptrie->limbohead));
+        poptrie->nlimbo -= poptrie->limbohead;
+        poptrie->nsealed -= poptrie->limbohead;
+        poptrie->limbohead = 0;
+    }
+    if ( poptrie->nlimbo >= poptrie->limbosz ) {
+        limbo = realloc(poptrie->limbo, sizeof(struct poptrie_limbo)
+                        * poptrie->limbosz * 2);
+        if ( NULL == limbo ) {
+            /* The block cannot be released safely, then leave it */
+            return;
+        }
+        poptrie->limbo = limbo;
+        poptrie->limbosz *= 2;
+    }
+    poptrie->limbo[poptrie->nlimbo].epoch = 0;
+    poptrie->limbo[poptrie->nlimbo].region = region;
+    poptrie->limbo[poptrie->nlimbo].off = off;
+    poptrie->limbo[poptrie->nlimbo].ptr = ptr;
+    poptrie->nlimbo++;
+}
+
+/*
+ * Seal the blocks released since the last call with a new epoch, and return
+ * the blocks that all the online readers have passed.  The number of the
+ * blocks still waiting for the readers is returned.
+ */
+int
+qsbr_reclaim(struct poptrie *poptrie)
+{
+    struct poptrie_reader **pp;
+    struct poptrie_reader *r;
+    struct poptrie_limbo *l;
+    u64 epoch;
+    u64 min;
+    int i;
+
+    if ( poptrie->nsealed < poptrie->nlimbo ) {
+        /* The full barrier orders the unlinking of the blocks before the new
+           epoch observed by the readers */
+        epoch = __sync_add_and_fetch(&poptrie->epoch, 1);
+        for ( i = poptrie->nsealed; i < poptrie->nlimbo; i++ ) {
+            poptrie->limbo[i].epoch = epoch;
+        }
+        poptrie->nsealed = poptrie->nlimbo;
+    }
+
+    /* Find the oldest epoch observed by the online readers, and release the
+       unregistered ones.  New readers are only pushed to the head. */
+    __sync_synchronize();
+    if ( NULL != poptrie->shm ) {
+        /* Including the reader processes */
+        min = shm_oldest(poptrie);
+    } else {
+        min = QSBR_OFFLINE;
+    }
+    pp = (struct poptrie_reader **)&poptrie->readers;
+    while ( NULL != (r = *pp) ) {
+        if ( r->dead ) {
+            if ( pp == &poptrie->readers ) {
+                if ( !__sync_bool_compare_and_swap(&poptrie->readers, r,
+                                                   r->next) ) {
+                    /* A new reader was pushed; retry from the head */
+                    continue;
+                }
+            } else {
+                *pp = r->next;
+            }
+            free(r);
+            continue;
+        }
+        if ( r->epoch < min ) {
+            min = r->epoch;
+        }
+        pp = &r->next;
+    }
+
+    /* Return the blocks in the order of the epochs */
+    while ( poptrie->limbohead < poptrie->nsealed
+            && poptrie->limbo[poptrie->limbohead].epoch <= min ) {
+        l = &poptrie->limbo[poptrie->limbohead];
+        switch ( l->region ) {
+        case POPTRIE_REGION_NODES:
+            buddy_free2(poptrie->cnodes, l->off);
+            break;
+        case POPTRIE_REGION_LEAVES:
+            buddy_free2(poptrie->cleaves, l->off);
+            break;
+        default:
+            free(l->ptr);
+        }
+        poptrie->limbohead++;
+    }
+    if ( poptrie->limbohead == poptrie->nlimbo ) {
+        poptrie->limbohead = 0;
+        poptrie->nlimbo = 0;
+        poptrie->nsealed = 0;
+    }
+
+    return poptrie->nlimbo - poptrie->limbohead;
+}
+
+/*
+ * Register the calling thread as a reader.  The reader is online.
+ */
+struct poptrie_reader *
+poptrie_reader_register(struct poptrie *poptrie)
+{
+    struct poptrie_reader *r;
+
+    if ( NULL == poptrie->limbo ) {
+        /* The reclamation is not enabled */
+        return NULL;
+    }
+    if ( 0 != posix_memalign((void **)&r, sizeof(struct poptrie_reader),
+                             sizeof(struct poptrie_reader)) ) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(struct poptrie_reader));
+    r->poptrie = poptrie;
+    r->epoch = poptrie->epoch;
+    do {
+        r->next = poptrie->readers;
+    } while ( !__sync_bool_compare_and_swap(&poptrie->readers, r->next, r) );
+    __sync_synchronize();
+
+    return r;
+}
+
+/*
+ * Unregister a reader.  It is released by the writer.
+ */
+void
+poptrie_reader_unregister(struct poptrie_reader *r)
+{
+    __atomic_store_n(&r->epoch, QSBR_OFFLINE, __ATOMIC_RELEASE);
+    r->dead = 1;
+}
+
+/*
+ * Bring a reader online before it starts the lookups again
+ */
+void
+poptrie_reader_online(struct poptrie_reader *r)
+{
+    r->epoch = __atomic_load_n(&r->poptrie->epoch, __ATOMIC_ACQUIRE);
+    /* The writer must see this reader before it reads the nodes */
+    __sync_synchronize();
+}
+
+/*
+ * Take a reader offline, e.g., while it is idle, so that it does not block
+ * the reclamation
+ */
+void
+poptrie_reader_offline(struct poptrie_reader *r)
+{
+    __atomic_store_n(&r->epoch, QSBR_OFFLINE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Announce a quiescent state of a reader, i.e., it holds no reference to the
+ * nodes and leaves looked up so far
+ */
+void
+poptrie_quiescent(struct poptrie_reader *r)
+{
+    __atomic_store_n(&r->epoch,
+                     __atomic_load_n(&r->poptrie->epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the released blocks that the readers have passed
+ */
+int
+poptrie_reclaim(struct poptrie *poptrie)
+{
+    if ( NULL == poptrie->limbo ) {
+        return 0;
+    }
+
+    return qsbr_reclaim(poptrie);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
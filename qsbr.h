@@ -0,0 +1,40 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_QSBR_H
+#define _POPTRIE_QSBR_H
+
+#include "poptrie.h"
+
+/* Initial size of the list of the released blocks */
+#define QSBR_INIT_LIMBO_SIZE    256
+
+/* Epoch of an offline reader */
+#define QSBR_OFFLINE            ((u64)-1)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* qsbr.c */
+    int qsbr_init(struct poptrie *);
+    void qsbr_release(struct poptrie *);
+    void qsbr_defer(struct poptrie *, int, u32, void *);
+    int qsbr_reclaim(struct poptrie *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_QSBR_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,400 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "poptrie.h"
+#include "radix.h"
+#include "slab.h"
+
+/*
+ * Path-compressed radix tree (RIB).  The prefixes of both the address families
+ * are left-aligned to 128 bits.  A node is kept only if it holds a route,
+ * branches into two children, or is the root at the depth zero; the other
+ * nodes are omitted, and the path to a node is taken from its key.  The
+ * update procedure sees the omitted nodes through radix_child().
+ */
+
+/*
+ * Length of the common prefix of two keys
+ */
+static __inline__ int
+_common(__uint128_t a, __uint128_t b)
+{
+    __uint128_t x;
+
+    x = a ^ b;
+    if ( (u64)(x >> 64) ) {
+        return __builtin_clzll((u64)(x >> 64));
+    }
+    if ( (u64)x ) {
+        return 64 + __builtin_clzll((u64)x);
+    }
+
+    return RADIX_KEYLENGTH;
+}
+
+/*
+ * Allocate an invalid node
+ */
+static struct radix_node *
+_new(struct poptrie *poptrie, __uint128_t key, int len, struct radix_node *ext)
+{
+    struct radix_node *node;
+
+    node = slab_alloc(poptrie->cradix);
+    if ( NULL == node ) {
+        return NULL;
+    }
+    node->key = key;
+    node->left = NULL;
+    node->right = NULL;
+    node->ext = ext;
+    node->nexthop = 0;
+    node->len = len;
+    node->valid = 0;
+    node->mark = 0;
+    node->lazy = 0;
+
+    return node;
+}
+
+/*
+ * Get the node of the prefix, inserting an invalid one with the nearest valid
+ * route if not exists
+ */
+struct radix_node *
+radix_insert(struct poptrie *poptrie, __uint128_t key, int len)
+{
+    struct radix_node **link;
+    struct radix_node *node;
+    struct radix_node *c;
+    struct radix_node *n;
+    struct radix_node *b;
+    int clen;
+
+    if ( len < 0 || len > RADIX_KEYLENGTH ) {
+        return NULL;
+    }
+    key &= radix_mask(len);
+
+    if ( NULL == poptrie->radix ) {
+        poptrie->radix = _new(poptrie, 0, 0, NULL);
+        if ( NULL == poptrie->radix ) {
+            /* Memory error */
+            return NULL;
+        }
+    }
+
+    node = poptrie->radix;
+    for ( ;; ) {
+        if ( node->len == len ) {
+            return node;
+        }
+        if ( RADIX_BT(key, node->len) ) {
+            link = &node->right;
+        } else {
+            link = &node->left;
+        }
+        c = *link;
+        if ( NULL == c ) {
+            /* Append a leaf */
+            n = _new(poptrie, key, len, node->ext);
+            if ( NULL == n ) {
+                return NULL;
+            }
+            *link = n;
+            return n;
+        }
+        clen = _common(key, c->key);
+        if ( clen >= c->len && len >= c->len ) {
+            /* The path to the child matches */
+            node = c;
+            continue;
+        }
+        if ( clen > len ) {
+            clen = len;
+        }
+
+        /* Split the path to the child.  The new nodes inherit the mark of the
+           path for the update deferred in the route batch. */
+        n = _new(poptrie, key, len, node->ext);
+        if ( NULL == n ) {
+            return NULL;
+        }
+        if ( clen == len ) {
+            /* The prefix is on the path */
+            n->mark = c->mark;
+            if ( RADIX_BT(c->key, len) ) {
+                n->right = c;
+            } else {
+                n->left = c;
+            }
+            *link = n;
+            return n;
+        }
+        /* Branch from the path */
+        b = _new(poptrie, key & radix_mask(clen), clen, node->ext);
+        if ( NULL == b ) {
+            slab_free(poptrie->cradix, n);
+            return NULL;
+        }
+        b->mark = c->mark;
+        if ( RADIX_BT(key, clen) ) {
+            b->left = c;
+            b->right = n;
+        } else {
+            b->left = n;
+            b->right = c;
+        }
+        *link = b;
+        return n;
+    }
+}
+
+/*
+ * Find the node of the prefix, and its parent
+ */
+struct radix_node *
+radix_find(struct radix_node *node, __uint128_t key, int len,
+           struct radix_node **parent)
+{
+    struct radix_node *p;
+
+    if ( len < 0 || len > RADIX_KEYLENGTH ) {
+        return NULL;
+    }
+    key &= radix_mask(len);
+
+    p = NULL;
+    while ( NULL != node && node->len < len ) {
+        p = node;
+        if ( RADIX_BT(key, node->len) ) {
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    if ( NULL == node || node->len != len || node->key != key ) {
+        return NULL;
+    }
+    if ( NULL != parent ) {
+        *parent = p;
+    }
+
+    return node;
+}
+
+/*
+ * Release the nodes on the path to the prefix that neither hold a route nor
+ * branch, from the bottom.  The marks must have been cleared.
+ */
+void
+radix_prune(struct poptrie *poptrie, __uint128_t key, int len)
+{
+    struct radix_node **links[RADIX_KEYLENGTH + 1];
+    struct radix_node *node;
+    int n;
+
+    if ( len < 0 || len > RADIX_KEYLENGTH ) {
+        return;
+    }
+    key &= radix_mask(len);
+
+    n = 0;
+    links[0] = &poptrie->radix;
+    node = poptrie->radix;
+    while ( NULL != node && node->len < len ) {
+        if ( RADIX_BT(key, node->len) ) {
+            links[++n] = &node->right;
+        } else {
+            links[++n] = &node->left;
+        }
+        node = *links[n];
+    }
+    if ( NULL == node || node->len != len || node->key != key ) {
+        return;
+    }
+
+    /* The root is kept for the update procedure */
+    for ( ; n > 0; n-- ) {
+        node = *links[n];
+        if ( node->valid || (NULL != node->left && NULL != node->right) ) {
+            break;
+        }
+        /* Lift the child if any; no node refers to this invalid one as the
+           nearest valid route */
+        if ( NULL != node->left ) {
+            *links[n] = node->left;
+        } else {
+            *links[n] = node->right;
+        }
+        slab_free(poptrie->cradix, node);
+    }
+}
+
+/*
+ * Copy the radix tree to a new pool in the preorder, dropping the nodes that
+ * neither hold a route nor branch, and release the old pool.  The siblings are
+ * laid out close to each other, and the nearest valid nodes are resolved on
+ * the copy.  The marks must have been cleared.  This returns the number of the
+ * nodes dropped, or -1 if the memory cannot be allocated; the tree is not
+ * modified then.
+ */
+int
+radix_compact(struct poptrie *poptrie)
+{
+    struct slab pool;
+    struct radix_node *stack[RADIX_DEPTH + 1];
+    struct radix_node **links[RADIX_DEPTH + 1];
+    struct radix_node *parents[RADIX_DEPTH + 1];
+    struct radix_node *node;
+    struct radix_node *n;
+    struct radix_node *p;
+    struct radix_node **link;
+    struct radix_node *root;
+    int used;
+    int sp;
+
+    if ( NULL == poptrie->radix ) {
+        return 0;
+    }
+    used = ((struct slab *)poptrie->cradix)->used;
+    slab_init(&pool, sizeof(struct radix_node));
+
+    root = NULL;
+    sp = 0;
+    stack[sp] = poptrie->radix;
+    links[sp] = &root;
+    parents[sp] = NULL;
+    sp++;
+    while ( sp > 0 ) {
+        sp--;
+        node = stack[sp];
+        link = links[sp];
+        p = parents[sp];
+
+        /* Skip the nodes neither holding a route nor branching except for the
+           root */
+        while ( NULL != p && NULL != node && !node->valid
+                && (NULL == node->left || NULL == node->right) ) {
+            node = NULL != node->left ? node->left : node->right;
+        }
+        if ( NULL == node ) {
+            *link = NULL;
+            continue;
+        }
+
+        n = slab_alloc(&pool);
+        if ( NULL == n ) {
+            slab_release(&pool);
+            return -1;
+        }
+        n->key = node->key;
+        n->left = NULL;
+        n->right = NULL;
+        n->ext = node->valid ? n : (NULL != p ? p->ext : NULL);
+        n->nexthop = node->nexthop;
+        n->len = node->len;
+        n->valid = node->valid;
+        n->mark = 0;
+        n->lazy = 0;
+        *link = n;
+
+        /* The left child is copied first */
+        if ( NULL != node->right ) {
+            stack[sp] = node->right;
+            links[sp] = &n->right;
+            parents[sp] = n;
+            sp++;
+        }
+        if ( NULL != node->left ) {
+            stack[sp] = node->left;
+            links[sp] = &n->left;
+            parents[sp] = n;
+            sp++;
+        }
+    }
+
+    /* Replace the pool */
+    slab_release(poptrie->cradix);
+    *(struct slab *)poptrie->cradix = pool;
+    poptrie->radix = root;
+
+    return used - pool.used;
+}
+
+/*
+ * Set the mark of the ancestors of the prefix from the root, and return the
+ * node of the prefix.  If the prefix is on an omitted path, the descendant is
+ * marked and returned instead.
+ */
+struct radix_node *
+radix_mark_path(struct radix_node *node, __uint128_t key, int len, int mark)
+{
+    key &= radix_mask(len);
+    while ( NULL != node ) {
+        if ( (node->key ^ key)
+             & radix_mask(node->len < len ? node->len : len) ) {
+            /* Off the path */
+            return NULL;
+        }
+        if ( node->len >= len ) {
+            if ( node->len > len && mark ) {
+                /* The descendant stands for the omitted node */
+                node->mark = mark;
+            }
+            return node;
+        }
+        node->mark = mark;
+        if ( RADIX_BT(key, node->len) ) {
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Lookup the next hop of the longest matching prefix
+ */
+poptrie_fib_index_t
+radix_lookup(struct radix_node *node, __uint128_t key)
+{
+    struct radix_node *en;
+
+    en = NULL;
+    while ( NULL != node ) {
+        if ( (node->key ^ key) & radix_mask(node->len) ) {
+            /* The path diverges from the key */
+            break;
+        }
+        if ( node->valid ) {
+            en = node;
+        }
+        if ( RADIX_KEYLENGTH == node->len ) {
+            break;
+        }
+        if ( RADIX_BT(key, node->len) ) {
+            node = node->right;
+        } else {
+            node = node->left;
+        }
+    }
+    if ( NULL == en ) {
+        return 0;
+    }
+
+    return en->nexthop;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,137 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_RADIX_H
+#define _POPTRIE_RADIX_H
+
+#include "poptrie.h"
+
+/* The maximum prefix length of the keys */
+#define RADIX_KEYLENGTH         128
+
+/* The maximum number of the nodes on a path from the root */
+#define RADIX_DEPTH             (RADIX_KEYLENGTH + 1)
+
+/* Bit of a key at the depth */
+#define RADIX_BT(k, d)          (((k) >> (RADIX_KEYLENGTH - (d) - 1)) & 1)
+
+/*
+ * Mask of the prefix length
+ */
+static __inline__ __uint128_t
+radix_mask(int len)
+{
+    if ( 0 == len ) {
+        return 0;
+    }
+
+    return ~(__uint128_t)0 << (RADIX_KEYLENGTH - len);
+}
+
+/*
+ * Resolve the nearest valid node of a child from its parent, and pass down the
+ * mark of the route added, changed, or deleted above the child unless the
+ * child holds a route of its own.  Nothing is written if it is up to date.
+ */
+static __inline__ void
+radix_resolve(const struct radix_node *node, struct radix_node *c)
+{
+    struct radix_node *ext;
+
+    ext = c->valid ? c : node->ext;
+    if ( c->ext != ext ) {
+        c->ext = ext;
+    }
+    if ( node->lazy && !c->valid && !c->lazy ) {
+        c->lazy = 1;
+        c->mark = 1;
+    }
+}
+
+/*
+ * Get the child of a node at the next depth, and resolve it from the node.  A
+ * child omitted from the path-compressed radix tree is materialized in tmp,
+ * which may be the node itself, as an invalid node with the nearest valid
+ * route of the node.  It only refers to the nodes in the tree, so that it is
+ * valid while the tree is not modified.
+ */
+static __inline__ struct radix_node *
+radix_child(struct radix_node *node, int right, struct radix_node *tmp)
+{
+    struct radix_node *c;
+    struct radix_node *ext;
+    int lazy;
+    int len;
+
+    c = right ? node->right : node->left;
+    if ( NULL == c ) {
+        return NULL;
+    }
+    len = node->len + 1;
+    if ( c->len == len ) {
+        radix_resolve(node, c);
+        return c;
+    }
+    ext = node->ext;
+    lazy = node->lazy;
+
+    /* The key of the descendant; the bits beyond len are not referred to */
+    tmp->key = c->key;
+    tmp->len = len;
+    tmp->valid = 0;
+    tmp->nexthop = 0;
+    tmp->ext = ext;
+    /* The omitted nodes are marked with the path to the descendant, or with
+       the route changed above */
+    tmp->mark = c->mark | lazy;
+    tmp->lazy = lazy;
+    if ( RADIX_BT(c->key, len) ) {
+        tmp->left = NULL;
+        tmp->right = c;
+    } else {
+        tmp->left = c;
+        tmp->right = NULL;
+    }
+
+    return tmp;
+}
+
+/*
+ * Test if a child is marked
+ */
+static __inline__ int
+radix_marked(const struct radix_node *node)
+{
+    return NULL != node && node->mark;
+}
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* radix.c */
+    struct radix_node * radix_insert(struct poptrie *, __uint128_t, int);
+    struct radix_node *
+    radix_find(struct radix_node *, __uint128_t, int, struct radix_node **);
+    void radix_prune(struct poptrie *, __uint128_t, int);
+    struct radix_node *
+    radix_mark_path(struct radix_node *, __uint128_t, int, int);
+    poptrie_fib_index_t radix_lookup(struct radix_node *, __uint128_t);
+    int radix_compact(struct poptrie *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_RADIX_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
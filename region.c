@@ -0,0 +1,284 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "region.h"
+#include "poptrie.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Memory policy for mbind(2) */
+#define REGION_MPOL_PREFERRED   1
+
+#define ROUNDUP(x, a)   (((x) + (a) - 1) / (a) * (a))
+
+/* Prototype declarations */
+static void * _mmap_aligned(size_t, size_t);
+static int _commit(struct poptrie_region *, size_t);
+static int _bind(void *, size_t, int);
+
+/*
+ * Allocate a memory region of sz bytes.  Without any flag, the region is
+ * allocated by malloc().  Otherwise, it is an anonymous mapping backed by huge
+ * pages if POPTRIE_HUGEPAGE is specified and available.
+ */
+int
+region_alloc(struct poptrie_region *r, size_t sz, int flags)
+{
+    return region_reserve(r, sz, sz, flags, -1);
+}
+
+/*
+ * Allocate a memory region of sz bytes on the NUMA node specified by the node
+ * argument.  A negative node does not bind the region to any node.
+ */
+int
+region_alloc_node(struct poptrie_region *r, size_t sz, int flags, int node)
+{
+    return region_reserve(r, sz, sz, flags, node);
+}
+
+/*
+ * Reserve the address space of maxsz bytes, and allocate the first sz bytes of
+ * it.  The rest is allocated by region_grow() without moving the region.
+ */
+int
+region_reserve(struct poptrie_region *r, size_t sz, size_t maxsz, int flags,
+               int node)
+{
+    void *ptr;
+    size_t align;
+
+    r->ptr = NULL;
+    r->sz = 0;
+    r->rsz = 0;
+    r->backing = POPTRIE_BACKING_MALLOC;
+    r->flags = flags;
+    r->node = node;
+    if ( maxsz < sz ) {
+        maxsz = sz;
+    }
+
+    if ( node < 0 && maxsz == sz
+         && !(flags & (POPTRIE_HUGEPAGE | POPTRIE_PREFAULT | POPTRIE_MLOCK)) ) {
+        /* Plain memory */
+        ptr = malloc(sz);
+        if ( NULL == ptr ) {
+            return -1;
+        }
+        r->ptr = ptr;
+        r->sz = sz;
+        r->rsz = sz;
+        return 0;
+    }
+
+    /* Reserve the address space without any page */
+    if ( flags & POPTRIE_HUGEPAGE ) {
+        align = REGION_HUGEPAGE_SIZE;
+    } else {
+        align = REGION_PAGE_SIZE;
+    }
+    ptr = _mmap_aligned(ROUNDUP(maxsz, align), align);
+    if ( MAP_FAILED == ptr ) {
+        return -1;
+    }
+    r->ptr = ptr;
+    r->rsz = ROUNDUP(maxsz, align);
+    r->backing = POPTRIE_BACKING_MMAP;
+
+    if ( flags & POPTRIE_HUGEPAGE ) {
+#ifdef MAP_HUGETLB
+        /* Try the reserved huge pages first */
+        r->backing = POPTRIE_BACKING_HUGETLB;
+        if ( 0 == _commit(r, sz) ) {
+            return 0;
+        }
+#endif
+        /* Fall back to the transparent huge pages */
+        r->backing = POPTRIE_BACKING_MMAP;
+#ifdef MADV_HUGEPAGE
+        if ( 0 == madvise(ptr, r->rsz, MADV_HUGEPAGE) ) {
+            r->backing = POPTRIE_BACKING_THP;
+        }
+#endif
+    }
+    if ( _commit(r, sz) < 0 ) {
+        region_free(r);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Extend the allocated part of a region to sz bytes in place
+ */
+int
+region_grow(struct poptrie_region *r, size_t sz)
+{
+    if ( sz <= r->sz ) {
+        return 0;
+    }
+    if ( POPTRIE_BACKING_MALLOC == (r->backing & POPTRIE_BACKING_MASK)
+         || sz > r->rsz ) {
+        /* Not reserved */
+        return -1;
+    }
+
+    return _commit(r, sz);
+}
+
+/*
+ * Release a memory region
+ */
+void
+region_free(struct poptrie_region *r)
+{
+    if ( NULL == r->ptr ) {
+        return;
+    }
+    if ( POPTRIE_BACKING_MALLOC == (r->backing & POPTRIE_BACKING_MASK) ) {
+        free(r->ptr);
+    } else {
+        (void)munmap(r->ptr, r->rsz);
+    }
+    r->ptr = NULL;
+    r->sz = 0;
+    r->rsz = 0;
+}
+
+/*
+ * Reserve the address space of sz bytes aligned to align bytes
+ */
+static void *
+_mmap_aligned(size_t sz, size_t align)
+{
+    u8 *ptr;
+    u8 *aligned;
+
+    ptr = mmap(NULL, sz + align, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( MAP_FAILED == ptr ) {
+        return MAP_FAILED;
+    }
+
+    /* Trim the head and the tail */
+    aligned = (u8 *)ROUNDUP((u64)ptr, align);
+    if ( aligned != ptr ) {
+        (void)munmap(ptr, aligned - ptr);
+    }
+    if ( ptr + align != aligned ) {
+        (void)munmap(aligned + sz, ptr + align - aligned);
+    }
+
+    return aligned;
+}
+
+/*
+ * Make the pages of a reserved region accessible up to sz bytes
+ */
+static int
+_commit(struct poptrie_region *r, size_t sz)
+{
+    u8 *ptr;
+    size_t len;
+    size_t off;
+    size_t align;
+
+    if ( r->flags & POPTRIE_HUGEPAGE ) {
+        align = REGION_HUGEPAGE_SIZE;
+    } else {
+        align = REGION_PAGE_SIZE;
+    }
+    sz = ROUNDUP(sz, align);
+    if ( sz > r->rsz ) {
+        return -1;
+    }
+    if ( sz <= r->sz ) {
+        return 0;
+    }
+    ptr = (u8 *)r->ptr + r->sz;
+    len = sz - r->sz;
+
+    if ( POPTRIE_BACKING_HUGETLB == (r->backing & POPTRIE_BACKING_MASK) ) {
+#ifdef MAP_HUGETLB
+        /* Replace the reserved range with huge pages */
+        if ( MAP_FAILED == mmap(ptr, len, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED
+                                | MAP_HUGETLB, -1, 0) ) {
+            /* Reserve the range again in case it was unmapped */
+            (void)mmap(ptr, len, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED
+                       | MAP_NORESERVE, -1, 0);
+            return -1;
+        }
+#else
+        return -1;
+#endif
+    } else {
+        if ( 0 != mprotect(ptr, len, PROT_READ | PROT_WRITE) ) {
+            return -1;
+        }
+    }
+
+    if ( r->node >= 0 ) {
+        /* Bind before the pages are faulted in */
+        if ( 0 == _bind(ptr, len, r->node) ) {
+            r->backing |= POPTRIE_BACKING_BOUND;
+        }
+    }
+    if ( r->flags & POPTRIE_PREFAULT ) {
+        /* Write to every page so that no page fault occurs on lookups */
+        for ( off = 0; off < len; off += REGION_PAGE_SIZE ) {
+            *((volatile u8 *)ptr + off) = 0;
+        }
+        r->backing |= POPTRIE_BACKING_PREFAULTED;
+    }
+    if ( r->flags & POPTRIE_MLOCK ) {
+        /* The region is still usable without the lock */
+        if ( 0 == mlock(ptr, len) ) {
+            r->backing |= POPTRIE_BACKING_LOCKED;
+        } else {
+            r->backing &= ~POPTRIE_BACKING_LOCKED;
+        }
+    }
+    r->sz = sz;
+
+    return 0;
+}
+
+/*
+ * Set the preferred NUMA node of the pages in a range
+ */
+static int
+_bind(void *ptr, size_t sz, int node)
+{
+#ifdef SYS_mbind
+    unsigned long mask[4];
+
+    if ( node >= (int)(sizeof(mask) * 8) ) {
+        return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / (sizeof(unsigned long) * 8)]
+        |= 1UL << (node % (sizeof(unsigned long) * 8));
+
+    return syscall(SYS_mbind, ptr, sz, REGION_MPOL_PREFERRED, mask,
+                   sizeof(mask) * 8, 0);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,41 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_REGION_H
+#define _POPTRIE_REGION_H
+
+#include "poptrie.h"
+#include <stddef.h>
+
+/* Size of a huge page assumed for the alignment and the rounding */
+#define REGION_HUGEPAGE_SIZE    (2 << 20)
+/* Size of a base page used to prefault */
+#define REGION_PAGE_SIZE        4096
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* region.c */
+    int region_alloc(struct poptrie_region *, size_t, int);
+    int region_alloc_node(struct poptrie_region *, size_t, int, int);
+    int region_reserve(struct poptrie_region *, size_t, size_t, int, int);
+    int region_grow(struct poptrie_region *, size_t);
+    void region_free(struct poptrie_region *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_REGION_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,285 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "poptrie.h"
+#include "region.h"
+#include "replica.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* NUMA node of the current thread cached at the first lookup.  The initial
+   exec model avoids __tls_get_addr() on every lookup in the shared library. */
+static __thread int _local_node __attribute__ ((tls_model("initial-exec")))
+    = -1;
+
+/*
+ * Get the number of NUMA nodes
+ */
+int
+poptrie_numa_nodes(void)
+{
+    FILE *fp;
+    char buf[256];
+    char *p;
+    int n;
+
+    /* The possible nodes are listed like "0" or "0-3" */
+    fp = fopen("/sys/devices/system/node/possible", "r");
+    if ( NULL == fp ) {
+        return 1;
+    }
+    if ( NULL == fgets(buf, sizeof(buf), fp) ) {
+        fclose(fp);
+        return 1;
+    }
+    fclose(fp);
+    p = buf + strlen(buf);
+    while ( p > buf && !(p[-1] >= '0' && p[-1] <= '9') ) {
+        p--;
+    }
+    while ( p > buf && p[-1] >= '0' && p[-1] <= '9' ) {
+        p--;
+    }
+    n = atoi(p) + 1;
+
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Get the NUMA node of the CPU the current thread runs on
+ */
+int
+poptrie_local_node(void)
+{
+#ifdef SYS_getcpu
+    unsigned cpu;
+    unsigned node;
+
+    if ( 0 == syscall(SYS_getcpu, &cpu, &node, NULL) ) {
+        return node;
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Get the NUMA node of the current thread.  The node is looked up only once
+ * per thread, so the threads should be pinned to the CPUs.
+ */
+int
+replica_local(void)
+{
+    if ( _local_node < 0 ) {
+        _local_node = poptrie_local_node();
+    }
+
+    return _local_node;
+}
+
+/*
+ * Allocate a replica on each NUMA node and copy the current arrays to them
+ */
+int
+replica_init(struct poptrie *poptrie, int flags)
+{
+    struct poptrie_replica *r;
+    int n;
+    int i;
+    int ret;
+
+    n = poptrie_numa_nodes();
+    poptrie->replicas = calloc(n, sizeof(struct poptrie_replica));
+    if ( NULL == poptrie->replicas ) {
+        return -1;
+    }
+    poptrie->nreplicas = n;
+
+    for ( i = 0; i < n; i++ ) {
+        r = &poptrie->replicas[i];
+        ret = region_reserve(&r->nodes_region, poptrie->nodes_region.sz,
+                             poptrie->nodes_region.rsz, flags, i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        r->nodes = r->nodes_region.ptr;
+        ret = region_reserve(&r->leaves_region, poptrie->leaves_region.sz,
+                             poptrie->leaves_region.rsz, flags, i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        r->leaves = r->leaves_region.ptr;
+        ret = region_alloc_node(&r->dir_region, sizeof(u32) << poptrie->s,
+                                flags, i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        r->dir = r->dir_region.ptr;
+
+        memcpy(r->nodes, poptrie->nodes, poptrie->nodes_region.sz);
+        memcpy(r->leaves, poptrie->leaves, poptrie->leaves_region.sz);
+        memcpy(r->dir, poptrie->dir, sizeof(u32) << poptrie->s);
+    }
+
+    /* Log of the written blocks */
+    poptrie->dirty = malloc(sizeof(struct poptrie_dirty)
+                            * REPLICA_INIT_DIRTY_SIZE);
+    if ( NULL == poptrie->dirty ) {
+        return -1;
+    }
+    poptrie->dirtysz = REPLICA_INIT_DIRTY_SIZE;
+    poptrie->ndirty = 0;
+
+    return 0;
+}
+
+/*
+ * Release the replicas
+ */
+void
+replica_release(struct poptrie *poptrie)
+{
+    int i;
+
+    if ( NULL != poptrie->replicas ) {
+        for ( i = 0; i < poptrie->nreplicas; i++ ) {
+            region_free(&poptrie->replicas[i].nodes_region);
+            region_free(&poptrie->replicas[i].leaves_region);
+            region_free(&poptrie->replicas[i].dir_region);
+        }
+        free(poptrie->replicas);
+        poptrie->replicas = NULL;
+        poptrie->nreplicas = 0;
+    }
+    if ( NULL != poptrie->dirty ) {
+        free(poptrie->dirty);
+        poptrie->dirty = NULL;
+    }
+}
+
+/*
+ * Grow the internal node or leaf array of the replicas to sz bytes
+ */
+int
+replica_grow(struct poptrie *poptrie, int region, size_t sz)
+{
+    struct poptrie_region *r;
+    int i;
+
+    for ( i = 0; i < poptrie->nreplicas; i++ ) {
+        if ( POPTRIE_REGION_NODES == region ) {
+            r = &poptrie->replicas[i].nodes_region;
+        } else {
+            r = &poptrie->replicas[i].leaves_region;
+        }
+        if ( region_grow(r, sz) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Log a block of 2^order nodes (or leaves if leaf is non-zero) written from
+ * the index off
+ */
+void
+replica_dirty(struct poptrie *poptrie, int leaf, int off, int order)
+{
+    struct poptrie_dirty *dirty;
+
+    if ( poptrie->ndirty < 0 ) {
+        /* Already overflowed */
+        return;
+    }
+    if ( poptrie->ndirty >= poptrie->dirtysz ) {
+        dirty = realloc(poptrie->dirty, sizeof(struct poptrie_dirty)
+                        * poptrie->dirtysz * 2);
+        if ( NULL == dirty ) {
+            /* Synchronize the whole arrays instead */
+            poptrie->ndirty = -1;
+            return;
+        }
+        poptrie->dirty = dirty;
+        poptrie->dirtysz *= 2;
+    }
+    poptrie->dirty[poptrie->ndirty].off = off;
+    poptrie->dirty[poptrie->ndirty].order = order;
+    poptrie->dirty[poptrie->ndirty].leaf = leaf;
+    poptrie->ndirty++;
+}
+
+/*
+ * Copy the logged blocks to a replica
+ */
+static void
+_sync_blocks(struct poptrie *poptrie, struct poptrie_replica *r)
+{
+    struct poptrie_dirty *d;
+    int j;
+
+    if ( poptrie->ndirty < 0 ) {
+        memcpy(r->nodes, poptrie->nodes, poptrie->nodes_region.sz);
+        memcpy(r->leaves, poptrie->leaves, poptrie->leaves_region.sz);
+    } else {
+        for ( j = 0; j < poptrie->ndirty; j++ ) {
+            d = &poptrie->dirty[j];
+            if ( d->leaf ) {
+                memcpy(r->leaves + d->off, poptrie->leaves + d->off,
+                       sizeof(poptrie_leaf_t) << d->order);
+            } else {
+                memcpy(r->nodes + d->off, poptrie->nodes + d->off,
+                       sizeof(poptrie_node_t) << d->order);
+            }
+        }
+    }
+}
+
+/*
+ * Apply the logged blocks and the n direct pointing entries from idx to the
+ * replicas and the shared-memory segment.  The nodes and leaves are copied
+ * before the direct pointing entries that refer to them.
+ */
+void
+replica_sync(struct poptrie *poptrie, u32 idx, u32 n)
+{
+    struct poptrie_replica *r;
+    int i;
+    int j;
+
+    for ( i = 0; i < poptrie->nreplicas; i++ ) {
+        _sync_blocks(poptrie, &poptrie->replicas[i]);
+    }
+    if ( NULL != poptrie->shm ) {
+        _sync_blocks(poptrie, &poptrie->shm->replica);
+    }
+    __sync_synchronize();
+    for ( i = 0; i < poptrie->nreplicas; i++ ) {
+        r = &poptrie->replicas[i];
+        for ( j = 0; j < (int)n; j++ ) {
+            r->dir[idx + j] = poptrie->dir[idx + j];
+        }
+    }
+    if ( NULL != poptrie->shm ) {
+        r = &poptrie->shm->replica;
+        for ( j = 0; j < (int)n; j++ ) {
+            r->dir[idx + j] = poptrie->dir[idx + j];
+        }
+    }
+    poptrie->ndirty = 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
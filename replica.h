@@ -0,0 +1,39 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_REPLICA_H
+#define _POPTRIE_REPLICA_H
+
+#include "poptrie.h"
+
+/* Initial size of the log of the written blocks */
+#define REPLICA_INIT_DIRTY_SIZE 256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* replica.c */
+    int replica_init(struct poptrie *, int);
+    void replica_release(struct poptrie *);
+    int replica_grow(struct poptrie *, int, size_t);
+    void replica_dirty(struct poptrie *, int, int, int);
+    void replica_sync(struct poptrie *, u32, u32);
+    int replica_local(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_REPLICA_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,505 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "poptrie.h"
+#include "qsbr.h"
+#include "region.h"
+#include "replica.h"
+#include "shm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Shared-memory segment for the reader processes.  The writer process keeps
+ * its own arrays with the RIB and the buddy systems, and copies the written
+ * blocks and direct pointing entries to the segment at the end of each update
+ * in the same way as the NUMA replicas.  The internal references are the
+ * indices to the arrays, so that the reader processes look up the segment
+ * mapped at any address.  Each reader process publishes the generation it
+ * has observed at a quiescent state in its slot, and the writer does not
+ * reuse the blocks until all the attached readers have passed the generation
+ * of their release.
+ */
+
+#define SHM_MAGIC               "POPTSHM"
+#define SHM_ALIGN               4096
+
+#define ROUNDUP(x, a)   (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * Header of the segment, followed by the slots of the readers
+ */
+struct shm_header {
+    char magic[8];
+    u32 version;
+    /* Sizes of the data structures to be compatible */
+    u32 nodebytes;
+    u32 leafbytes;
+    u32 fibbytes;
+    int s;
+    int nslots;
+    int fibsz;
+    /* Generation of the reclamation published by the writer */
+    volatile u64 generation;
+    /* Sections */
+    u64 slotsoff;
+    u64 headerlen;
+    u64 diroff;
+    u64 nodesoff;
+    u64 nodeslen;
+    u64 leavesoff;
+    u64 leaveslen;
+    u64 fiboff;
+    u64 fiblen;
+};
+
+/*
+ * Slot of a reader process.  Each one occupies a cache line.
+ */
+struct shm_slot {
+    /* The generation observed at the last quiescent state; QSBR_OFFLINE when
+       offline */
+    volatile u64 epoch;
+    /* Process ID of the reader, or zero if the slot is free */
+    volatile int pid;
+} __attribute__ ((aligned (64)));
+
+/*
+ * Map a section of the segment to a region
+ */
+static int
+_map(struct poptrie_region *r, int fd, u64 off, u64 len, int prot)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, len, prot, MAP_SHARED, fd, off);
+    if ( MAP_FAILED == ptr ) {
+        return -1;
+    }
+    r->ptr = ptr;
+    r->sz = len;
+    r->rsz = len;
+    r->backing = POPTRIE_BACKING_SHM;
+    r->flags = 0;
+    r->node = -1;
+
+    return 0;
+}
+
+/*
+ * Map the sections of the segment described by the header
+ */
+static int
+_map_sections(struct poptrie_shm *shm, int fd, const struct shm_header *h,
+              int prot)
+{
+    int ret;
+
+    ret = _map(&shm->header_region, fd, 0, h->headerlen,
+               PROT_READ | PROT_WRITE);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = _map(&shm->replica.dir_region, fd, h->diroff, sizeof(u32) << h->s,
+               prot);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    shm->replica.dir = shm->replica.dir_region.ptr;
+    ret = _map(&shm->replica.nodes_region, fd, h->nodesoff, h->nodeslen,
+               prot);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    shm->replica.nodes = shm->replica.nodes_region.ptr;
+    ret = _map(&shm->replica.leaves_region, fd, h->leavesoff, h->leaveslen,
+               prot);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    shm->replica.leaves = shm->replica.leaves_region.ptr;
+    ret = _map(&shm->fib_region, fd, h->fiboff, h->fiblen, prot);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    shm->fib = shm->fib_region.ptr;
+    shm->nslots = h->nslots;
+
+    return 0;
+}
+
+/*
+ * Unmap the sections, and unlink the segment if the name is set
+ */
+static void
+_unmap_sections(struct poptrie_shm *shm)
+{
+    region_free(&shm->header_region);
+    region_free(&shm->replica.dir_region);
+    region_free(&shm->replica.nodes_region);
+    region_free(&shm->replica.leaves_region);
+    region_free(&shm->fib_region);
+    if ( NULL != shm->name ) {
+        (void)shm_unlink(shm->name);
+        free(shm->name);
+        shm->name = NULL;
+    }
+}
+
+/*
+ * Get the slots of the readers in the segment
+ */
+static struct shm_slot *
+_slots(struct poptrie_shm *shm)
+{
+    struct shm_header *h;
+
+    h = shm->header_region.ptr;
+
+    return (struct shm_slot *)((u8 *)h + h->slotsoff);
+}
+
+/*
+ * Create the segment, and copy the current arrays to it
+ */
+static int
+_create(struct poptrie *poptrie, struct poptrie_shm *shm, int nslots)
+{
+    struct shm_header h;
+    struct shm_header *hp;
+    int fd;
+    int ret;
+    int i;
+
+    /* Place the sections; the arrays are sized to the maximum sizes to
+       which they grow, while the pages are not allocated until written */
+    memset(&h, 0, sizeof(h));
+    h.version = POPTRIE_SHM_VERSION;
+    h.nodebytes = sizeof(poptrie_node_t);
+    h.leafbytes = sizeof(poptrie_leaf_t);
+    h.fibbytes = sizeof(struct poptrie_fib_entry);
+    h.s = poptrie->s;
+    h.nslots = nslots;
+    h.fibsz = POPTRIE_FIB_MAX;
+    h.slotsoff = ROUNDUP(sizeof(struct shm_header), sizeof(struct shm_slot));
+    h.headerlen = ROUNDUP(h.slotsoff + sizeof(struct shm_slot) * nslots,
+                          SHM_ALIGN);
+    h.diroff = h.headerlen;
+    h.nodesoff = h.diroff + ROUNDUP(sizeof(u32) << poptrie->s, SHM_ALIGN);
+    h.nodeslen = ROUNDUP(poptrie->nodes_region.rsz, SHM_ALIGN);
+    h.leavesoff = h.nodesoff + h.nodeslen;
+    h.leaveslen = ROUNDUP(poptrie->leaves_region.rsz, SHM_ALIGN);
+    h.fiboff = h.leavesoff + h.leaveslen;
+    h.fiblen = ROUNDUP(sizeof(struct poptrie_fib_entry) * h.fibsz, SHM_ALIGN);
+
+    fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ( fd < 0 ) {
+        /* Do not unlink the segment of another writer */
+        free(shm->name);
+        shm->name = NULL;
+        return -1;
+    }
+    ret = ftruncate(fd, h.fiboff + h.fiblen);
+    if ( ret < 0 ) {
+        close(fd);
+        return -1;
+    }
+    ret = _map_sections(shm, fd, &h, PROT_READ | PROT_WRITE);
+    close(fd);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    /* Copy the arrays and the FIB entries */
+    memcpy(shm->replica.dir, poptrie->dir, sizeof(u32) << poptrie->s);
+    memcpy(shm->replica.nodes, poptrie->nodes, poptrie->nodes_region.sz);
+    memcpy(shm->replica.leaves, poptrie->leaves, poptrie->leaves_region.sz);
+    for ( i = 0; i < poptrie->fib.sz; i++ ) {
+        shm->fib[i].entry = poptrie->fib.entries[i].entry;
+    }
+
+    /* The magic is written last, so that the readers do not attach to the
+       segment being initialized */
+    hp = shm->header_region.ptr;
+    memcpy(hp, &h, sizeof(h));
+    hp->generation = poptrie->epoch;
+    __sync_synchronize();
+    memcpy(hp->magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+
+    return 0;
+}
+
+/*
+ * Create a shared-memory segment of the name with nslots slots of the reader
+ * processes.  The poptrie must be initialized with POPTRIE_QSBR.
+ */
+int
+poptrie_shm_create(struct poptrie *poptrie, const char *name, int nslots)
+{
+    struct poptrie_shm *shm;
+    int ret;
+
+    if ( NULL == poptrie->limbo || NULL != poptrie->shm || nslots <= 0 ) {
+        return -1;
+    }
+    shm = calloc(1, sizeof(struct poptrie_shm));
+    if ( NULL == shm ) {
+        return -1;
+    }
+    shm->name = strdup(name);
+    if ( NULL == shm->name ) {
+        free(shm);
+        return -1;
+    }
+
+    /* Log the written blocks even without the NUMA replicas */
+    if ( NULL == poptrie->dirty ) {
+        poptrie->dirty = malloc(sizeof(struct poptrie_dirty)
+                                * REPLICA_INIT_DIRTY_SIZE);
+        if ( NULL == poptrie->dirty ) {
+            free(shm->name);
+            free(shm);
+            return -1;
+        }
+        poptrie->dirtysz = REPLICA_INIT_DIRTY_SIZE;
+        poptrie->ndirty = 0;
+    }
+
+    ret = _create(poptrie, shm, nslots);
+    if ( ret < 0 ) {
+        _unmap_sections(shm);
+        free(shm);
+        return -1;
+    }
+    poptrie->shm = shm;
+
+    return 0;
+}
+
+/*
+ * Release the segment of the writer.  The segment is unlinked, while the
+ * attached readers keep their mappings.
+ */
+void
+shm_release(struct poptrie *poptrie)
+{
+    if ( NULL != poptrie->shm ) {
+        _unmap_sections(poptrie->shm);
+        free(poptrie->shm);
+        poptrie->shm = NULL;
+    }
+}
+
+/*
+ * Publish the current epoch to the readers, and return the oldest generation
+ * observed by them.  The slots of the readers that have exited without
+ * detaching are released.
+ */
+u64
+shm_oldest(struct poptrie *poptrie)
+{
+    struct shm_header *h;
+    struct shm_slot *slots;
+    u64 min;
+    u64 epoch;
+    int pid;
+    int i;
+
+    h = poptrie->shm->header_region.ptr;
+    slots = _slots(poptrie->shm);
+    __atomic_store_n(&h->generation, poptrie->epoch, __ATOMIC_RELEASE);
+    __sync_synchronize();
+
+    min = QSBR_OFFLINE;
+    for ( i = 0; i < poptrie->shm->nslots; i++ ) {
+        pid = slots[i].pid;
+        epoch = __atomic_load_n(&slots[i].epoch, __ATOMIC_ACQUIRE);
+        if ( 0 == pid || epoch >= min ) {
+            continue;
+        }
+        if ( kill(pid, 0) < 0 && ESRCH == errno ) {
+            /* The reader has gone */
+            __atomic_store_n(&slots[i].epoch, QSBR_OFFLINE, __ATOMIC_RELEASE);
+            (void)__sync_bool_compare_and_swap(&slots[i].pid, pid, 0);
+            continue;
+        }
+        min = epoch;
+    }
+
+    return min;
+}
+
+/*
+ * Map the segment, and take a free slot
+ */
+static int
+_attach(struct poptrie_shm_reader *reader, int fd)
+{
+    struct shm_header h;
+    struct shm_header *hp;
+    struct shm_slot *slots;
+    struct stat st;
+    int pid;
+    int ret;
+    int i;
+
+    /* Check the header and that the sections are in the segment */
+    if ( fstat(fd, &st) < 0 ) {
+        return -1;
+    }
+    if ( sizeof(h) != pread(fd, &h, sizeof(h), 0) ) {
+        return -1;
+    }
+    if ( 0 != memcmp(h.magic, SHM_MAGIC, sizeof(SHM_MAGIC))
+         || POPTRIE_SHM_VERSION != h.version
+         || sizeof(poptrie_node_t) != h.nodebytes
+         || sizeof(poptrie_leaf_t) != h.leafbytes
+         || sizeof(struct poptrie_fib_entry) != h.fibbytes
+         || h.s < POPTRIE_S_MIN || h.s > POPTRIE_S_MAX
+         || h.nslots <= 0 || h.fibsz <= 0 || h.fibsz > POPTRIE_FIB_MAX
+         || h.slotsoff + sizeof(struct shm_slot) * h.nslots > h.headerlen
+         || h.fiboff + h.fiblen > (u64)st.st_size
+         || h.diroff + (sizeof(u32) << h.s) > h.nodesoff
+         || h.nodesoff + h.nodeslen > h.leavesoff
+         || h.leavesoff + h.leaveslen > h.fiboff
+         || sizeof(struct poptrie_fib_entry) * h.fibsz > h.fiblen ) {
+        return -1;
+    }
+
+    /* The arrays are read-only, while the slots are written by the readers */
+    ret = _map_sections(&reader->shm, fd, &h, PROT_READ);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    /* Take a free slot */
+    pid = getpid();
+    slots = _slots(&reader->shm);
+    for ( i = 0; i < h.nslots; i++ ) {
+        if ( 0 == slots[i].pid
+             && __sync_bool_compare_and_swap(&slots[i].pid, 0, pid) ) {
+            break;
+        }
+    }
+    if ( i >= h.nslots ) {
+        return -1;
+    }
+    reader->slot = i;
+    poptrie_shm_online(reader);
+
+    /* Look up the arrays in the segment */
+    hp = reader->shm.header_region.ptr;
+    reader->poptrie.s = hp->s;
+    reader->poptrie.dir = reader->shm.replica.dir;
+    reader->poptrie.nodes = reader->shm.replica.nodes;
+    reader->poptrie.leaves = reader->shm.replica.leaves;
+    reader->poptrie.fib.entries = reader->shm.fib;
+    reader->poptrie.fib.sz = hp->fibsz;
+    reader->poptrie.fib.free = -1;
+
+    return 0;
+}
+
+/*
+ * Attach to the shared-memory segment of the name.  The reader is online.
+ */
+struct poptrie_shm_reader *
+poptrie_shm_attach(const char *name)
+{
+    struct poptrie_shm_reader *reader;
+    int fd;
+    int ret;
+
+    reader = calloc(1, sizeof(struct poptrie_shm_reader));
+    if ( NULL == reader ) {
+        return NULL;
+    }
+    reader->slot = -1;
+    fd = shm_open(name, O_RDWR, 0);
+    if ( fd < 0 ) {
+        free(reader);
+        return NULL;
+    }
+    ret = _attach(reader, fd);
+    close(fd);
+    if ( ret < 0 ) {
+        _unmap_sections(&reader->shm);
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+/*
+ * Release the slot, and unmap the segment
+ */
+void
+poptrie_shm_detach(struct poptrie_shm_reader *reader)
+{
+    struct shm_slot *slots;
+
+    slots = _slots(&reader->shm);
+    __atomic_store_n(&slots[reader->slot].epoch, QSBR_OFFLINE,
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&slots[reader->slot].pid, 0, __ATOMIC_RELEASE);
+    _unmap_sections(&reader->shm);
+    free(reader);
+}
+
+/*
+ * Bring a reader online before it starts the lookups again
+ */
+void
+poptrie_shm_online(struct poptrie_shm_reader *reader)
+{
+    struct shm_header *h;
+
+    h = reader->shm.header_region.ptr;
+    _slots(&reader->shm)[reader->slot].epoch
+        = __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE);
+    /* The writer must see this reader before it reads the nodes */
+    __sync_synchronize();
+}
+
+/*
+ * Take a reader offline, e.g., while it is idle
+ */
+void
+poptrie_shm_offline(struct poptrie_shm_reader *reader)
+{
+    __atomic_store_n(&_slots(&reader->shm)[reader->slot].epoch, QSBR_OFFLINE,
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Announce a quiescent state of a reader, i.e., it holds no reference to the
+ * nodes and leaves looked up so far
+ */
+void
+poptrie_shm_quiescent(struct poptrie_shm_reader *reader)
+{
+    struct shm_header *h;
+
+    h = reader->shm.header_region.ptr;
+    __atomic_store_n(&_slots(&reader->shm)[reader->slot].epoch,
+                     __atomic_load_n(&h->generation, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
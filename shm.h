@@ -0,0 +1,32 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_SHM_H
+#define _POPTRIE_SHM_H
+
+#include "poptrie.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* shm.c */
+    void shm_release(struct poptrie *);
+    u64 shm_oldest(struct poptrie *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_SHM_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,106 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "poptrie.h"
+#include "slab.h"
+#include <stdlib.h>
+
+/*
+ * Slab allocator.  The objects are carved in the order of the allocations
+ * from the chunks of SLAB_CHUNK_SIZE bytes, and the released ones are reused
+ * first.  The chunks are returned all at once by slab_release().
+ */
+
+/*
+ * Initialize the pool of the objects of objsz bytes
+ */
+void
+slab_init(struct slab *slab, size_t objsz)
+{
+    /* An object must hold the link of the free list */
+    if ( objsz < sizeof(void *) ) {
+        objsz = sizeof(void *);
+    }
+    slab->objsz = (objsz + sizeof(void *) - 1) / sizeof(void *)
+        * sizeof(void *);
+    slab->free = NULL;
+    slab->chunks = NULL;
+    slab->cur = NULL;
+    slab->end = NULL;
+    slab->used = 0;
+    slab->nchunks = 0;
+}
+
+/*
+ * Release all the chunks, including the objects still allocated
+ */
+void
+slab_release(struct slab *slab)
+{
+    void *chunk;
+
+    while ( NULL != slab->chunks ) {
+        chunk = slab->chunks;
+        slab->chunks = *(void **)chunk;
+        free(chunk);
+    }
+    slab_init(slab, slab->objsz);
+}
+
+/*
+ * Allocate an object
+ */
+void *
+slab_alloc(struct slab *slab)
+{
+    void *obj;
+    u8 *chunk;
+
+    if ( NULL != slab->free ) {
+        /* Reuse a released one */
+        obj = slab->free;
+        slab->free = *(void **)obj;
+        slab->used++;
+        return obj;
+    }
+
+    if ( NULL == slab->cur || slab->cur + slab->objsz > slab->end ) {
+        /* Take a new chunk; the first object is the link to the older ones */
+        chunk = malloc(SLAB_CHUNK_SIZE);
+        if ( NULL == chunk ) {
+            return NULL;
+        }
+        *(void **)chunk = slab->chunks;
+        slab->chunks = chunk;
+        slab->cur = chunk + slab->objsz;
+        slab->end = chunk + SLAB_CHUNK_SIZE;
+        slab->nchunks++;
+    }
+    obj = slab->cur;
+    slab->cur += slab->objsz;
+    slab->used++;
+
+    return obj;
+}
+
+/*
+ * Release an object to the pool
+ */
+void
+slab_free(struct slab *slab, void *obj)
+{
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->used--;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
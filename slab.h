@@ -0,0 +1,56 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#ifndef _POPTRIE_SLAB_H
+#define _POPTRIE_SLAB_H
+
+#include "poptrie.h"
+#include <stddef.h>
+
+/* Size of a chunk of the objects */
+#define SLAB_CHUNK_SIZE         (256 << 10)
+
+/*
+ * Pool of fixed-size objects carved from large chunks
+ */
+struct slab {
+    /* Size of each object */
+    size_t objsz;
+    /* Free objects linked through their first word */
+    void *free;
+    /* Chunks linked through their first word, and the unused part of the
+       newest one */
+    void *chunks;
+    u8 *cur;
+    u8 *end;
+    /* Number of the allocated objects and chunks */
+    int used;
+    int nchunks;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* slab.c */
+    void slab_init(struct slab *, size_t);
+    void slab_release(struct slab *);
+    void * slab_alloc(struct slab *);
+    void slab_free(struct slab *, void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _POPTRIE_SLAB_H */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,1042 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "buddy.h"
+#include "poptrie.h"
+#include "radix.h"
+#include "replica.h"
+#include "slab.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Snapshot of a poptrie.  The header is followed by the direct pointing array,
+ * the internal nodes and leaves up to the last allocated one, the buddy
+ * systems of them, the FIB mapping table with the next hops as the IDs, the
+ * blocks in the limbo list, and the radix tree in the preorder with the key
+ * and the prefix length of each node.  The checksum of all of them is
+ * appended.
+ * The integers are written in the host byte order.
+ */
+#define SNAPSHOT_MAGIC          "POPTRIE"
+#define SNAPSHOT_BUFSZ          (1 << 16)
+
+/* Flags of a radix node in the snapshot */
+#define SNAPSHOT_RADIX_VALID    0x1
+#define SNAPSHOT_RADIX_LEFT     0x2
+#define SNAPSHOT_RADIX_RIGHT    0x4
+
+/* The maximum depth of the radix tree (IPv6) */
+#define SNAPSHOT_RADIX_DEPTH    128
+
+struct snapshot_header {
+    char magic[8];
+    u32 version;
+    /* Sizes of the data structures to be compatible */
+    u32 nodebytes;
+    u32 leafbytes;
+    int s;
+    /* Buddy systems of the internal nodes and leaves */
+    int nodesz;
+    int leafsz;
+    int nodelevel;
+    int leaflevel;
+    int nodeused;
+    int leafused;
+    /* Number of the internal nodes and leaves written */
+    u32 nnodes;
+    u32 nleaves;
+    /* FIB mapping table */
+    int fibsz;
+    int nfib;
+    /* Number of the blocks released but not yet returned to the buddy
+       systems for the readers */
+    int nlimbo;
+    int reserved;
+    /* Number of the radix nodes */
+    u64 nradix;
+};
+
+/*
+ * Header of a read-only image.  Each section is aligned to
+ * POPTRIE_IMAGE_ALIGN from the head of the image, and referred to by the
+ * offset, so that the image is looked up where it is mapped.
+ */
+#define IMAGE_MAGIC             "POPTIMG"
+
+struct image_header {
+    char magic[8];
+    u32 version;
+    /* Sizes of the data structures to be compatible */
+    u32 nodebytes;
+    u32 leafbytes;
+    u32 fibbytes;
+    int s;
+    int fibsz;
+    /* Sections of the direct pointing array, the internal nodes, the leaves,
+       and the FIB entries */
+    u64 diroff;
+    u64 nodesoff;
+    u64 nnodes;
+    u64 leavesoff;
+    u64 nleaves;
+    u64 fiboff;
+};
+
+/*
+ * Entry of the FIB mapping table in the snapshot
+ */
+struct snapshot_fib {
+    u32 idx;
+    u32 refs;
+    u64 id;
+};
+
+/*
+ * Block in the limbo list, which is returned to the buddy system at the load
+ */
+struct snapshot_limbo {
+    int region;
+    u32 off;
+};
+
+/*
+ * Buffered I/O computing the checksum of the bytes read or written
+ */
+struct snapshot_io {
+    int fd;
+    /* Bytes written so far */
+    u64 off;
+    u64 sum1;
+    u64 sum2;
+    size_t pos;
+    size_t len;
+    u8 buf[SNAPSHOT_BUFSZ];
+};
+
+/*
+ * Update the checksum with the bytes
+ */
+static void
+_checksum(struct snapshot_io *io, const void *buf, size_t len)
+{
+    const u8 *p;
+    u64 sum1;
+    u64 sum2;
+    size_t i;
+
+    p = buf;
+    sum1 = io->sum1;
+    sum2 = io->sum2;
+    for ( i = 0; i < len; i++ ) {
+        sum1 += p[i];
+        sum2 += sum1;
+    }
+    io->sum1 = sum1;
+    io->sum2 = sum2;
+}
+
+/*
+ * Write all the bytes to the file descriptor
+ */
+static int
+_write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = write(fd, buf, len);
+        if ( n < 0 ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            return -1;
+        }
+        buf = (const u8 *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Read all the bytes from the file descriptor; the end of the file is an error
+ */
+static int
+_read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ( len > 0 ) {
+        n = read(fd, buf, len);
+        if ( n < 0 ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            return -1;
+        } else if ( 0 == n ) {
+            return -1;
+        }
+        buf = (u8 *)buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Flush the buffered bytes
+ */
+static int
+_flush(struct snapshot_io *io)
+{
+    if ( _write_all(io->fd, io->buf, io->pos) < 0 ) {
+        return -1;
+    }
+    io->pos = 0;
+
+    return 0;
+}
+
+/*
+ * Write the bytes through the buffer; a large array is written at once
+ */
+static int
+_write(struct snapshot_io *io, const void *buf, size_t len)
+{
+    _checksum(io, buf, len);
+    io->off += len;
+    if ( io->pos + len > SNAPSHOT_BUFSZ ) {
+        if ( _flush(io) < 0 ) {
+            return -1;
+        }
+    }
+    if ( len >= SNAPSHOT_BUFSZ ) {
+        return _write_all(io->fd, buf, len);
+    }
+    memcpy(io->buf + io->pos, buf, len);
+    io->pos += len;
+
+    return 0;
+}
+
+/*
+ * Read the bytes through the buffer; a large array is read at once
+ */
+static int
+_read(struct snapshot_io *io, void *buf, size_t len)
+{
+    u8 *p;
+    size_t n;
+    ssize_t ret;
+
+    p = buf;
+    while ( len > 0 ) {
+        if ( io->pos < io->len ) {
+            /* Take from the buffer */
+            n = io->len - io->pos;
+            if ( n > len ) {
+                n = len;
+            }
+            memcpy(p, io->buf + io->pos, n);
+            io->pos += n;
+        } else if ( len >= SNAPSHOT_BUFSZ ) {
+            if ( _read_all(io->fd, p, len) < 0 ) {
+                return -1;
+            }
+            n = len;
+        } else {
+            /* Fill the buffer */
+            ret = read(io->fd, io->buf, SNAPSHOT_BUFSZ);
+            if ( ret < 0 && EINTR == errno ) {
+                continue;
+            } else if ( ret <= 0 ) {
+                return -1;
+            }
+            io->pos = 0;
+            io->len = ret;
+            continue;
+        }
+        _checksum(io, p, n);
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Get the number of the blocks up to the last allocated one from the bitmap of
+ * the buddy system, where the tail block of each allocation is flagged
+ */
+static u32
+_buddy_used(struct buddy *bs)
+{
+    int i;
+    int j;
+
+    for ( i = ((1 << bs->sz) + 7) / 8 - 1; i >= 0; i-- ) {
+        if ( bs->b[i] ) {
+            for ( j = 7; j >= 0; j-- ) {
+                if ( bs->b[i] & (1 << j) ) {
+                    return i * 8 + j + 1;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Write the tags of the blocks and the bitmap of a buddy system
+ */
+static int
+_save_buddy(struct snapshot_io *io, struct buddy *bs)
+{
+    if ( _write(io, bs->blocks, (size_t)bs->bsz << bs->sz) < 0 ) {
+        return -1;
+    }
+    if ( _write(io, bs->b, ((1 << bs->sz) + 7) / 8) < 0 ) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read the tags of the blocks and the bitmap of a buddy system initialized
+ * with the same size, and rebuild the free bitmaps from the tags
+ */
+static int
+_load_buddy(struct snapshot_io *io, struct buddy *bs, int used)
+{
+    if ( _read(io, bs->blocks, (size_t)bs->bsz << bs->sz) < 0 ) {
+        return -1;
+    }
+    if ( _read(io, bs->b, ((1 << bs->sz) + 7) / 8) < 0 ) {
+        return -1;
+    }
+    if ( buddy_restore(bs) < 0 ) {
+        return -1;
+    }
+    bs->used = used;
+
+    return 0;
+}
+
+/*
+ * Count the radix nodes
+ */
+static u64
+_count_radix(struct radix_node *node)
+{
+    if ( NULL == node ) {
+        return 0;
+    }
+
+    return 1 + _count_radix(node->left) + _count_radix(node->right);
+}
+
+/*
+ * Write the radix tree in the preorder
+ */
+static int
+_save_radix(struct snapshot_io *io, struct radix_node *node)
+{
+    u8 flags;
+
+    flags = 0;
+    if ( node->valid ) {
+        flags |= SNAPSHOT_RADIX_VALID;
+    }
+    if ( node->left ) {
+        flags |= SNAPSHOT_RADIX_LEFT;
+    }
+    if ( node->right ) {
+        flags |= SNAPSHOT_RADIX_RIGHT;
+    }
+    if ( _write(io, &flags, sizeof(flags)) < 0 ) {
+        return -1;
+    }
+    if ( _write(io, &node->len, sizeof(node->len)) < 0 ) {
+        return -1;
+    }
+    if ( _write(io, &node->key, sizeof(node->key)) < 0 ) {
+        return -1;
+    }
+    if ( node->valid ) {
+        if ( _write(io, &node->nexthop, sizeof(poptrie_leaf_t)) < 0 ) {
+            return -1;
+        }
+    }
+    if ( node->left ) {
+        if ( _save_radix(io, node->left) < 0 ) {
+            return -1;
+        }
+    }
+    if ( node->right ) {
+        if ( _save_radix(io, node->right) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Read the radix tree in the preorder.  The nearest valid nodes are set from
+ * the ancestors.  The key of a node must extend that of the parent on the
+ * side of the node.
+ */
+static int
+_load_radix(struct poptrie *poptrie, struct snapshot_io *io,
+            struct radix_node **node, struct radix_node *parent, int right,
+            int depth, int fibsz, u64 *n)
+{
+    u8 flags;
+    u8 len;
+    __uint128_t key;
+
+    if ( depth > SNAPSHOT_RADIX_DEPTH || 0 == *n ) {
+        return -1;
+    }
+    (*n)--;
+    if ( _read(io, &flags, sizeof(flags)) < 0 ) {
+        return -1;
+    }
+    if ( _read(io, &len, sizeof(len)) < 0 ) {
+        return -1;
+    }
+    if ( _read(io, &key, sizeof(key)) < 0 ) {
+        return -1;
+    }
+    if ( len > RADIX_KEYLENGTH || (key & ~radix_mask(len)) ) {
+        return -1;
+    }
+    if ( NULL == parent ) {
+        /* The root is at the depth zero */
+        if ( 0 != len ) {
+            return -1;
+        }
+    } else if ( len <= parent->len
+                || (key & radix_mask(parent->len)) != parent->key
+                || (int)RADIX_BT(key, parent->len) != right ) {
+        return -1;
+    }
+    *node = slab_alloc(poptrie->cradix);
+    if ( NULL == *node ) {
+        return -1;
+    }
+    (*node)->key = key;
+    (*node)->valid = 0;
+    (*node)->left = NULL;
+    (*node)->right = NULL;
+    (*node)->len = len;
+    (*node)->nexthop = 0;
+    (*node)->ext = parent ? parent->ext : NULL;
+    (*node)->mark = 0;
+    (*node)->lazy = 0;
+    if ( flags & SNAPSHOT_RADIX_VALID ) {
+        if ( _read(io, &(*node)->nexthop, sizeof(poptrie_leaf_t)) < 0 ) {
+            return -1;
+        }
+        if ( (*node)->nexthop >= fibsz ) {
+            return -1;
+        }
+        (*node)->valid = 1;
+        (*node)->ext = *node;
+    }
+    if ( flags & SNAPSHOT_RADIX_LEFT ) {
+        if ( _load_radix(poptrie, io, &(*node)->left, *node, 0, depth + 1,
+                         fibsz, n) < 0 ) {
+            return -1;
+        }
+    }
+    if ( flags & SNAPSHOT_RADIX_RIGHT ) {
+        if ( _load_radix(poptrie, io, &(*node)->right, *node, 1, depth + 1,
+                         fibsz, n) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Restore the FIB mapping table from the entries
+ */
+static int
+_load_fib(struct poptrie *poptrie, const struct snapshot_fib *fib, int n,
+          int sz, poptrie_load_f func, void *arg)
+{
+    struct poptrie_fib_entry *entries;
+    int *hash;
+    int h;
+    int i;
+
+    entries = malloc(sizeof(struct poptrie_fib_entry) * sz);
+    if ( NULL == entries ) {
+        return -1;
+    }
+    memset(entries, 0, sizeof(struct poptrie_fib_entry) * sz);
+    hash = malloc(sizeof(int) * sz);
+    if ( NULL == hash ) {
+        free(entries);
+        return -1;
+    }
+    for ( i = 0; i < n; i++ ) {
+        if ( fib[i].idx >= (u32)sz || 0 == fib[i].refs ) {
+            free(entries);
+            free(hash);
+            return -1;
+        }
+        if ( 0 == fib[i].idx ) {
+            /* Reserved for no route */
+            entries[0].entry = NULL;
+        } else if ( NULL != func ) {
+            entries[fib[i].idx].entry = func(fib[i].id, arg);
+        } else {
+            entries[fib[i].idx].entry = (void *)(uintptr_t)fib[i].id;
+        }
+        entries[fib[i].idx].refs = fib[i].refs;
+    }
+    entries[0].entry = NULL;
+    if ( 0 == entries[0].refs ) {
+        entries[0].refs = 1;
+    }
+
+    /* Hash the entries in use, and chain the others to the free list in the
+       ascending order */
+    for ( i = 0; i < sz; i++ ) {
+        hash[i] = -1;
+    }
+    poptrie->fib.free = -1;
+    for ( i = sz - 1; i >= 0; i-- ) {
+        if ( entries[i].refs > 0 ) {
+            h = POPTRIE_FIB_HASH(entries[i].entry, sz);
+            entries[i].next = hash[h];
+            hash[h] = i;
+        } else {
+            entries[i].next = poptrie->fib.free;
+            poptrie->fib.free = i;
+        }
+    }
+
+    free(poptrie->fib.entries);
+    free(poptrie->fib.hash);
+    poptrie->fib.entries = entries;
+    poptrie->fib.hash = hash;
+    poptrie->fib.sz = sz;
+
+    return 0;
+}
+
+/*
+ * Write a snapshot of the poptrie to the file descriptor.  The next hops are
+ * written as the IDs returned by func, or as their values if func is NULL.
+ */
+int
+poptrie_save(struct poptrie *poptrie, int fd, poptrie_save_f func, void *arg)
+{
+    struct snapshot_header h;
+    struct snapshot_fib fib;
+    struct snapshot_limbo limbo;
+    struct snapshot_io *io;
+    struct buddy *bn;
+    struct buddy *bl;
+    u64 sum[2];
+    int ret;
+    int i;
+
+    io = malloc(sizeof(struct snapshot_io));
+    if ( NULL == io ) {
+        return -1;
+    }
+    memset(io, 0, sizeof(struct snapshot_io));
+    io->fd = fd;
+
+    /* Header */
+    bn = poptrie->cnodes;
+    bl = poptrie->cleaves;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = POPTRIE_SNAPSHOT_VERSION;
+    h.nodebytes = sizeof(poptrie_node_t);
+    h.leafbytes = sizeof(poptrie_leaf_t);
+    h.s = poptrie->s;
+    h.nodesz = bn->sz;
+    h.leafsz = bl->sz;
+    h.nodelevel = bn->level;
+    h.leaflevel = bl->level;
+    h.nodeused = bn->used;
+    h.leafused = bl->used;
+    h.nnodes = _buddy_used(bn);
+    h.nleaves = _buddy_used(bl);
+    h.fibsz = poptrie->fib.sz;
+    h.nfib = 0;
+    for ( i = 0; i < poptrie->fib.sz; i++ ) {
+        if ( poptrie->fib.entries[i].refs > 0 ) {
+            h.nfib++;
+        }
+    }
+    h.nlimbo = 0;
+    for ( i = poptrie->limbohead; i < poptrie->nlimbo; i++ ) {
+        if ( poptrie->limbo[i].region >= 0 ) {
+            h.nlimbo++;
+        }
+    }
+    h.nradix = _count_radix(poptrie->radix);
+
+    ret = _write(io, &h, sizeof(h));
+
+    /* Direct pointing array, internal nodes, and leaves */
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->dir, sizeof(u32) << poptrie->s);
+    }
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->nodes, sizeof(poptrie_node_t) * h.nnodes);
+    }
+    if ( ret >= 0 ) {
+        ret = _save_buddy(io, bn);
+    }
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->leaves, sizeof(poptrie_leaf_t) * h.nleaves);
+    }
+    if ( ret >= 0 ) {
+        ret = _save_buddy(io, bl);
+    }
+
+    /* FIB mapping table */
+    for ( i = 0; ret >= 0 && i < poptrie->fib.sz; i++ ) {
+        if ( 0 == poptrie->fib.entries[i].refs ) {
+            continue;
+        }
+        memset(&fib, 0, sizeof(fib));
+        fib.idx = i;
+        fib.refs = poptrie->fib.entries[i].refs;
+        if ( 0 == i ) {
+            fib.id = 0;
+        } else if ( NULL != func ) {
+            fib.id = func(poptrie->fib.entries[i].entry, arg);
+        } else {
+            fib.id = (u64)(uintptr_t)poptrie->fib.entries[i].entry;
+        }
+        ret = _write(io, &fib, sizeof(fib));
+    }
+
+    /* Blocks waiting for the readers */
+    for ( i = poptrie->limbohead; ret >= 0 && i < poptrie->nlimbo; i++ ) {
+        if ( poptrie->limbo[i].region < 0 ) {
+            continue;
+        }
+        limbo.region = poptrie->limbo[i].region;
+        limbo.off = poptrie->limbo[i].off;
+        ret = _write(io, &limbo, sizeof(limbo));
+    }
+
+    /* RIB */
+    if ( ret >= 0 && NULL != poptrie->radix ) {
+        ret = _save_radix(io, poptrie->radix);
+    }
+
+    /* Checksum */
+    if ( ret >= 0 ) {
+        sum[0] = io->sum1;
+        sum[1] = io->sum2;
+        ret = _write(io, sum, sizeof(sum));
+    }
+    if ( ret >= 0 ) {
+        ret = _flush(io);
+    }
+    free(io);
+
+    return ret;
+}
+
+/*
+ * Read the body of a snapshot to the poptrie initialized with the sizes in the
+ * header
+ */
+static int
+_load(struct snapshot_io *io, struct poptrie *poptrie,
+      const struct snapshot_header *h, poptrie_load_f func, void *arg)
+{
+    struct snapshot_fib *fib;
+    struct snapshot_limbo *limbo;
+    u64 sum[2];
+    u64 cksum[2];
+    u64 n;
+    int ret;
+    int i;
+
+    if ( ((struct buddy *)poptrie->cnodes)->level != h->nodelevel
+         || ((struct buddy *)poptrie->cleaves)->level != h->leaflevel ) {
+        return -1;
+    }
+
+    /* Direct pointing array, internal nodes, and leaves */
+    if ( _read(io, poptrie->dir, sizeof(u32) << poptrie->s) < 0 ) {
+        return -1;
+    }
+    memcpy(poptrie->altdir, poptrie->dir, sizeof(u32) << poptrie->s);
+    if ( _read(io, poptrie->nodes, sizeof(poptrie_node_t) * h->nnodes) < 0 ) {
+        return -1;
+    }
+    if ( _load_buddy(io, poptrie->cnodes, h->nodeused) < 0 ) {
+        return -1;
+    }
+    if ( _read(io, poptrie->leaves, sizeof(poptrie_leaf_t) * h->nleaves)
+         < 0 ) {
+        return -1;
+    }
+    if ( _load_buddy(io, poptrie->cleaves, h->leafused) < 0 ) {
+        return -1;
+    }
+
+    /* FIB mapping table */
+    fib = malloc(sizeof(struct snapshot_fib) * (h->nfib + 1));
+    if ( NULL == fib ) {
+        return -1;
+    }
+    if ( _read(io, fib, sizeof(struct snapshot_fib) * h->nfib) < 0 ) {
+        free(fib);
+        return -1;
+    }
+
+    /* Blocks waiting for the readers */
+    limbo = malloc(sizeof(struct snapshot_limbo) * (h->nlimbo + 1));
+    if ( NULL == limbo ) {
+        free(fib);
+        return -1;
+    }
+    ret = _read(io, limbo, sizeof(struct snapshot_limbo) * h->nlimbo);
+
+    /* RIB */
+    n = h->nradix;
+    if ( ret >= 0 && n > 0 ) {
+        ret = _load_radix(poptrie, io, &poptrie->radix, NULL, 0, 0, h->fibsz,
+                          &n);
+        if ( 0 != n ) {
+            ret = -1;
+        }
+    }
+
+    /* Verify the checksum before the blocks and the next hops are used */
+    cksum[0] = io->sum1;
+    cksum[1] = io->sum2;
+    if ( ret >= 0 ) {
+        ret = _read(io, sum, sizeof(sum));
+    }
+    if ( ret < 0 || sum[0] != cksum[0] || sum[1] != cksum[1] ) {
+        free(limbo);
+        free(fib);
+        return -1;
+    }
+
+    /* No reader refers to the blocks in the limbo list of the snapshot */
+    for ( i = 0; i < h->nlimbo; i++ ) {
+        if ( POPTRIE_REGION_NODES == limbo[i].region ) {
+            buddy_free2(poptrie->cnodes, limbo[i].off);
+        } else {
+            buddy_free2(poptrie->cleaves, limbo[i].off);
+        }
+    }
+    free(limbo);
+
+    ret = _load_fib(poptrie, fib, h->nfib, h->fibsz, func, arg);
+    free(fib);
+    if ( ret < 0 ) {
+        return -1;
+    }
+
+    /* Copy all to the replicas */
+    poptrie->ndirty = -1;
+    replica_sync(poptrie, 0, 1 << poptrie->s);
+
+    return 0;
+}
+
+/*
+ * Load a snapshot from the file descriptor to a new poptrie initialized with
+ * the parameters.  The IDs of the next hops are converted by func, or used as
+ * the values if func is NULL.
+ */
+struct poptrie *
+poptrie_load(struct poptrie *poptrie, int fd,
+             const struct poptrie_params *params, poptrie_load_f func,
+             void *arg)
+{
+    struct snapshot_header h;
+    struct snapshot_io *io;
+    struct poptrie_params p;
+    int ret;
+
+    io = malloc(sizeof(struct snapshot_io));
+    if ( NULL == io ) {
+        return NULL;
+    }
+    memset(io, 0, sizeof(struct snapshot_io));
+    io->fd = fd;
+
+    /* Check the header */
+    ret = _read(io, &h, sizeof(h));
+    if ( ret < 0 || 0 != memcmp(h.magic, SNAPSHOT_MAGIC,
+                                sizeof(SNAPSHOT_MAGIC))
+         || POPTRIE_SNAPSHOT_VERSION != h.version
+         || sizeof(poptrie_node_t) != h.nodebytes
+         || sizeof(poptrie_leaf_t) != h.leafbytes
+         || (NULL != params && 0 != params->s && params->s != h.s)
+         || h.nodesz < 0 || h.nodesz > POPTRIE_SZ_MAX
+         || h.leafsz < 0 || h.leafsz > POPTRIE_SZ_MAX
+         || h.nnodes > ((u32)1 << h.nodesz)
+         || h.nleaves > ((u32)1 << h.leafsz)
+         || h.fibsz < POPTRIE_INIT_FIB_SIZE || h.fibsz > POPTRIE_FIB_MAX
+         || 0 != (h.fibsz & (h.fibsz - 1))
+         || h.nfib < 0 || h.nfib > h.fibsz || h.nlimbo < 0 ) {
+        free(io);
+        return NULL;
+    }
+
+    /* Initialize with the sizes in the snapshot */
+    if ( NULL != params ) {
+        memcpy(&p, params, sizeof(p));
+    } else {
+        memset(&p, 0, sizeof(p));
+    }
+    p.s = h.s;
+    poptrie = poptrie_init2(poptrie, h.nodesz, h.leafsz, &p);
+    if ( NULL == poptrie ) {
+        free(io);
+        return NULL;
+    }
+
+    ret = _load(io, poptrie, &h, func, arg);
+    free(io);
+    if ( ret < 0 ) {
+        poptrie_release(poptrie);
+        return NULL;
+    }
+
+    return poptrie;
+}
+
+/*
+ * Write zeros up to the next boundary of the alignment
+ */
+static int
+_pad(struct snapshot_io *io, u64 align)
+{
+    static const u8 zeros[POPTRIE_IMAGE_ALIGN];
+    size_t n;
+
+    n = (align - io->off % align) % align;
+    if ( n > 0 ) {
+        return _write(io, zeros, n);
+    }
+
+    return 0;
+}
+
+/*
+ * Round up an offset in the image to the alignment of the sections
+ */
+static u64
+_align(u64 off)
+{
+    return (off + POPTRIE_IMAGE_ALIGN - 1) / POPTRIE_IMAGE_ALIGN
+        * POPTRIE_IMAGE_ALIGN;
+}
+
+/*
+ * Write a read-only image of the poptrie to the file descriptor.  The next hops
+ * are written as the IDs returned by func, or as their values if func is NULL.
+ */
+int
+poptrie_save_image(struct poptrie *poptrie, int fd, poptrie_save_f func,
+                   void *arg)
+{
+    struct image_header h;
+    struct poptrie_fib_entry fib;
+    struct snapshot_io *io;
+    int ret;
+    int i;
+
+    io = malloc(sizeof(struct snapshot_io));
+    if ( NULL == io ) {
+        return -1;
+    }
+    memset(io, 0, sizeof(struct snapshot_io));
+    io->fd = fd;
+
+    /* Place the sections */
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    h.version = POPTRIE_IMAGE_VERSION;
+    h.nodebytes = sizeof(poptrie_node_t);
+    h.leafbytes = sizeof(poptrie_leaf_t);
+    h.fibbytes = sizeof(struct poptrie_fib_entry);
+    h.s = poptrie->s;
+    h.fibsz = poptrie->fib.sz;
+    h.nnodes = _buddy_used(poptrie->cnodes);
+    h.nleaves = _buddy_used(poptrie->cleaves);
+    h.diroff = _align(sizeof(h));
+    h.nodesoff = _align(h.diroff + (sizeof(u32) << poptrie->s));
+    h.leavesoff = _align(h.nodesoff + sizeof(poptrie_node_t) * h.nnodes);
+    h.fiboff = _align(h.leavesoff + sizeof(poptrie_leaf_t) * h.nleaves);
+
+    /* Write the sections in the order of the offsets */
+    ret = _write(io, &h, sizeof(h));
+    if ( ret >= 0 ) {
+        ret = _pad(io, POPTRIE_IMAGE_ALIGN);
+    }
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->dir, sizeof(u32) << poptrie->s);
+    }
+    if ( ret >= 0 ) {
+        ret = _pad(io, POPTRIE_IMAGE_ALIGN);
+    }
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->nodes, sizeof(poptrie_node_t) * h.nnodes);
+    }
+    if ( ret >= 0 ) {
+        ret = _pad(io, POPTRIE_IMAGE_ALIGN);
+    }
+    if ( ret >= 0 ) {
+        ret = _write(io, poptrie->leaves, sizeof(poptrie_leaf_t) * h.nleaves);
+    }
+    if ( ret >= 0 ) {
+        ret = _pad(io, POPTRIE_IMAGE_ALIGN);
+    }
+    for ( i = 0; ret >= 0 && i < poptrie->fib.sz; i++ ) {
+        memset(&fib, 0, sizeof(fib));
+        if ( i > 0 && poptrie->fib.entries[i].refs > 0 ) {
+            if ( NULL != func ) {
+                fib.entry = (void *)(uintptr_t)
+                    func(poptrie->fib.entries[i].entry, arg);
+            } else {
+                fib.entry = poptrie->fib.entries[i].entry;
+            }
+            fib.refs = poptrie->fib.entries[i].refs;
+        }
+        fib.next = -1;
+        ret = _write(io, &fib, sizeof(fib));
+    }
+    if ( ret >= 0 ) {
+        ret = _flush(io);
+    }
+    free(io);
+
+    return ret;
+}
+
+/*
+ * Map a read-only image from the file descriptor.  The pages are shared with
+ * the other processes mapping the same file, which must not be modified while
+ * it is mapped; a new image should be written to another file.
+ */
+struct poptrie_map *
+poptrie_map(int fd)
+{
+    struct poptrie_map *map;
+    const struct image_header *h;
+    struct stat st;
+    void *addr;
+    u64 sz;
+
+    if ( fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h) ) {
+        return NULL;
+    }
+    sz = st.st_size;
+    addr = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+    if ( MAP_FAILED == addr ) {
+        return NULL;
+    }
+
+    /* Check the header and that the sections are in the image */
+    h = addr;
+    if ( 0 != memcmp(h->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+         || POPTRIE_IMAGE_VERSION != h->version
+         || sizeof(poptrie_node_t) != h->nodebytes
+         || sizeof(poptrie_leaf_t) != h->leafbytes
+         || sizeof(struct poptrie_fib_entry) != h->fibbytes
+         || h->s < POPTRIE_S_MIN || h->s > POPTRIE_S_MAX
+         || h->fibsz <= 0 || h->fibsz > POPTRIE_FIB_MAX
+         || h->nnodes > sz || h->nleaves > sz
+         || h->diroff + (sizeof(u32) << h->s) > sz
+         || h->nodesoff + sizeof(poptrie_node_t) * h->nnodes > sz
+         || h->leavesoff + sizeof(poptrie_leaf_t) * h->nleaves > sz
+         || h->fiboff + sizeof(struct poptrie_fib_entry) * h->fibsz > sz
+         || 0 != (h->diroff | h->nodesoff | h->leavesoff | h->fiboff)
+         % POPTRIE_IMAGE_ALIGN ) {
+        munmap(addr, sz);
+        return NULL;
+    }
+
+    map = malloc(sizeof(struct poptrie_map));
+    if ( NULL == map ) {
+        munmap(addr, sz);
+        return NULL;
+    }
+    memset(map, 0, sizeof(struct poptrie_map));
+    map->addr = addr;
+    map->len = sz;
+
+    /* Point the arrays of the poptrie to the sections for the lookups */
+    map->poptrie.s = h->s;
+    map->poptrie.dir = (u32 *)((u8 *)addr + h->diroff);
+    map->poptrie.nodes = (poptrie_node_t *)((u8 *)addr + h->nodesoff);
+    map->poptrie.leaves = (poptrie_leaf_t *)((u8 *)addr + h->leavesoff);
+    map->poptrie.fib.entries
+        = (struct poptrie_fib_entry *)((u8 *)addr + h->fiboff);
+    map->poptrie.fib.sz = h->fibsz;
+    map->poptrie.fib.free = -1;
+
+    return map;
+}
+
+/*
+ * Map a new image from the file descriptor, and replace the map pointed by
+ * mapp with it atomically.  The old one is returned to old, and should be
+ * unmapped after the lookups in progress on it finish.
+ */
+int
+poptrie_remap(struct poptrie_map **mapp, int fd, struct poptrie_map **old)
+{
+    struct poptrie_map *map;
+
+    map = poptrie_map(fd);
+    if ( NULL == map ) {
+        return -1;
+    }
+    *old = __sync_lock_test_and_set(mapp, map);
+
+    return 0;
+}
+
+/*
+ * Unmap a read-only image
+ */
+void
+poptrie_unmap(struct poptrie_map *map)
+{
+    if ( NULL != map ) {
+        munmap(map->addr, map->len);
+        free(map);
+    }
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -6,6 +6,9 @@
 #include "../poptrie.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 
 /* Macro for testing */
@@ -50,6 +53,57 @@ test_init(void)
     return 0;
 }
 
+static int
+test_init_backing(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    int backing;
+    int i;
+
+    /* Default without the growth */
+    memset(&params, 0, sizeof(params));
+    params.sz1_max = 19;
+    params.sz0_max = 22;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    for ( i = POPTRIE_REGION_NODES; i <= POPTRIE_REGION_CLEAVES; i++ ) {
+        if ( POPTRIE_BACKING_MALLOC != poptrie_backing(poptrie, i) ) {
+            return -1;
+        }
+    }
+    poptrie_release(poptrie);
+    TEST_PROGRESS();
+
+    /* Huge pages; the backing depends on the system */
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_HUGEPAGE | POPTRIE_PREFAULT | POPTRIE_MLOCK;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    for ( i = POPTRIE_REGION_NODES; i <= POPTRIE_REGION_CLEAVES; i++ ) {
+        backing = poptrie_backing(poptrie, i);
+        if ( POPTRIE_BACKING_MALLOC == (backing & POPTRIE_BACKING_MASK)
+             || !(backing & POPTRIE_BACKING_PREFAULTED) ) {
+            return -1;
+        }
+    }
+    if ( poptrie_route_add(poptrie, 0x1c001200, 24, (void *)1) < 0 ) {
+        return -1;
+    }
+    if ( (void *)1 != poptrie_lookup(poptrie, 0x1c001234)
+         || NULL != poptrie_lookup(poptrie, 0x1c001334) ) {
+        return -1;
+    }
+    poptrie_release(poptrie);
+    TEST_PROGRESS();
+
+    return 0;
+}
+
 static int
 test_lookup(void)
 {
@@ -168,6 +222,1836 @@ test_lookup2(void)
     return 0;
 }
 
+/*
+ * Change and delete a route at the bottom of an internal node, i.e., at a
+ * child of its triangle, covering a route one bit longer
+ */
+static int
+test_update_triangle(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int len;
+    int i;
+    u32 prefix;
+    u32 addr;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    for ( len = poptrie->s + 6; len < 32; len += 6 ) {
+        prefix = 0x0a0a0a0a & ~(((u32)1 << (32 - len)) - 1);
+        addr = prefix + ((u32)1 << (31 - len));
+        ret = poptrie_route_add(poptrie, prefix, len, (void *)1);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_add(poptrie, prefix, len + 1, (void *)2);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        for ( i = 0; i < 4; i++ ) {
+            ret = poptrie_route_change(poptrie, prefix, len,
+                                       (void *)(u64)(3 + i));
+            if ( ret < 0 ) {
+                return -1;
+            }
+            if ( (void *)(u64)(3 + i) != poptrie_lookup(poptrie, addr)
+                 || (void *)2 != poptrie_lookup(poptrie, prefix) ) {
+                return -1;
+            }
+        }
+        ret = poptrie_route_del(poptrie, prefix, len);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        if ( NULL != poptrie_lookup(poptrie, addr)
+             || (void *)2 != poptrie_lookup(poptrie, prefix) ) {
+            return -1;
+        }
+        ret = poptrie_route_del(poptrie, prefix, len + 1);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        TEST_PROGRESS();
+    }
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_s(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    int ret;
+    int i;
+    int j;
+    u32 addr;
+    static const int sizes[] = { 6, 8, 16, 19, 20, 22, 24 };
+
+    /* Out of range */
+    memset(&params, 0, sizeof(params));
+    params.s = POPTRIE_S_MAX + 1;
+    if ( NULL != poptrie_init2(NULL, 19, 22, &params) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    for ( i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++ ) {
+        /* Initialize */
+        params.s = sizes[i];
+        poptrie = poptrie_init2(NULL, 19, 22, &params);
+        if ( NULL == poptrie ) {
+            return -1;
+        }
+
+        /* Routes shorter and longer than the direct pointing */
+        ret = poptrie_route_add(poptrie, 0x1c000000, 6, (void *)1);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_add(poptrie, 0x1c000000, 12, (void *)2);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_add(poptrie, 0x1c001200, 23, (void *)3);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_add(poptrie, 0x1c001280, 25, (void *)4);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_del(poptrie, 0x1c000000, 12);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        for ( j = 0; j < 0x10000; j++ ) {
+            addr = 0x1c000000 + (u32)j * 0x1011;
+            if ( poptrie_lookup(poptrie, addr)
+                 != poptrie_rib_lookup(poptrie, addr) ) {
+                return -1;
+            }
+        }
+        if ( (void *)4 != poptrie_lookup(poptrie, 0x1c0012ff)
+             || (void *)1 != poptrie_lookup(poptrie, 0x1f000000) ) {
+            return -1;
+        }
+
+        /* Release */
+        poptrie_release(poptrie);
+    }
+    TEST_PROGRESS();
+
+    return 0;
+}
+
+static int
+test_lookup_short(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    u32 addr;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Longer routes under the flapping routes */
+    for ( i = 0; i < 256; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a000000 + ((u32)i << 14),
+                                18 + (i & 7), (void *)(u64)(10 + (i & 3)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Flap the routes shorter than the direct pointing */
+    for ( i = 0; i < 1000; i++ ) {
+        ret = poptrie_route_update(poptrie, 0x0a000000, 8 + (i % 10),
+                                   (void *)(u64)(1 + (i & 1)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_update(poptrie, 0, 0, (void *)(u64)(3 + (i & 1)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+        if ( i & 1 ) {
+            ret = poptrie_route_del(poptrie, 0x0a000000, 8 + (i % 10));
+            if ( ret < 0 ) {
+                return -1;
+            }
+        }
+    }
+    TEST_PROGRESS();
+
+    /* The alternative array follows the current one */
+    if ( 0 != memcmp(poptrie->dir, poptrie->altdir,
+                     sizeof(u32) << poptrie->s) ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x100000; i++ ) {
+        addr = 0x09000000 + (u32)i * 0x301;
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_rib(void)
+{
+    struct poptrie *poptrie;
+    struct radix_node *node;
+    int ret;
+    int i;
+    u32 addr;
+    static const struct {
+        u32 prefix;
+        int len;
+    } routes[] = {
+        { 0x0a010200, 24 }, { 0x0a000000, 8 }, { 0x0a010280, 25 },
+        { 0x0a010300, 24 }, { 0x0a010000, 16 }, { 0x0a010203, 32 },
+    };
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* The path to a route is compressed */
+    ret = poptrie_route_add(poptrie, routes[0].prefix, routes[0].len,
+                            (void *)(u64)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    node = poptrie->radix->left;
+    if ( 0 != poptrie->radix->len || NULL == node || 24 != node->len
+         || NULL != node->left || NULL != node->right ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Nested and branching routes */
+    for ( i = 1; i < (int)(sizeof(routes) / sizeof(routes[0])); i++ ) {
+        ret = poptrie_route_add(poptrie, routes[i].prefix, routes[i].len,
+                                (void *)(u64)(i + 1));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    for ( addr = 0x0a000000; addr < 0x0a020000; addr += 0x3f ) {
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    if ( poptrie_lookup(poptrie, 0x0a010203) != (void *)6
+         || poptrie_lookup(poptrie, 0x0a010290) != (void *)3
+         || poptrie_lookup(poptrie, 0x0a010210) != (void *)1
+         || poptrie_lookup(poptrie, 0x0a010410) != (void *)5 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Delete them in the order of the insertion; the nodes left are
+       released */
+    for ( i = 0; i < (int)(sizeof(routes) / sizeof(routes[0])); i++ ) {
+        ret = poptrie_route_del(poptrie, routes[i].prefix, routes[i].len);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        for ( addr = 0x0a000000; addr < 0x0a020000; addr += 0x3f ) {
+            if ( poptrie_lookup(poptrie, addr)
+                 != poptrie_rib_lookup(poptrie, addr) ) {
+                return -1;
+            }
+        }
+    }
+    if ( NULL != poptrie->radix->left || NULL != poptrie->radix->right
+         || NULL != poptrie_lookup(poptrie, 0x0a010203) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+/*
+ * Count the radix tree nodes left marked
+ */
+static int
+_count_marked(struct radix_node *node)
+{
+    if ( NULL == node ) {
+        return 0;
+    }
+
+    return (node->mark || node->lazy) + _count_marked(node->left)
+        + _count_marked(node->right);
+}
+
+/*
+ * Compare the lookups under 10.0.0.0/8 and around it with the RIB
+ */
+static int
+_compare_rib(struct poptrie *poptrie)
+{
+    u32 addr;
+
+    for ( addr = 0x09ff0000; addr < 0x0b010000; addr += 0x1f3 ) {
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    for ( addr = 0x0a010000; addr < 0x0a011000; addr += 0x3 ) {
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Change, delete, and add the short routes covering the more specific ones
+ */
+static int
+test_rib_lazy(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    int j;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* A /8 partly covered by /16s, and a /20 below the direct pointing array
+       partly covered by /24s and /28s */
+    ret = poptrie_route_add(poptrie, 0x0a000000, 8, (void *)1);
+    for ( i = 0; i < 64 && 0 == ret; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a000000 | (i << 18), 16,
+                                (void *)(u64)(2 + (i & 3)));
+    }
+    if ( 0 == ret ) {
+        ret = poptrie_route_add(poptrie, 0x0a010000, 20, (void *)6);
+    }
+    for ( i = 0; i < 16 && 0 == ret; i++ ) {
+        if ( 0 == (i & 1) ) {
+            ret = poptrie_route_add(poptrie, 0x0a010000 | (i << 8), 24,
+                                    (void *)(u64)(7 + (i & 3)));
+            continue;
+        }
+        for ( j = 0; j < 16 && 0 == ret; j += 1 + (i & 2) ) {
+            ret = poptrie_route_add(poptrie, 0x0a010000 | (i << 8) | (j << 4),
+                                    28, (void *)(u64)(11 + (j & 3)));
+        }
+    }
+    if ( 0 != ret ) {
+        return -1;
+    }
+    if ( _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Change the covering routes */
+    for ( i = 0; i < 4; i++ ) {
+        ret = poptrie_route_update(poptrie, 0x0a010000, 20,
+                                   (void *)(u64)(20 + i));
+        if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_update(poptrie, 0x0a000000, 8,
+                                   (void *)(u64)(30 + i));
+        if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_update(poptrie, 0, 0, (void *)(u64)(40 + i));
+        if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+            return -1;
+        }
+    }
+    if ( 0 != _count_marked(poptrie->radix) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Delete the covering routes and some of the more specific ones, and add
+       them back */
+    ret = poptrie_route_del(poptrie, 0x0a010000, 20);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_del(poptrie, 0x0a000000, 8);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 16; i += 3 ) {
+        if ( 0 == (i & 1) ) {
+            ret = poptrie_route_del(poptrie, 0x0a010000 | (i << 8), 24);
+        } else {
+            ret = poptrie_route_del(poptrie, 0x0a010000 | (i << 8), 28);
+        }
+        if ( 0 != ret ) {
+            return -1;
+        }
+    }
+    ret = poptrie_route_add(poptrie, 0x0a010000, 20, (void *)6);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x0a000000, 8, (void *)1);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_del(poptrie, 0, 0);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    if ( 0 != _count_marked(poptrie->radix) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+/*
+ * Count the radix tree nodes
+ */
+static int
+_count_nodes(struct radix_node *node)
+{
+    if ( NULL == node ) {
+        return 0;
+    }
+
+    return 1 + _count_nodes(node->left) + _count_nodes(node->right);
+}
+
+/*
+ * Compact the RIB after deletions, and update the routes on the copy
+ */
+static int
+test_rib_compact(void)
+{
+    struct poptrie *poptrie;
+    int nodes;
+    int ret;
+    int i;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Nothing to compact */
+    if ( 0 != poptrie_rib_compact(poptrie) ) {
+        return -1;
+    }
+
+    /* Add and delete the routes under 10.0.0.0/8 */
+    ret = poptrie_route_add(poptrie, 0x0a000000, 8, (void *)1);
+    for ( i = 0; i < 256 && 0 == ret; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a010000 | (i << 4), 28,
+                                (void *)(u64)(2 + (i & 7)));
+    }
+    for ( i = 0; i < 256 && 0 == ret; i += 1 + (i & 1) ) {
+        ret = poptrie_route_del(poptrie, 0x0a010000 | (i << 4), 28);
+    }
+    if ( 0 != ret ) {
+        return -1;
+    }
+    nodes = poptrie_rib_nodes(poptrie);
+    if ( nodes != _count_nodes(poptrie->radix) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Compact */
+    ret = poptrie_rib_compact(poptrie);
+    if ( ret < 0 || poptrie_rib_nodes(poptrie) != nodes - ret
+         || poptrie_rib_nodes(poptrie) != _count_nodes(poptrie->radix) ) {
+        return -1;
+    }
+    if ( _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* The nearest valid routes are resolved on the copy */
+    ret = poptrie_route_update(poptrie, 0x0a000000, 8, (void *)11);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_del(poptrie, 0x0a000000, 8);
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 256 && 0 == ret; i += 3 ) {
+        ret = poptrie_route_update(poptrie, 0x0a010000 | (i << 4), 28,
+                                   (void *)12);
+    }
+    if ( 0 != ret || _compare_rib(poptrie) < 0 ) {
+        return -1;
+    }
+    if ( 0 != _count_marked(poptrie->radix) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_batch(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    u32 addrs[300];
+    void *nexthops[300];
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Routes with various prefix lengths */
+    ret = poptrie_route_add(poptrie, 0x1c000000, 8, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001200, 24, (void *)2);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001280, 25, (void *)3);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001203, 32, (void *)4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Lookup a burst larger than the internal batch size */
+    for ( i = 0; i < 300; i++ ) {
+        addrs[i] = 0x1c001200 + (i * 0x1011) % 0x400 - 0x100;
+    }
+    addrs[0] = 0x1c001203;
+    addrs[1] = 0x0a000001;
+    poptrie_lookup_batch(poptrie, addrs, nexthops, 300);
+    for ( i = 0; i < 300; i++ ) {
+        if ( nexthops[i] != poptrie_lookup(poptrie, addrs[i]) ) {
+            return -1;
+        }
+    }
+    if ( (void *)4 != nexthops[0] || NULL != nexthops[1] ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_index(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    u32 addrs[300];
+    poptrie_fib_index_t idx[300];
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* No route must be found */
+    if ( 0 != poptrie_lookup_index(poptrie, 0x1c001203) ) {
+        return -1;
+    }
+
+    /* Routes with various prefix lengths */
+    ret = poptrie_route_add(poptrie, 0x1c000000, 8, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001200, 24, (void *)2);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001203, 32, (void *)3);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* The index must point to the FIB entry of the next hop */
+    for ( i = 0; i < 300; i++ ) {
+        addrs[i] = 0x1c001200 + (i * 0x1011) % 0x400 - 0x100;
+    }
+    addrs[0] = 0x1c001203;
+    addrs[1] = 0x0a000001;
+    poptrie_lookup_index_batch(poptrie, addrs, idx, 300);
+    for ( i = 0; i < 300; i++ ) {
+        if ( idx[i] != poptrie_lookup_index(poptrie, addrs[i]) ) {
+            return -1;
+        }
+        if ( poptrie->fib.entries[idx[i]].entry
+             != poptrie_lookup(poptrie, addrs[i]) ) {
+            return -1;
+        }
+    }
+    if ( (void *)3 != poptrie->fib.entries[idx[0]].entry || 0 != idx[1] ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_simd(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    u32 addrs[300];
+    void *nexthops[300];
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Routes with various prefix lengths */
+    for ( i = 0; i < 64; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x1c000000 + ((u32)i << 10),
+                                22 + i % 11, (void *)(u64)(i % 5 + 1));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    ret = poptrie_route_add(poptrie, 0x1c000000, 8, (void *)100);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    for ( i = 0; i < 300; i++ ) {
+        addrs[i] = 0x1c000000 + (u32)i * 0x3a7;
+    }
+    addrs[0] = 0x0a000001;
+    poptrie_lookup_simd(poptrie, addrs, nexthops, 300);
+    for ( i = 0; i < 300; i++ ) {
+        if ( nexthops[i] != poptrie_lookup(poptrie, addrs[i]) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_amac(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_amac amac;
+    int ret;
+    int i;
+    u32 addrs[300];
+    void *nexthops[300];
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    if ( NULL == poptrie_amac_init(&amac, poptrie, 8) ) {
+        return -1;
+    }
+
+    /* Routes with various prefix lengths */
+    ret = poptrie_route_add(poptrie, 0x1c000000, 8, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001200, 24, (void *)2);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001203, 32, (void *)3);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Mix of direct pointing hits and deep descents */
+    for ( i = 0; i < 300; i++ ) {
+        if ( i % 3 ) {
+            addrs[i] = 0x1c001200 + (i & 0x7);
+        } else {
+            addrs[i] = 0x0a000000 + (i << 20);
+        }
+    }
+    poptrie_amac_lookup(&amac, addrs, nexthops, 300);
+    for ( i = 0; i < 300; i++ ) {
+        if ( nexthops[i] != poptrie_lookup(poptrie, addrs[i]) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_amac_release(&amac);
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_fib(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    poptrie_fib_index_t idx;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Distinct next hops beyond the initial size of the FIB mapping table */
+    idx = 0;
+    for ( i = 1; i < POPTRIE_INIT_FIB_SIZE * 4; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a000000 + (i << 8), 24,
+                                (void *)(u64)i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        if ( 1 == i ) {
+            idx = poptrie_lookup_index(poptrie, 0x0a000101);
+        }
+    }
+    if ( poptrie->fib.sz < POPTRIE_INIT_FIB_SIZE * 4
+         || idx != poptrie_lookup_index(poptrie, 0x0a000101) ) {
+        return -1;
+    }
+    for ( i = 1; i < POPTRIE_INIT_FIB_SIZE * 4; i++ ) {
+        if ( (void *)(u64)i
+             != poptrie_lookup(poptrie, 0x0a000001 + (i << 8)) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Up to the width of the leaves */
+    for ( ; i < 0x10000; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a000000 + (i << 8), 24,
+                                (void *)(u64)i);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    ret = poptrie_route_add(poptrie, 0x0b000000, 24, (void *)(u64)i);
+#ifdef POPTRIE_FIB32
+    if ( ret < 0 || (void *)(u64)i != poptrie_lookup(poptrie, 0x0b000001)
+         || poptrie_lookup_index(poptrie, 0x0b000001) <= 0xffff ) {
+        return -1;
+    }
+    ret = poptrie_route_del(poptrie, 0x0b000000, 24);
+    if ( ret < 0 ) {
+        return -1;
+    }
+#else
+    if ( ret >= 0 || NULL != poptrie_lookup(poptrie, 0x0b000001) ) {
+        return -1;
+    }
+#endif
+    TEST_PROGRESS();
+
+    /* The same next hop shares the index */
+    idx = poptrie_lookup_index(poptrie, 0x0a000101);
+    ret = poptrie_route_add(poptrie, 0x0b000000, 24, (void *)1);
+    if ( ret < 0 || idx != poptrie_lookup_index(poptrie, 0x0b000001) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* A deleted next hop frees its slot for a new one, and the indices of the
+       others are kept */
+    idx = poptrie_lookup_index(poptrie, 0x0a000301);
+    ret = poptrie_route_del(poptrie, 0x0a000200, 24);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x0c000000, 24, (void *)0x10001);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    if ( (void *)0x10001 != poptrie_lookup(poptrie, 0x0c000001)
+         || NULL != poptrie_lookup(poptrie, 0x0a000201)
+         || idx != poptrie_lookup_index(poptrie, 0x0a000301) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_route_batch(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *ref;
+    struct poptrie_route_op ops[2000];
+    int ret;
+    int i;
+    u32 addr;
+    poptrie_fib_index_t idx;
+
+    /* Initialize the one updated by batches and the reference */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ref = poptrie_init(NULL, 19, 22);
+    if ( NULL == ref ) {
+        return -1;
+    }
+
+    /* Many routes under the same entries of the direct pointing, and a route
+       shorter than the direct pointing */
+    for ( i = 0; i < 2000; i++ ) {
+        ops[i].type = POPTRIE_ROUTE_ADD;
+        ops[i].prefix = 0x0a000000 + ((u32)(i % 500) << 8)
+            + ((u32)i << 24 >> 4);
+        ops[i].len = 24 + (i & 3) * 2;
+        ops[i].nexthop = (void *)(u64)(1 + (i % 7));
+    }
+    ops[1000].prefix = 0x0a000000;
+    ops[1000].len = 12;
+    for ( i = 0; i < 2000; i++ ) {
+        ret = poptrie_route_add(ref, ops[i].prefix, ops[i].len,
+                                ops[i].nexthop);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    ret = poptrie_route_batch(poptrie, ops, 2000);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Mixed operations including failing ones */
+    for ( i = 0; i < 2000; i++ ) {
+        ops[i].type = POPTRIE_ROUTE_ADD + (i & 3);
+        ops[i].nexthop = (void *)(u64)(8 + (i % 5));
+    }
+    ops[1].prefix = 0x0b000000;
+    ops[2].prefix = 0x0b000000;
+    ops[3].prefix = 0x0b000000;
+    ops[4].type = 0;
+    for ( i = 0; i < 2000; i++ ) {
+        switch ( ops[i].type ) {
+        case POPTRIE_ROUTE_ADD:
+            poptrie_route_add(ref, ops[i].prefix, ops[i].len, ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_CHANGE:
+            poptrie_route_change(ref, ops[i].prefix, ops[i].len,
+                                 ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_UPDATE:
+            poptrie_route_update(ref, ops[i].prefix, ops[i].len,
+                                 ops[i].nexthop);
+            break;
+        case POPTRIE_ROUTE_DEL:
+            poptrie_route_del(ref, ops[i].prefix, ops[i].len);
+            break;
+        }
+    }
+    /* 499 adds of the existing routes, a change and a deletion of the
+       nonexistent routes, and the unknown type fail */
+    ret = poptrie_route_batch(poptrie, ops, 2000);
+    if ( 502 != ret ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x100000; i++ ) {
+        addr = 0x0a000000 + (u32)i * 0x13;
+        if ( poptrie_lookup(poptrie, addr) != poptrie_lookup(ref, addr)
+             || poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* The index of a next hop released in a batch is not reused by the
+       batch */
+    ret = poptrie_route_add(poptrie, 0x0c000000, 24, (void *)100);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    idx = poptrie_lookup_index(poptrie, 0x0c000001);
+    ops[0].type = POPTRIE_ROUTE_DEL;
+    ops[0].prefix = 0x0c000000;
+    ops[0].len = 24;
+    ops[1].type = POPTRIE_ROUTE_ADD;
+    ops[1].prefix = 0x0d000000;
+    ops[1].len = 24;
+    ops[1].nexthop = (void *)101;
+    ret = poptrie_route_batch(poptrie, ops, 2);
+    if ( 0 != ret || idx == poptrie_lookup_index(poptrie, 0x0d000001)
+         || NULL != poptrie_lookup(poptrie, 0x0c000001)
+         || 0 != poptrie->fib.entries[idx].refs ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+    poptrie_release(ref);
+
+    return 0;
+}
+
+static int
+test_build(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *ref;
+    static struct poptrie_prefix prefixes[10000];
+    struct poptrie_prefix tmp;
+    int ret;
+    int i;
+    u32 addr;
+
+    /* Routes sorted by the prefix, including a default route */
+    prefixes[0].prefix = 0;
+    prefixes[0].len = 0;
+    prefixes[0].nexthop = (void *)1;
+    for ( i = 1; i < 10000; i++ ) {
+        prefixes[i].len = 16 + (i % 17);
+        prefixes[i].prefix = (0x0a000000 + ((u32)i << 12))
+            >> (32 - prefixes[i].len) << (32 - prefixes[i].len);
+        prefixes[i].nexthop = (void *)(u64)(2 + (i % 100));
+    }
+
+    /* Initialize the one built at once and the reference */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ref = poptrie_init(NULL, 19, 22);
+    if ( NULL == ref ) {
+        return -1;
+    }
+    for ( i = 0; i < 10000; i++ ) {
+        ret = poptrie_route_add(ref, prefixes[i].prefix, prefixes[i].len,
+                                prefixes[i].nexthop);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    ret = poptrie_build(poptrie, prefixes, 10000);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr) != poptrie_lookup(ref, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Incremental updates after the build */
+    for ( i = 1; i < 10000; i += 3 ) {
+        ret = poptrie_route_del(poptrie, prefixes[i].prefix, prefixes[i].len);
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_del(ref, prefixes[i].prefix, prefixes[i].len);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr) != poptrie_lookup(ref, addr)
+             || poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Not to a poptrie with routes */
+    ret = poptrie_build(poptrie, prefixes, 1);
+    if ( ret >= 0 ) {
+        return -1;
+    }
+    poptrie_release(poptrie);
+    poptrie_release(ref);
+
+    /* Unsorted routes */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    for ( i = 0; i < 5000; i++ ) {
+        tmp = prefixes[i];
+        prefixes[i] = prefixes[9999 - i];
+        prefixes[9999 - i] = tmp;
+    }
+    ret = poptrie_build(poptrie, prefixes, 10000);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    poptrie_release(poptrie);
+    TEST_PROGRESS();
+
+    /* Duplicate prefixes */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    prefixes[1] = prefixes[2];
+    ret = poptrie_build(poptrie, prefixes, 3);
+    if ( ret >= 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_build_parallel(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *ref;
+    struct poptrie_params params;
+    static struct poptrie_prefix prefixes[100000];
+    int ret;
+    int i;
+    u32 addr;
+
+    /* Routes sorted by the prefix, including the short ones covering the
+       chunks of the direct pointing */
+    prefixes[0].prefix = 0;
+    prefixes[0].len = 0;
+    prefixes[0].nexthop = (void *)1;
+    prefixes[1].prefix = 0x0a000000;
+    prefixes[1].len = 7;
+    prefixes[1].nexthop = (void *)2;
+    for ( i = 2; i < 100000; i++ ) {
+        prefixes[i].len = 16 + (i % 17);
+        prefixes[i].prefix = (0x0a000000 + ((u32)i << 12))
+            >> (32 - prefixes[i].len) << (32 - prefixes[i].len);
+        prefixes[i].nexthop = (void *)(u64)(3 + (i % 100));
+    }
+
+    /* Built sequentially, and with the threads starting from small arrays so
+       that the threads run out of their parts and the arrays grow */
+    memset(&params, 0, sizeof(params));
+    params.sz1_max = 22;
+    params.sz0_max = 24;
+    ref = poptrie_init2(NULL, 12, 14, &params);
+    if ( NULL == ref ) {
+        return -1;
+    }
+    poptrie = poptrie_init2(NULL, 12, 14, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_build(ref, prefixes, 100000);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_build2(poptrie, prefixes, 100000, 4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr) != poptrie_lookup(ref, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Incremental updates after the build */
+    for ( i = 2; i < 100000; i += 3 ) {
+        ret = poptrie_route_del(poptrie, prefixes[i].prefix, prefixes[i].len);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    /* With the arrays large enough for the parts */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_build2(poptrie, prefixes, 100000, 4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(poptrie, addr) != poptrie_lookup(ref, addr) ) {
+            return -1;
+        }
+    }
+    poptrie_release(poptrie);
+    TEST_PROGRESS();
+
+    /* With more threads than the parts split from tiny arrays */
+    poptrie = poptrie_init(NULL, 6, 6);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_build2(poptrie, prefixes, 400, 128);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x100000; i++ ) {
+        addr = 0x09000000 + (u32)i * 37;
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    poptrie_release(poptrie);
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(ref);
+
+    return 0;
+}
+
+static void
+grow_watermark(struct poptrie *poptrie, int region, int used, int max,
+               void *arg)
+{
+    (void)poptrie;
+    (void)used;
+    (void)max;
+    ((int *)arg)[region]++;
+}
+
+static int
+test_grow(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    int ret;
+    int i;
+    int hit[2];
+    poptrie_node_t *nodes;
+    poptrie_leaf_t *leaves;
+    u32 prefix;
+
+    /* Initialize with small arrays */
+    memset(&params, 0, sizeof(params));
+    params.sz1_max = 19;
+    params.sz0_max = 22;
+    poptrie = poptrie_init2(NULL, 8, 8, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    nodes = poptrie->nodes;
+    leaves = poptrie->leaves;
+    hit[0] = 0;
+    hit[1] = 0;
+    poptrie_set_watermark(poptrie, 1, grow_watermark, hit);
+
+    /* The arrays grow in place */
+    for ( i = 0; i < 20000; i++ ) {
+        prefix = 0x0a000000 + ((u32)i << 10);
+        ret = poptrie_route_add(poptrie, prefix, 22 + (i & 7),
+                                (void *)(u64)(1 + (i % 100)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    if ( poptrie->nodesz <= 8 || poptrie->leafsz <= 8
+         || nodes != poptrie->nodes || leaves != poptrie->leaves ) {
+        return -1;
+    }
+    if ( 1 != hit[POPTRIE_REGION_NODES] || 1 != hit[POPTRIE_REGION_LEAVES] ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    for ( i = 0; i < 20000 * 4; i++ ) {
+        prefix = 0x0a000000 + ((u32)i << 8) + 3;
+        if ( poptrie_lookup(poptrie, prefix)
+             != poptrie_rib_lookup(poptrie, prefix) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Not beyond the maximum */
+    i = poptrie->nodesz;
+    while ( 0 == poptrie_grow(poptrie, POPTRIE_REGION_NODES) ) {
+        i++;
+    }
+    if ( 19 != i || 19 != poptrie->nodesz ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_qsbr(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    struct poptrie_reader *r[2];
+    int ret;
+    int i;
+    u32 addr;
+
+    /* Readers are not available without the reclamation */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    if ( NULL != poptrie_reader_register(poptrie) ) {
+        return -1;
+    }
+    poptrie_release(poptrie);
+
+    /* Initialize with the reclamation */
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_QSBR;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    r[0] = poptrie_reader_register(poptrie);
+    r[1] = poptrie_reader_register(poptrie);
+    if ( NULL == r[0] || NULL == r[1] ) {
+        return -1;
+    }
+
+    /* The blocks are kept while the readers have not passed */
+    for ( i = 0; i < 1000; i++ ) {
+        ret = poptrie_route_update(poptrie, 0x0a000000 + ((u32)i << 10),
+                                   22 + (i & 7), (void *)(u64)(1 + (i % 10)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    if ( poptrie_reclaim(poptrie) <= 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Still kept until all the readers pass */
+    poptrie_quiescent(r[0]);
+    if ( poptrie_reclaim(poptrie) <= 0 ) {
+        return -1;
+    }
+    poptrie_quiescent(r[1]);
+    if ( 0 != poptrie_reclaim(poptrie) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Offline and unregistered readers do not block the reclamation */
+    poptrie_reader_offline(r[0]);
+    poptrie_reader_unregister(r[1]);
+    for ( i = 0; i < 1000; i++ ) {
+        ret = poptrie_route_del(poptrie, 0x0a000000 + ((u32)i << 10),
+                                22 + (i & 7));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    if ( 0 != poptrie_reclaim(poptrie) ) {
+        return -1;
+    }
+    poptrie_reader_online(r[0]);
+    TEST_PROGRESS();
+
+    /* Lookup */
+    for ( i = 0; i < 1000; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0a000000 + ((u32)i << 12),
+                                20 + (i & 7), (void *)(u64)(1 + (i % 10)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+        if ( 0 == (i & 15) ) {
+            poptrie_quiescent(r[0]);
+        }
+    }
+    for ( i = 0; i < 1000 * 8; i++ ) {
+        addr = 0x0a000000 + ((u32)i << 9) + 1;
+        if ( poptrie_lookup(poptrie, addr)
+             != poptrie_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_reader_unregister(r[0]);
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_lookup_replica(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    int ret;
+    int i;
+    int j;
+    u32 addr;
+
+    /* Initialize with the replicas */
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_REPLICATE;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    if ( poptrie->nreplicas < 1
+         || poptrie->nreplicas != poptrie_numa_nodes() ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Updates both above and under the direct pointing */
+    ret = poptrie_route_add(poptrie, 0x1c000000, 8, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001200, 24, (void *)2);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x1c001203, 32, (void *)3);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_change(poptrie, 0x1c001200, 24, (void *)4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_del(poptrie, 0x1c001203, 32);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* All the replicas must return the same as the primary */
+    for ( i = 0; i < 0x400; i++ ) {
+        addr = 0x1c001000 + i;
+        for ( j = 0; j < poptrie->nreplicas; j++ ) {
+            if ( poptrie_replica_lookup(poptrie, j, addr)
+                 != poptrie_lookup(poptrie, addr) ) {
+                return -1;
+            }
+        }
+        if ( poptrie_lookup_local(poptrie, addr)
+             != poptrie_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    if ( (void *)4 != poptrie_lookup_local(poptrie, 0x1c001203)
+         || (void *)1 != poptrie_lookup_local(poptrie, 0x1c002000) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static u64
+snapshot_save_id(void *nexthop, void *arg)
+{
+    return (u64)nexthop + *(u64 *)arg;
+}
+
+static void *
+snapshot_load_nexthop(u64 id, void *arg)
+{
+    return (void *)(id - *(u64 *)arg);
+}
+
+static int
+test_snapshot(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *loaded;
+    FILE *fp;
+    int ret;
+    int i;
+    u64 base;
+    u32 prefix[10000];
+    u32 addr;
+    u8 c;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0, 0, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 10000; i++ ) {
+        prefix[i] = (0x0a000000 + ((u32)i << 12)) >> (16 - (i % 17))
+            << (16 - (i % 17));
+        ret = poptrie_route_add(poptrie, prefix[i], 16 + (i % 17),
+                                (void *)(u64)(2 + (i % 100)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    /* Leave the free blocks in the buddy systems */
+    for ( i = 0; i < 10000; i += 3 ) {
+        ret = poptrie_route_del(poptrie, prefix[i], 16 + (i % 17));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Save, and load it with the next hops converted to the IDs and back */
+    fp = tmpfile();
+    if ( NULL == fp ) {
+        return -1;
+    }
+    base = 1000;
+    ret = poptrie_save(poptrie, fileno(fp), snapshot_save_id, &base);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    lseek(fileno(fp), 0, SEEK_SET);
+    loaded = poptrie_load(NULL, fileno(fp), NULL, snapshot_load_nexthop,
+                          &base);
+    if ( NULL == loaded ) {
+        return -1;
+    }
+    if ( 0 != memcmp(loaded->dir, poptrie->dir, sizeof(u32) << poptrie->s) ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(loaded, addr) != poptrie_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Incremental updates after the load */
+    for ( i = 1; i < 10000; i += 3 ) {
+        ret = poptrie_route_del(poptrie, prefix[i], 16 + (i % 17));
+        if ( ret < 0 ) {
+            return -1;
+        }
+        ret = poptrie_route_del(loaded, prefix[i], 16 + (i % 17));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    ret = poptrie_route_add(loaded, 0x0b000000, 8, (void *)200);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x0b000000, 8, (void *)200);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        addr = 0x09000000 + (u32)i * 3;
+        if ( poptrie_lookup(loaded, addr) != poptrie_lookup(poptrie, addr)
+             || poptrie_lookup(loaded, addr)
+             != poptrie_rib_lookup(loaded, addr) ) {
+            return -1;
+        }
+    }
+    poptrie_release(loaded);
+    TEST_PROGRESS();
+
+    /* A corrupted snapshot must be rejected */
+    lseek(fileno(fp), 4096, SEEK_SET);
+    if ( 1 != read(fileno(fp), &c, 1) ) {
+        return -1;
+    }
+    c ^= 0x10;
+    lseek(fileno(fp), 4096, SEEK_SET);
+    if ( 1 != write(fileno(fp), &c, 1) ) {
+        return -1;
+    }
+    lseek(fileno(fp), 0, SEEK_SET);
+    loaded = poptrie_load(NULL, fileno(fp), NULL, snapshot_load_nexthop,
+                          &base);
+    if ( NULL != loaded ) {
+        return -1;
+    }
+    fclose(fp);
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_map(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_map *map;
+    struct poptrie_map *old;
+    FILE *fp;
+    FILE *fp2;
+    int ret;
+    int i;
+    u64 base;
+    u32 addrs[256];
+    void *nexthops[256];
+    void *nexthop;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0, 0, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 10000; i++ ) {
+        ret = poptrie_route_add(poptrie,
+                                (0x0a000000 + ((u32)i << 12))
+                                >> (16 - (i % 17)) << (16 - (i % 17)),
+                                16 + (i % 17), (void *)(u64)(2 + (i % 100)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Write the image with the IDs of the next hops, and map it */
+    fp = tmpfile();
+    if ( NULL == fp ) {
+        return -1;
+    }
+    base = 1000;
+    ret = poptrie_save_image(poptrie, fileno(fp), snapshot_save_id, &base);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    map = poptrie_map(fileno(fp));
+    if ( NULL == map ) {
+        return -1;
+    }
+    for ( i = 0; i < 0x1000000; i++ ) {
+        nexthop = poptrie_lookup(poptrie, 0x09000000 + (u32)i * 3);
+        if ( poptrie_lookup(&map->poptrie, 0x09000000 + (u32)i * 3)
+             != (void *)((u64)nexthop + base) ) {
+            return -1;
+        }
+    }
+    for ( i = 0; i < 256; i++ ) {
+        addrs[i] = 0x0a000000 + (u32)i * 0x10101;
+    }
+    poptrie_lookup_batch(&map->poptrie, addrs, nexthops, 256);
+    for ( i = 0; i < 256; i++ ) {
+        if ( nexthops[i] != poptrie_lookup(&map->poptrie, addrs[i])
+             || nexthops[i] != map->poptrie.fib.entries[
+                 poptrie_lookup_index(&map->poptrie, addrs[i])].entry ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Replace it with a new image */
+    ret = poptrie_route_add(poptrie, 0x0d000000, 8, (void *)200);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    fp2 = tmpfile();
+    if ( NULL == fp2 ) {
+        return -1;
+    }
+    ret = poptrie_save_image(poptrie, fileno(fp2), snapshot_save_id, &base);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_remap(&map, fileno(fp2), &old);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    if ( (void *)1001 != poptrie_lookup(&old->poptrie, 0x0d000001)
+         || (void *)1200 != poptrie_lookup(&map->poptrie, 0x0d000001) ) {
+        return -1;
+    }
+    poptrie_unmap(old);
+    poptrie_unmap(map);
+    fclose(fp2);
+    TEST_PROGRESS();
+
+    /* A truncated image must be rejected */
+    ret = ftruncate(fileno(fp), 8192);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    map = poptrie_map(fileno(fp));
+    if ( NULL != map ) {
+        return -1;
+    }
+    fclose(fp);
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+shm_check(struct poptrie *poptrie, struct poptrie_shm_reader *reader)
+{
+    int i;
+    u32 addr;
+
+    for ( i = 0; i < 0x100000; i++ ) {
+        addr = 0x09000000 + (u32)i * 37;
+        if ( poptrie_lookup(&reader->poptrie, addr)
+             != poptrie_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+test_shm(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    struct poptrie_shm_reader *reader;
+    char name[64];
+    pid_t pid;
+    int status;
+    int ret;
+    int i;
+
+    /* The reclamation is required */
+    snprintf(name, sizeof(name), "/poptrie_test_%d", (int)getpid());
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    if ( 0 == poptrie_shm_create(poptrie, name, 4) ) {
+        return -1;
+    }
+    poptrie_release(poptrie);
+
+    /* Initialize with the reclamation, and create the segment */
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_QSBR;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0, 0, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie_shm_create(poptrie, name, 4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    reader = poptrie_shm_attach(name);
+    if ( NULL == reader ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* The updates by the writer are seen by the reader */
+    for ( i = 0; i < 10000; i++ ) {
+        ret = poptrie_route_add(poptrie,
+                                (0x0a000000 + ((u32)i << 12))
+                                >> (16 - (i % 17)) << (16 - (i % 17)),
+                                16 + (i % 17), (void *)(u64)(2 + (i % 100)));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    if ( 0 != shm_check(poptrie, reader) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* The blocks are kept until the reader passes */
+    for ( i = 0; i < 10000; i += 2 ) {
+        ret = poptrie_route_del(poptrie,
+                                (0x0a000000 + ((u32)i << 12))
+                                >> (16 - (i % 17)) << (16 - (i % 17)),
+                                16 + (i % 17));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    if ( poptrie_reclaim(poptrie) <= 0 ) {
+        return -1;
+    }
+    poptrie_shm_quiescent(reader);
+    if ( 0 != poptrie_reclaim(poptrie) ) {
+        return -1;
+    }
+    if ( 0 != shm_check(poptrie, reader) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Another process attaches, and exits without detaching */
+    poptrie_shm_offline(reader);
+    pid = fork();
+    if ( pid < 0 ) {
+        return -1;
+    }
+    if ( 0 == pid ) {
+        reader = poptrie_shm_attach(name);
+        if ( NULL == reader || 0 != shm_check(poptrie, reader) ) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    if ( pid != waitpid(pid, &status, 0) || !WIFEXITED(status)
+         || 0 != WEXITSTATUS(status) ) {
+        return -1;
+    }
+    ret = poptrie_route_add(poptrie, 0x0d000000, 8, (void *)200);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    if ( 0 != poptrie_reclaim(poptrie) ) {
+        return -1;
+    }
+    poptrie_shm_online(reader);
+    if ( (void *)200 != poptrie_lookup(&reader->poptrie, 0x0d000001) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release; the reader keeps the mapping after the writer releases */
+    poptrie_release(poptrie);
+    if ( (void *)200 != poptrie_lookup(&reader->poptrie, 0x0d000001) ) {
+        return -1;
+    }
+    poptrie_shm_detach(reader);
+    if ( NULL != poptrie_shm_attach(name) ) {
+        return -1;
+    }
+
+    return 0;
+}
+
 static int
 test_lookup_linx(void)
 {
@@ -378,8 +2262,29 @@ main(int argc, const char *const argv[])
 
     /* Run tests */
     TEST_FUNC("init", test_init, ret);
+    TEST_FUNC("init_backing", test_init_backing, ret);
     TEST_FUNC("lookup", test_lookup, ret);
     TEST_FUNC("lookup2", test_lookup2, ret);
+    TEST_FUNC("update_triangle", test_update_triangle, ret);
+    TEST_FUNC("lookup_s", test_lookup_s, ret);
+    TEST_FUNC("lookup_short", test_lookup_short, ret);
+    TEST_FUNC("rib", test_rib, ret);
+    TEST_FUNC("rib_lazy", test_rib_lazy, ret);
+    TEST_FUNC("rib_compact", test_rib_compact, ret);
+    TEST_FUNC("lookup_batch", test_lookup_batch, ret);
+    TEST_FUNC("lookup_index", test_lookup_index, ret);
+    TEST_FUNC("lookup_simd", test_lookup_simd, ret);
+    TEST_FUNC("lookup_amac", test_lookup_amac, ret);
+    TEST_FUNC("lookup_replica", test_lookup_replica, ret);
+    TEST_FUNC("fib", test_fib, ret);
+    TEST_FUNC("route_batch", test_route_batch, ret);
+    TEST_FUNC("build", test_build, ret);
+    TEST_FUNC("build_parallel", test_build_parallel, ret);
+    TEST_FUNC("grow", test_grow, ret);
+    TEST_FUNC("qsbr", test_qsbr, ret);
+    TEST_FUNC("snapshot", test_snapshot, ret);
+    TEST_FUNC("map", test_map, ret);
+    TEST_FUNC("shm", test_shm, ret);
     TEST_FUNC("lookup_fullroute", test_lookup_linx, ret);
     TEST_FUNC("lookup_fullroute_update", test_lookup_linx_update, ret);
 
@@ -7,9 +7,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <pthread.h>
 
 
 /* Macro for testing */
@@ -142,6 +144,365 @@ test_lookup(void)
     return 0;
 }
 
+static int
+test_lookup_batch(void)
+{
+    struct poptrie *poptrie;
+    int ret;
+    int i;
+    __uint128_t addr;
+    __uint128_t addrs[100];
+    void *nexthops[100];
+    poptrie_fib_index_t idx[100];
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Routes with various prefix lengths */
+    addr = IPV6ADDR(0x2001, 0xdb8, 0, 0, 0, 0, 0, 0);
+    ret = poptrie6_route_add(poptrie, addr, 32, (void *)1);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    addr = IPV6ADDR(0x2001, 0xdb8, 0x1, 0, 0, 0, 0, 0);
+    ret = poptrie6_route_add(poptrie, addr, 48, (void *)2);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    addr = IPV6ADDR(0x2001, 0xdb8, 0x1, 0x3, 0, 0, 0, 0);
+    ret = poptrie6_route_add(poptrie, addr, 64, (void *)3);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Lookup a burst larger than the internal batch size */
+    for ( i = 0; i < 100; i++ ) {
+        addrs[i] = IPV6ADDR(0x2001, 0xdb8, i % 3, i % 5, 0, 0, 0, i);
+    }
+    addrs[0] = IPV6ADDR(0x2001, 0xdb9, 0, 0, 0, 0, 0, 1);
+    poptrie6_lookup_batch(poptrie, addrs, nexthops, 100);
+    poptrie6_lookup_index_batch(poptrie, addrs, idx, 100);
+    for ( i = 0; i < 100; i++ ) {
+        if ( nexthops[i] != poptrie6_lookup(poptrie, addrs[i]) ) {
+            return -1;
+        }
+        if ( idx[i] != poptrie6_lookup_index(poptrie, addrs[i]) ) {
+            return -1;
+        }
+        if ( poptrie->fib.entries[idx[i]].entry != nexthops[i] ) {
+            return -1;
+        }
+    }
+    if ( NULL != nexthops[0] || 0 != idx[0] || (void *)3 != nexthops[13] ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_route_batch(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie6_route_op ops[1000];
+    int ret;
+    int i;
+    __uint128_t addr;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Routes under the same entries of the direct pointing */
+    for ( i = 0; i < 1000; i++ ) {
+        ops[i].type = POPTRIE_ROUTE_ADD;
+        ops[i].prefix = IPV6ADDR(0x2001, 0xdb8, i, i % 300, 0, 0, 0, 0);
+        ops[i].len = 48 + (i % 3) * 8;
+        ops[i].nexthop = (void *)(u64)(1 + (i % 7));
+    }
+    ops[0].prefix = IPV6ADDR(0x2001, 0, 0, 0, 0, 0, 0, 0);
+    ops[0].len = 16;
+    ret = poptrie6_route_batch(poptrie, ops, 1000);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Delete a half */
+    for ( i = 0; i < 1000; i++ ) {
+        ops[i].type = (i & 1) ? POPTRIE_ROUTE_DEL : POPTRIE_ROUTE_UPDATE;
+        ops[i].nexthop = (void *)(u64)(8 + (i % 5));
+    }
+    ret = poptrie6_route_batch(poptrie, ops, 1000);
+    if ( 0 != ret ) {
+        return -1;
+    }
+    for ( i = 0; i < 100000; i++ ) {
+        addr = IPV6ADDR(0x2001, 0xdb8, i % 1000, i % 300, 0, 0, 0, i);
+        if ( poptrie6_lookup(poptrie, addr)
+             != poptrie6_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+/*
+ * Update the routes nested down to /128 on a thread with a small stack
+ */
+static void *
+_update_deep(void *arg)
+{
+    struct poptrie *poptrie;
+    __uint128_t prefix;
+    __uint128_t addr;
+    int len;
+    int i;
+
+    poptrie = arg;
+    prefix = IPV6ADDR(0x2001, 0xdb8, 0x1234, 0x5678, 0x9abc, 0xdef0, 0x1357,
+                      0x9bdf);
+    /* Propagate a short route down to /128 */
+    if ( 0 != poptrie6_route_add(poptrie, prefix, 128, (void *)(u64)1)
+         || 0 != poptrie6_route_add(poptrie, prefix >> 112 << 112, 16,
+                                    (void *)(u64)2)
+         || 0 != poptrie6_route_del(poptrie, prefix >> 112 << 112, 16)
+         || 0 != poptrie6_route_del(poptrie, prefix, 128) ) {
+        return (void *)-1;
+    }
+    /* Add the nested routes in a shuffled order */
+    for ( i = 0; i < 128; i++ ) {
+        len = 128 - ((i * 37) & 127);
+        if ( 0 != poptrie6_route_add(poptrie, prefix >> (128 - len)
+                                     << (128 - len), len,
+                                     (void *)(u64)(1 + (len % 5))) ) {
+            return (void *)-1;
+        }
+    }
+    /* Delete every other route, and update the rest */
+    for ( len = 1; len <= 128; len++ ) {
+        addr = prefix >> (128 - len) << (128 - len);
+        if ( len & 1 ) {
+            i = poptrie6_route_del(poptrie, addr, len);
+        } else {
+            i = poptrie6_route_update(poptrie, addr, len,
+                                      (void *)(u64)(6 + (len % 3)));
+        }
+        if ( 0 != i ) {
+            return (void *)-1;
+        }
+    }
+    for ( i = 0; i < 128; i++ ) {
+        addr = prefix ^ ((__uint128_t)1 << i);
+        if ( poptrie6_lookup(poptrie, addr)
+             != poptrie6_rib_lookup(poptrie, addr) ) {
+            return (void *)-1;
+        }
+    }
+
+    return NULL;
+}
+static int
+test_update_deep(void)
+{
+    struct poptrie *poptrie;
+    pthread_attr_t attr;
+    pthread_t th;
+    void *ret;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* The update neither recurses along the radix tree nor allocates the
+       working buffers on the stack */
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    if ( 0 != pthread_create(&th, &attr, _update_deep, poptrie) ) {
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_join(th, &ret);
+    pthread_attr_destroy(&attr);
+    if ( NULL != ret ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_build(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *ref;
+    struct poptrie6_prefix prefixes[1000];
+    int ret;
+    int i;
+    __uint128_t addr;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+
+    /* Routes sorted by the prefix */
+    for ( i = 0; i < 1000; i++ ) {
+        prefixes[i].prefix = IPV6ADDR(0x2001, (0xdb8 + (i >> 8)),
+                                      (i & 0xff) << 8, 0, 0, 0, 0, 0);
+        prefixes[i].len = 40 + (i % 9);
+        prefixes[i].nexthop = (void *)(u64)(1 + (i % 7));
+    }
+    prefixes[0].prefix = IPV6ADDR(0x2001, 0, 0, 0, 0, 0, 0, 0);
+    prefixes[0].len = 16;
+    ret = poptrie6_build(poptrie, prefixes, 1000);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 100000; i++ ) {
+        addr = IPV6ADDR(0x2001, (0xdb8 + (i % 5)), (i * 7) & 0xffff, i,
+                        0, 0, 0, i);
+        if ( poptrie6_lookup(poptrie, addr)
+             != poptrie6_rib_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    addr = IPV6ADDR(0x2001, 0xdc0, 0, 0, 0, 0, 0, 1);
+    if ( (void *)1 != poptrie6_lookup(poptrie, addr) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* With the threads */
+    ref = poptrie;
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    ret = poptrie6_build2(poptrie, prefixes, 1000, 4);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 100000; i++ ) {
+        addr = IPV6ADDR(0x2001, (0xdb8 + (i % 5)), (i * 7) & 0xffff, i,
+                        0, 0, 0, i);
+        if ( poptrie6_lookup(poptrie, addr) != poptrie6_lookup(ref, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+    poptrie_release(ref);
+
+    return 0;
+}
+
+static int
+test_snapshot(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie *loaded;
+    struct poptrie_params params;
+    FILE *fp;
+    int ret;
+    int i;
+    __uint128_t addr;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    for ( i = 0; i < 1000; i++ ) {
+        addr = IPV6ADDR(0x2001, 0xdb8, i, 0, 0, 0, 0, 0);
+        ret = poptrie6_route_add(poptrie, addr, 48, (void *)(u64)(1 + i % 7));
+        if ( ret < 0 ) {
+            return -1;
+        }
+        addr = IPV6ADDR(0x2001, 0xdb8, i, 0, 0, 0, 0, i);
+        ret = poptrie6_route_add(poptrie, addr, 128, (void *)(u64)(8 + i % 5));
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+
+    /* Save, and load it to the one with the replicas */
+    fp = tmpfile();
+    if ( NULL == fp ) {
+        return -1;
+    }
+    ret = poptrie_save(poptrie, fileno(fp), NULL, NULL);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    lseek(fileno(fp), 0, SEEK_SET);
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_REPLICATE;
+    loaded = poptrie_load(NULL, fileno(fp), &params, NULL, NULL);
+    if ( NULL == loaded ) {
+        return -1;
+    }
+    fclose(fp);
+    for ( i = 0; i < 100000; i++ ) {
+        addr = IPV6ADDR(0x2001, 0xdb8, i % 1024, 0, 0, 0, 0, i % 1024);
+        if ( poptrie6_lookup(loaded, addr) != poptrie6_lookup(poptrie, addr)
+             || poptrie6_lookup_local(loaded, addr)
+             != poptrie6_lookup(poptrie, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Routes under the loaded ones */
+    addr = IPV6ADDR(0x2001, 0xdb8, 1, 0, 0, 0, 0, 0);
+    ret = poptrie6_route_del(loaded, addr, 48);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    ret = poptrie6_route_add(loaded, addr, 64, (void *)100);
+    if ( ret < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 100000; i++ ) {
+        addr = IPV6ADDR(0x2001, 0xdb8, 1, i % 3, 0, 0, 0, i);
+        if ( poptrie6_lookup(loaded, addr)
+             != poptrie6_rib_lookup(loaded, addr) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(loaded);
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
 static int
 test_lookup_linx(void)
 {
@@ -239,6 +600,11 @@ main(int argc, const char *const argv[])
     /* Run tests */
     TEST_FUNC("init6", test_init, ret);
     TEST_FUNC("lookup6", test_lookup, ret);
+    TEST_FUNC("lookup6_batch", test_lookup_batch, ret);
+    TEST_FUNC("route6_batch", test_route_batch, ret);
+    TEST_FUNC("update6_deep", test_update_deep, ret);
+    TEST_FUNC("build6", test_build, ret);
+    TEST_FUNC("snapshot6", test_snapshot, ret);
     TEST_FUNC("lookup6_fullroute", test_lookup_linx, ret);
 
     return ret;
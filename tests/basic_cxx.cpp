@@ -0,0 +1,299 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "../poptrie.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+/* Macro for testing */
+#define TEST_FUNC(str, func, ret)                \
+    do {                                         \
+        printf("%s: ", str);                     \
+        if ( 0 == func() ) {                     \
+            printf("passed");                    \
+        } else {                                 \
+            printf("failed");                    \
+            ret = -1;                            \
+        }                                        \
+        printf("\n");                            \
+    } while ( 0 )
+
+#define TEST_PROGRESS()                              \
+    do {                                             \
+        printf(".");                                 \
+        fflush(stdout);                              \
+    } while ( 0 )
+
+/* The number of the routes with distinct next hops added during the bursts,
+   which grows the FIB mapping table twice */
+#define TEST_FIB_NROUTES        (POPTRIE_INIT_FIB_SIZE * 3)
+
+/*
+ * Reader looking up the routes being added in bursts
+ */
+struct fib_reader {
+    Poptrie<u32> *poptrie;
+    struct poptrie_reader *r;
+    u32 addrs[TEST_FIB_NROUTES];
+    void *out[TEST_FIB_NROUTES];
+    volatile int done;
+    int nbursts;
+    int err;
+};
+
+/*
+ * Compare the inline lookup with the one in libpoptrie
+ */
+template <int S>
+static int
+test_lookup4(void)
+{
+    Poptrie<u32, S> poptrie;
+    u32 addrs[256];
+    void *nexthops[256];
+    int i;
+
+    /* Routes shorter and longer than the direct pointing */
+    if ( poptrie.route_add(0x1c000000, 8, (void *)1) < 0
+         || poptrie.route_add(0x1c001200, 24, (void *)2) < 0
+         || poptrie.route_add(0x1c001280, 25, (void *)3) < 0
+         || poptrie.route_add(0x1c001203, 32, (void *)4) < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 256; i++ ) {
+        addrs[i] = 0x1c001200 + (i * 0x1011) % 0x400 - 0x100;
+    }
+    addrs[0] = 0x1c001203;
+    addrs[1] = 0x0a000001;
+
+    poptrie.lookup(addrs, nexthops, 256);
+    for ( i = 0; i < 256; i++ ) {
+        if ( nexthops[i] != poptrie_lookup(poptrie.get(), addrs[i])
+             || nexthops[i] != poptrie.lookup(addrs[i])
+             || poptrie.lookup_index(addrs[i])
+             != poptrie_lookup_index(poptrie.get(), addrs[i]) ) {
+            return -1;
+        }
+    }
+    if ( (void *)4 != nexthops[0] || NULL != nexthops[1] ) {
+        return -1;
+    }
+
+    return 0;
+}
+static int
+test_lookup(void)
+{
+    if ( test_lookup4<16>() < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+    if ( test_lookup4<18>() < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+    if ( test_lookup4<22>() < 0 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    return 0;
+}
+
+static int
+test_lookup6(void)
+{
+    Poptrie<__uint128_t, 20> poptrie;
+    __uint128_t prefix;
+    __uint128_t addr;
+    int i;
+
+    prefix = (__uint128_t)0x20010db8 << 96;
+    if ( poptrie.route_add(prefix, 32, (void *)1) < 0
+         || poptrie.route_add(prefix | ((__uint128_t)1 << 80), 48,
+                              (void *)2) < 0
+         || poptrie.route_add(prefix | ((__uint128_t)0x10003 << 64), 64,
+                              (void *)3) < 0 ) {
+        return -1;
+    }
+    for ( i = 0; i < 100; i++ ) {
+        addr = prefix | ((__uint128_t)(i % 3) << 80)
+            | ((__uint128_t)(i % 5) << 64) | (__uint128_t)i;
+        if ( poptrie.lookup(addr) != poptrie6_lookup(poptrie.get(), addr) ) {
+            return -1;
+        }
+    }
+    if ( (void *)3 != poptrie.lookup(prefix | ((__uint128_t)0x10003 << 64)) ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    return 0;
+}
+
+/*
+ * Look up the routes in bursts until the writer finishes; each address is
+ * either not routed yet or routed to its own next hop
+ */
+static void *
+_fib_reader(void *arg)
+{
+    struct fib_reader *fr;
+    int i;
+
+    fr = (struct fib_reader *)arg;
+    while ( !fr->done ) {
+        fr->poptrie->lookup(fr->addrs, fr->out, TEST_FIB_NROUTES);
+        for ( i = 0; i < TEST_FIB_NROUTES; i++ ) {
+            if ( NULL != fr->out[i] && (void *)(u64)(i + 1) != fr->out[i] ) {
+                fr->err = -1;
+            }
+        }
+        poptrie_quiescent(fr->r);
+        fr->nbursts++;
+    }
+
+    return NULL;
+}
+
+/*
+ * Grow the FIB mapping table in the middle of the bursts
+ */
+static int
+test_fib_grow(void)
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    struct fib_reader *fr;
+    pthread_t th;
+    int ret;
+    int i;
+
+    /* Initialize with the reclamation for the reader */
+    memset(&params, 0, sizeof(params));
+    params.flags = POPTRIE_QSBR;
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    fr = (struct fib_reader *)calloc(1, sizeof(struct fib_reader));
+    if ( NULL == fr ) {
+        return -1;
+    }
+    fr->poptrie = new Poptrie<u32>(poptrie);
+    fr->r = poptrie_reader_register(poptrie);
+    if ( NULL == fr->r ) {
+        return -1;
+    }
+    for ( i = 0; i < TEST_FIB_NROUTES; i++ ) {
+        fr->addrs[i] = 0x0b000000 + ((u32)i << 8) + 1;
+    }
+    if ( 0 != pthread_create(&th, NULL, _fib_reader, fr) ) {
+        return -1;
+    }
+
+    /* Add the routes while the reader is running */
+    ret = 0;
+    for ( i = 0; i < TEST_FIB_NROUTES && 0 == ret; i++ ) {
+        ret = poptrie_route_add(poptrie, 0x0b000000 + ((u32)i << 8), 24,
+                                (void *)(u64)(i + 1));
+        if ( 0 == (i & 255) ) {
+            poptrie_reclaim(poptrie);
+        }
+    }
+    while ( 0 == fr->nbursts ) {
+        sched_yield();
+    }
+    fr->done = 1;
+    pthread_join(th, NULL);
+    if ( 0 != ret || 0 != fr->err
+         || poptrie->fib.sz < POPTRIE_INIT_FIB_SIZE * 4 ) {
+        return -1;
+    }
+    TEST_PROGRESS();
+
+    /* All the routes are found */
+    fr->poptrie->lookup(fr->addrs, fr->out, TEST_FIB_NROUTES);
+    for ( i = 0; i < TEST_FIB_NROUTES; i++ ) {
+        if ( (void *)(u64)(i + 1) != fr->out[i] ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_reader_unregister(fr->r);
+    delete fr->poptrie;
+    free(fr);
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+static int
+test_wrap(void)
+{
+    struct poptrie *poptrie;
+
+    /* Initialize */
+    poptrie = poptrie_init(NULL, 19, 22);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    if ( poptrie_route_add(poptrie, 0x1c000000, 8, (void *)1) < 0 ) {
+        return -1;
+    }
+
+    /* The width of the direct pointing must match */
+    try {
+        Poptrie<u32, 20> p(poptrie);
+        return -1;
+    } catch ( std::invalid_argument & ) {
+    }
+    {
+        Poptrie<u32> p(poptrie);
+        if ( (void *)1 != p.lookup(0x1c010203) ) {
+            return -1;
+        }
+    }
+    TEST_PROGRESS();
+
+    /* Release */
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+/*
+ * Main routine for the C++ wrapper test
+ */
+int
+main(int argc, const char *const argv[])
+{
+    int ret;
+
+    ret = 0;
+
+    /* Run tests */
+    TEST_FUNC("lookup_cxx", test_lookup, ret);
+    TEST_FUNC("lookup6_cxx", test_lookup6, ret);
+    TEST_FUNC("wrap_cxx", test_wrap, ret);
+    TEST_FUNC("fib_grow_cxx", test_fib_grow, ret);
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */
@@ -0,0 +1,731 @@
+/*_
+ * Copyright (c) 2017 Hirochika Asai <asai@jar.jp>
+ * All rights reserved.
+ */
+
+#include "../poptrie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* The number of addresses looked up in each benchmark */
+#define BENCH_NADDRS    (1 << 22)
+/* The number of random routes when no RIB file is specified */
+#define BENCH_NROUTES   500000
+/* The size of a burst for the batched lookups */
+#define BENCH_BURST     256
+/* The number of in-flight lookups for the asynchronous lookup */
+#define BENCH_AMAC      16
+/* The number of the short routes changed back and forth, and the longest
+   prefix length of them */
+#define BENCH_NCHURN    1000
+#define BENCH_CHURNLEN  16
+/* The number of the rounds replaying the update file */
+#define BENCH_SOAK      10
+
+/* Lookup function for a burst of addresses */
+typedef int (*bench_lookup_f)(struct poptrie *, const u32 *, void **, int);
+
+static u64 xorshift_state = 88172645463325252ULL;
+static struct poptrie_amac amac;
+static int replica_node;
+
+/* Routes to be loaded */
+static struct poptrie_prefix *routes;
+static int nroutes;
+static int routesz;
+
+/* Route updates to be replayed */
+static struct poptrie_route_op *updates;
+static int nupdates;
+static int updatesz;
+
+/*
+ * Xorshift random number generator
+ */
+static u64
+xorshift64(void)
+{
+    xorshift_state ^= xorshift_state << 13;
+    xorshift_state ^= xorshift_state >> 7;
+    xorshift_state ^= xorshift_state << 17;
+
+    return xorshift_state;
+}
+
+/*
+ * Get the current time in seconds
+ */
+static double
+gettime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Append a route to the list
+ */
+static int
+append_route(u32 prefix, int len, void *nexthop)
+{
+    struct poptrie_prefix *r;
+
+    if ( nroutes >= routesz ) {
+        r = realloc(routes, sizeof(struct poptrie_prefix)
+                    * (routesz ? routesz * 2 : 4096));
+        if ( NULL == r ) {
+            return -1;
+        }
+        routes = r;
+        routesz = routesz ? routesz * 2 : 4096;
+    }
+    routes[nroutes].prefix = prefix;
+    routes[nroutes].len = len;
+    routes[nroutes].nexthop = nexthop;
+    nroutes++;
+
+    return 0;
+}
+
+/*
+ * Compare routes by the prefix and the length
+ */
+static int
+cmp_route(const void *a, const void *b)
+{
+    const struct poptrie_prefix *x;
+    const struct poptrie_prefix *y;
+
+    x = a;
+    y = b;
+    if ( x->prefix != y->prefix ) {
+        return x->prefix < y->prefix ? -1 : 1;
+    }
+
+    return x->len - y->len;
+}
+
+/*
+ * Sort the routes, and remove the duplicate prefixes
+ */
+static void
+sort_routes(void)
+{
+    int i;
+    int n;
+
+    qsort(routes, nroutes, sizeof(struct poptrie_prefix), cmp_route);
+    n = 0;
+    for ( i = 0; i < nroutes; i++ ) {
+        if ( n > 0 && routes[n - 1].prefix == routes[i].prefix
+             && routes[n - 1].len == routes[i].len ) {
+            continue;
+        }
+        routes[n++] = routes[i];
+    }
+    nroutes = n;
+}
+
+/*
+ * Load routes from a file in the format of tests/linx-rib.*.txt
+ */
+static int
+load_rib(const char *fname)
+{
+    FILE *fp;
+    char buf[4096];
+    int prefix[4];
+    int prefixlen;
+    int nexthop[4];
+    int ret;
+    u32 addr1;
+    u32 addr2;
+
+    fp = fopen(fname, "r");
+    if ( NULL == fp ) {
+        return -1;
+    }
+    while ( fgets(buf, sizeof(buf), fp) ) {
+        ret = sscanf(buf, "%d.%d.%d.%d/%d %d.%d.%d.%d", &prefix[0], &prefix[1],
+                     &prefix[2], &prefix[3], &prefixlen, &nexthop[0],
+                     &nexthop[1], &nexthop[2], &nexthop[3]);
+        if ( 9 != ret ) {
+            continue;
+        }
+        addr1 = ((u32)prefix[0] << 24) + ((u32)prefix[1] << 16)
+            + ((u32)prefix[2] << 8) + (u32)prefix[3];
+        addr2 = ((u32)nexthop[0] << 24) + ((u32)nexthop[1] << 16)
+            + ((u32)nexthop[2] << 8) + (u32)nexthop[3];
+        if ( append_route(addr1, prefixlen, (void *)(u64)addr2) < 0 ) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * Load route updates from a file in the format of tests/linx-update.*.txt
+ */
+static int
+load_updates(const char *fname)
+{
+    struct poptrie_route_op *u;
+    FILE *fp;
+    char buf[4096];
+    int tm;
+    char type;
+    int prefix[4];
+    int prefixlen;
+    int nexthop[4];
+    int ret;
+
+    fp = fopen(fname, "r");
+    if ( NULL == fp ) {
+        return -1;
+    }
+    while ( fgets(buf, sizeof(buf), fp) ) {
+        ret = sscanf(buf, "%d %c %d.%d.%d.%d/%d %d.%d.%d.%d", &tm, &type,
+                     &prefix[0], &prefix[1], &prefix[2], &prefix[3],
+                     &prefixlen, &nexthop[0], &nexthop[1], &nexthop[2],
+                     &nexthop[3]);
+        if ( 11 != ret || ('a' != type && 'w' != type) ) {
+            continue;
+        }
+        if ( nupdates >= updatesz ) {
+            u = realloc(updates, sizeof(struct poptrie_route_op)
+                        * (updatesz ? updatesz * 2 : 4096));
+            if ( NULL == u ) {
+                fclose(fp);
+                return -1;
+            }
+            updates = u;
+            updatesz = updatesz ? updatesz * 2 : 4096;
+        }
+        u = &updates[nupdates];
+        u->type = 'a' == type ? POPTRIE_ROUTE_UPDATE : POPTRIE_ROUTE_DEL;
+        u->prefix = ((u32)prefix[0] << 24) + ((u32)prefix[1] << 16)
+            + ((u32)prefix[2] << 8) + (u32)prefix[3];
+        u->len = prefixlen;
+        u->nexthop = (void *)(u64)(((u32)nexthop[0] << 24)
+                                   + ((u32)nexthop[1] << 16)
+                                   + ((u32)nexthop[2] << 8)
+                                   + (u32)nexthop[3]);
+        nupdates++;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * Generate random routes roughly following the prefix length distribution of
+ * the global routing table
+ */
+static int
+random_rib(int nr)
+{
+    int i;
+    int len;
+    int r;
+    u32 prefix;
+
+    for ( i = 0; i < nr; i++ ) {
+        r = xorshift64() % 100;
+        if ( r < 55 ) {
+            len = 24;
+        } else if ( r < 90 ) {
+            len = 16 + xorshift64() % 8;
+        } else if ( r < 97 ) {
+            len = 8 + xorshift64() % 8;
+        } else {
+            len = 25 + xorshift64() % 8;
+        }
+        prefix = (u32)xorshift64() >> (32 - len) << (32 - len);
+        if ( append_route(prefix, len,
+                          (void *)(u64)(1 + xorshift64() % 256)) < 0 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Scalar lookups with the same interface as the batched ones
+ */
+static int
+lookup_scalar(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        out[i] = poptrie_lookup(poptrie, addrs[i]);
+    }
+
+    return 0;
+}
+static int
+lookup_batch(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    poptrie_lookup_batch(poptrie, addrs, out, n);
+
+    return 0;
+}
+static int
+lookup_index(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    int i;
+    poptrie_fib_index_t idx[BENCH_BURST];
+
+    /* Resolve the indices with the FIB table as a dataplane would do with its
+       own adjacency array */
+    poptrie_lookup_index_batch(poptrie, addrs, idx, n);
+    for ( i = 0; i < n; i++ ) {
+        out[i] = POPTRIE_FIB_ENTRIES(poptrie)[idx[i]].entry;
+    }
+
+    return 0;
+}
+static int
+lookup_amac(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    /* The ring is bound to the poptrie at the initialization */
+    (void)poptrie;
+    poptrie_amac_lookup(&amac, addrs, out, n);
+
+    return 0;
+}
+static int
+lookup_local(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        out[i] = poptrie_lookup_local(poptrie, addrs[i]);
+    }
+
+    return 0;
+}
+static int
+lookup_replica(struct poptrie *poptrie, const u32 *addrs, void **out, int n)
+{
+    int i;
+
+    for ( i = 0; i < n; i++ ) {
+        out[i] = poptrie_replica_lookup(poptrie, replica_node, addrs[i]);
+    }
+
+    return 0;
+}
+
+/*
+ * Run a lookup benchmark and compare the results with the reference
+ */
+static void
+bench_lookup(const char *name, bench_lookup_f func, struct poptrie *poptrie,
+             const u32 *addrs, void **out, void *const *ref)
+{
+    int i;
+    double t0;
+    double t1;
+
+    t0 = gettime();
+    for ( i = 0; i < BENCH_NADDRS; i += BENCH_BURST ) {
+        if ( func(poptrie, addrs + i, out + i, BENCH_BURST) < 0 ) {
+            printf("%-8s: not supported\n", name);
+            return;
+        }
+    }
+    t1 = gettime();
+
+    if ( NULL != ref && 0 != memcmp(out, ref, sizeof(void *) * BENCH_NADDRS) ) {
+        printf("%-8s: result mismatch\n", name);
+        return;
+    }
+    printf("%-8s: %.3f Mlps\n", name, BENCH_NADDRS / (t1 - t0) / 1000000);
+}
+
+/*
+ * Print the backing of the memory regions
+ */
+static void
+print_backing(struct poptrie *poptrie)
+{
+    static const char *regions[] = {
+        "nodes", "leaves", "dir", "cnodes", "cleaves"
+    };
+    static const char *types[] = { "malloc", "mmap", "thp", "hugetlb" };
+    int backing;
+    int i;
+
+    for ( i = 0; i < (int)(sizeof(regions) / sizeof(regions[0])); i++ ) {
+        backing = poptrie_backing(poptrie, i);
+        printf("%-8s: %s%s%s\n", regions[i],
+               types[backing & POPTRIE_BACKING_MASK],
+               (backing & POPTRIE_BACKING_PREFAULTED) ? ", prefaulted" : "",
+               (backing & POPTRIE_BACKING_LOCKED) ? ", locked" : "");
+    }
+}
+
+/*
+ * Run the lookup benchmark on the replica of each NUMA node from the current
+ * CPU to compare the local and remote memory accesses
+ */
+static void
+bench_replicas(struct poptrie *poptrie, const u32 *addrs, void **out,
+               void *const *ref)
+{
+    char name[32];
+    int local;
+
+    local = poptrie_local_node();
+    printf("cpu node: %d (%d replicas)\n", local, poptrie->nreplicas);
+    bench_lookup("local", lookup_local, poptrie, addrs, out, ref);
+    for ( replica_node = 0; replica_node < poptrie->nreplicas;
+          replica_node++ ) {
+        snprintf(name, sizeof(name), "node%d%s", replica_node,
+                 replica_node == local ? "*" : "");
+        bench_lookup(name, lookup_replica, poptrie, addrs, out, ref);
+    }
+}
+
+/*
+ * Measure the time to save the poptrie to a snapshot and to restore it, which
+ * is compared to the load of the routes
+ */
+static int
+bench_snapshot(struct poptrie *poptrie, const struct poptrie_params *params)
+{
+    struct poptrie *loaded;
+    FILE *fp;
+    double t0;
+    double t1;
+    double t2;
+    off_t sz;
+    int ret;
+
+    fp = tmpfile();
+    if ( NULL == fp ) {
+        return -1;
+    }
+    t0 = gettime();
+    ret = poptrie_save(poptrie, fileno(fp), NULL, NULL);
+    if ( ret < 0 ) {
+        fclose(fp);
+        return -1;
+    }
+    t1 = gettime();
+    sz = lseek(fileno(fp), 0, SEEK_CUR);
+    lseek(fileno(fp), 0, SEEK_SET);
+    loaded = poptrie_load(NULL, fileno(fp), params, NULL, NULL);
+    t2 = gettime();
+    fclose(fp);
+    if ( NULL == loaded ) {
+        return -1;
+    }
+    if ( 0 != memcmp(loaded->dir, poptrie->dir, sizeof(u32) << poptrie->s) ) {
+        fprintf(stderr, "Snapshot mismatch\n");
+        poptrie_release(loaded);
+        return -1;
+    }
+    printf("save    : %.3f sec (%.1f MB)\n", t1 - t0,
+           (double)sz / (1 << 20));
+    printf("restore : %.3f sec\n", t2 - t1);
+    poptrie_release(loaded);
+
+    return 0;
+}
+
+/*
+ * Measure the latency of the updates changing the next hops of the short
+ * routes, each of which covers a large part of the RIB, back and forth
+ */
+static int
+bench_update(struct poptrie *poptrie)
+{
+    double t0;
+    double t1;
+    double sum;
+    double max;
+    int n;
+    int i;
+    int j;
+
+    sum = 0;
+    max = 0;
+    n = 0;
+    for ( i = 0; i < nroutes && n < BENCH_NCHURN * 2; i++ ) {
+        if ( routes[i].len > BENCH_CHURNLEN ) {
+            continue;
+        }
+        for ( j = 0; j < 2; j++ ) {
+            t0 = gettime();
+            if ( 0 != poptrie_route_change(poptrie, routes[i].prefix,
+                                           routes[i].len,
+                                           j ? routes[i].nexthop
+                                           : (void *)(u64)-1) ) {
+                return -1;
+            }
+            t1 = gettime();
+            sum += t1 - t0;
+            if ( t1 - t0 > max ) {
+                max = t1 - t0;
+            }
+            n++;
+        }
+    }
+    if ( n > 0 ) {
+        printf("update  : %d changes of /%d or shorter, %.2f usec/op "
+               "(max %.2f usec)\n", n, BENCH_CHURNLEN, sum * 1e6 / n,
+               max * 1e6);
+    }
+
+    return 0;
+}
+
+/*
+ * Replay the route updates in rounds, and report the number of the RIB nodes
+ * and the update latency of each round, then compact the RIB
+ */
+static int
+bench_soak(struct poptrie *poptrie)
+{
+    double t0;
+    double t1;
+    int nodes;
+    int ret;
+    int r;
+    int i;
+
+    for ( r = 0; r < BENCH_SOAK; r++ ) {
+        t0 = gettime();
+        for ( i = 0; i < nupdates; i++ ) {
+            /* The withdrawals of unknown routes fail */
+            if ( POPTRIE_ROUTE_DEL == updates[i].type ) {
+                (void)poptrie_route_del(poptrie, updates[i].prefix,
+                                        updates[i].len);
+            } else {
+                (void)poptrie_route_update(poptrie, updates[i].prefix,
+                                           updates[i].len,
+                                           updates[i].nexthop);
+            }
+        }
+        t1 = gettime();
+        printf("soak    : round %d, %d RIB nodes, %.2f usec/update\n", r,
+               poptrie_rib_nodes(poptrie), (t1 - t0) * 1e6 / nupdates);
+    }
+    nodes = poptrie_rib_nodes(poptrie);
+    t0 = gettime();
+    ret = poptrie_rib_compact(poptrie);
+    t1 = gettime();
+    if ( ret < 0 ) {
+        return -1;
+    }
+    printf("compact : %d -> %d RIB nodes, %.6f sec\n", nodes,
+           poptrie_rib_nodes(poptrie), t1 - t0);
+
+    return 0;
+}
+
+/*
+ * Measure the time to map a read-only image of the poptrie, and the lookups on
+ * the mapped image
+ */
+static int
+bench_image(struct poptrie *poptrie, const u32 *addrs, void **out,
+            void *const *ref)
+{
+    struct poptrie_map *map;
+    FILE *fp;
+    double t0;
+    double t1;
+    int ret;
+
+    fp = tmpfile();
+    if ( NULL == fp ) {
+        return -1;
+    }
+    ret = poptrie_save_image(poptrie, fileno(fp), NULL, NULL);
+    if ( ret < 0 ) {
+        fclose(fp);
+        return -1;
+    }
+    t0 = gettime();
+    map = poptrie_map(fileno(fp));
+    t1 = gettime();
+    if ( NULL == map ) {
+        fclose(fp);
+        return -1;
+    }
+    printf("map     : %.6f sec\n", t1 - t0);
+    bench_lookup("mapped", lookup_batch, &map->poptrie, addrs, out, ref);
+    poptrie_unmap(map);
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * Main routine for the benchmark
+ */
+int
+main(int argc, const char *const argv[])
+{
+    struct poptrie *poptrie;
+    struct poptrie_params params;
+    u32 *addrs;
+    void **out;
+    void **ref;
+    double t0;
+    double t1;
+    const char *soak;
+    int build;
+    int ret;
+    int n;
+    int i;
+
+    /* -H for the huge page backing, -N for the NUMA replicas, -B to load the
+       routes with poptrie_build(), -T to build it with the threads, and -S to
+       replay the route updates in the file */
+    build = 0;
+    soak = NULL;
+    memset(&params, 0, sizeof(params));
+    while ( argc > 1 && '-' == argv[1][0] ) {
+        if ( 0 == strcmp(argv[1], "-H") ) {
+            params.flags |= POPTRIE_HUGEPAGE | POPTRIE_PREFAULT
+                | POPTRIE_MLOCK;
+        } else if ( 0 == strcmp(argv[1], "-N") ) {
+            params.flags |= POPTRIE_REPLICATE;
+        } else if ( 0 == strcmp(argv[1], "-B") ) {
+            if ( 0 == build ) {
+                build = 1;
+            }
+        } else if ( 0 == strcmp(argv[1], "-T") && argc > 2
+                    && atoi(argv[2]) > 0 ) {
+            build = atoi(argv[2]);
+            argc--;
+            argv++;
+        } else if ( 0 == strcmp(argv[1], "-S") && argc > 2 ) {
+            soak = argv[2];
+            argc--;
+            argv++;
+        } else {
+            fprintf(stderr, "Usage: %s [-H] [-N] [-B] [-T threads] "
+                    "[-S updates] [rib]\n", argv[0]);
+            return -1;
+        }
+        argc--;
+        argv++;
+    }
+
+    poptrie = poptrie_init2(NULL, 19, 22, &params);
+    if ( NULL == poptrie ) {
+        return -1;
+    }
+    print_backing(poptrie);
+    if ( argc > 1 ) {
+        ret = load_rib(argv[1]);
+        if ( ret < 0 ) {
+            fprintf(stderr, "Cannot open %s\n", argv[1]);
+            return -1;
+        }
+    } else {
+        ret = random_rib(BENCH_NROUTES);
+        if ( ret < 0 ) {
+            return -1;
+        }
+    }
+    sort_routes();
+    t0 = gettime();
+    if ( build ) {
+        ret = poptrie_build2(poptrie, routes, nroutes, build);
+        if ( ret < 0 ) {
+            fprintf(stderr, "Cannot build the poptrie\n");
+            return -1;
+        }
+        n = nroutes;
+    } else {
+        n = 0;
+        for ( i = 0; i < nroutes; i++ ) {
+            if ( 0 == poptrie_route_add(poptrie, routes[i].prefix,
+                                        routes[i].len, routes[i].nexthop) ) {
+                n++;
+            }
+        }
+    }
+    t1 = gettime();
+    printf("routes  : %d\n", n);
+    printf("load    : %.3f sec\n", t1 - t0);
+    if ( bench_snapshot(poptrie, &params) < 0 ) {
+        fprintf(stderr, "Cannot save and restore the poptrie\n");
+        return -1;
+    }
+    if ( bench_update(poptrie) < 0 ) {
+        fprintf(stderr, "Cannot update the routes\n");
+        return -1;
+    }
+    if ( NULL != soak ) {
+        if ( load_updates(soak) < 0 ) {
+            fprintf(stderr, "Cannot open %s\n", soak);
+            return -1;
+        }
+        if ( bench_soak(poptrie) < 0 ) {
+            fprintf(stderr, "Cannot compact the RIB\n");
+            return -1;
+        }
+    }
+
+    addrs = malloc(sizeof(u32) * BENCH_NADDRS);
+    out = malloc(sizeof(void *) * BENCH_NADDRS);
+    ref = malloc(sizeof(void *) * BENCH_NADDRS);
+    if ( NULL == addrs || NULL == out || NULL == ref ) {
+        return -1;
+    }
+    for ( i = 0; i < BENCH_NADDRS; i++ ) {
+        addrs[i] = (u32)xorshift64();
+    }
+
+    bench_lookup("scalar", lookup_scalar, poptrie, addrs, ref, NULL);
+    bench_lookup("batch", lookup_batch, poptrie, addrs, out, ref);
+    bench_lookup("index", lookup_index, poptrie, addrs, out, ref);
+    if ( NULL != poptrie_amac_init(&amac, poptrie, BENCH_AMAC) ) {
+        bench_lookup("amac", lookup_amac, poptrie, addrs, out, ref);
+        poptrie_amac_release(&amac);
+    }
+    bench_lookup("avx2", poptrie_lookup_avx2, poptrie, addrs, out, ref);
+    bench_lookup("avx512", poptrie_lookup_avx512, poptrie, addrs, out, ref);
+    if ( params.flags & POPTRIE_REPLICATE ) {
+        bench_replicas(poptrie, addrs, out, ref);
+    }
+    if ( bench_image(poptrie, addrs, out, ref) < 0 ) {
+        fprintf(stderr, "Cannot map the image\n");
+        return -1;
+    }
+
+    free(addrs);
+    free(out);
+    free(ref);
+    free(routes);
+    free(updates);
+    poptrie_release(poptrie);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: sw=4 ts=4 fdm=marker
+ * vim<600: sw=4 ts=4
+ */